@@ -9,6 +9,47 @@
 #include <getopt.h>
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <strings.h>
+
+/**
+ * Identifiers of the options that only have a long form.
+ */
+enum LongOnlyOption
+{
+    OPT_BATCH_SIZE = 256,
+    OPT_BATCH_BYTES,
+    OPT_PIPELINE,
+    OPT_REBUILD_INDEX,
+    OPT_PRUNE,
+    OPT_SUBSCRIBED,
+    OPT_CONNECTIONS,
+    OPT_MAX_CONNECTIONS,
+    OPT_DAEMON,
+    OPT_IDLE,
+    OPT_COMPRESS,
+    OPT_NO_COMPRESS,
+    OPT_FSYNC,
+    OPT_STORAGE,
+    OPT_DEDUP,
+    OPT_GZIP,
+    OPT_CHUNK_SIZE,
+    OPT_CONNECT_TIMEOUT,
+    OPT_READ_TIMEOUT,
+    OPT_TOTAL_TIMEOUT,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_NO_NODELAY,
+    OPT_KEEPALIVE,
+    OPT_READ_BUFFER,
+    OPT_ORDER,
+    OPT_MAX_SIZE,
+    OPT_SINCE,
+    OPT_BEFORE,
+    OPT_PARTS,
+    OPT_MAX_PART_SIZE,
+};
 
 /**
  * @brief Constructs an ArgumentParser object with provided command-line arguments.
@@ -24,7 +65,183 @@ ArgumentParser::ArgumentParser(int argc, char *argv[]) : argc(argc), argv(argv)
  */
 void ArgumentParser::print_usage()
 {
-    std::cerr << "Usage: " << argv[0] << " server [-p port] [-T [-c certfile] [-C certaddr]] [-n] [-h] -a auth_file [-b MAILBOX] -o out_dir\n";
+    std::cerr << "Usage: " << argv[0] << " server [-p port] [-T [-c certfile] [-C certaddr]] [-n] [-h] -a auth_file [-b MAILBOX]... [--subscribed] -o out_dir\n"
+              << "       [--batch-size uids] [--batch-bytes bytes] [--pipeline depth] [--rebuild-index] [--prune]\n"
+              << "       [--connections n] [--max-connections n] [--idle] [--compress] [--no-compress]\n"
+              << "       [--fsync none|message|batch] [--storage flat|maildir|maildir-hashed|mbox] [--dedup blob_dir] [--gzip]\n"
+              << "       [--chunk-size bytes] [--connect-timeout seconds] [--read-timeout seconds] [--total-timeout seconds]\n"
+              << "       [--rcvbuf bytes] [--sndbuf bytes] [--no-nodelay] [--keepalive seconds] [--read-buffer bytes]\n"
+              << "       [--order uid|newest|smallest|packed] [--max-size bytes] [--since date] [--before date]\n"
+              << "       [--parts types] [--max-part-size bytes]\n"
+              << "       " << argv[0] << " --daemon config_file\n";
+}
+
+/**
+ * @brief Parses the name of an fsync policy.
+ *
+ * @param value The name, one of none, message and batch.
+ * @param policy The parsed policy, unchanged if the name is not valid.
+ * @return true if the name is valid, false otherwise.
+ */
+bool ArgumentParser::parseFsyncPolicy(const std::string &value, FsyncPolicy &policy)
+{
+    if (value == "none")
+    {
+        policy = FsyncPolicy::None;
+    }
+    else if (value == "message")
+    {
+        policy = FsyncPolicy::Message;
+    }
+    else if (value == "batch")
+    {
+        policy = FsyncPolicy::Batch;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses the name of a storage format.
+ *
+ * @param value The name, one of flat, maildir, maildir-hashed and mbox.
+ * @param format The parsed format, unchanged if the name is not valid.
+ * @return true if the name is valid, false otherwise.
+ */
+bool ArgumentParser::parseStorageFormat(const std::string &value, StorageFormat &format)
+{
+    if (value == "flat")
+    {
+        format = StorageFormat::Flat;
+    }
+    else if (value == "maildir")
+    {
+        format = StorageFormat::Maildir;
+    }
+    else if (value == "maildir-hashed")
+    {
+        format = StorageFormat::HashedMaildir;
+    }
+    else if (value == "mbox")
+    {
+        format = StorageFormat::Mbox;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses the name of a fetch order.
+ *
+ * @param value The name, one of uid, newest, smallest and packed.
+ * @param order The parsed order, unchanged if the name is not valid.
+ * @return true if the name is valid, false otherwise.
+ */
+bool ArgumentParser::parseFetchOrder(const std::string &value, FetchOrder &order)
+{
+    if (value == "uid")
+    {
+        order = FetchOrder::Uid;
+    }
+    else if (value == "newest")
+    {
+        order = FetchOrder::Newest;
+    }
+    else if (value == "smallest")
+    {
+        order = FetchOrder::Smallest;
+    }
+    else if (value == "packed")
+    {
+        order = FetchOrder::Packed;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses a date in the IMAP format (e.g. 1-Feb-2024) or the ISO format (2024-02-01).
+ *
+ * @param value The date.
+ * @param date The parsed date as the number yyyymmdd, unchanged if the date is not valid.
+ * @return true if the date is valid, false otherwise.
+ */
+bool ArgumentParser::parseDate(const std::string &value, int &date)
+{
+    static const char *const months[] = {"jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"};
+    int year = 0;
+    int month = 0;
+    int day = 0;
+    char name[4] = {};
+    int length = 0;
+
+    if (sscanf(value.c_str(), "%4d-%2d-%2d%n", &year, &month, &day, &length) != 3 || length != static_cast<int>(value.size()))
+    {
+        month = 0;
+        length = 0;
+        if (sscanf(value.c_str(), "%2d-%3[A-Za-z]-%4d%n", &day, name, &year, &length) != 3 || length != static_cast<int>(value.size()))
+        {
+            return false;
+        }
+
+        for (int i = 0; i < 12 && month == 0; ++i)
+        {
+            if (strcasecmp(name, months[i]) == 0)
+            {
+                month = i + 1;
+            }
+        }
+    }
+
+    static const int days[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (year < 1000 || month < 1 || month > 12 || day < 1 || day > days[month - 1])
+    {
+        return false;
+    }
+    date = year * 10000 + month * 100 + day;
+    return true;
+}
+
+/**
+ * @brief Parses a comma separated list of MIME types, a subtype may be the wildcard *.
+ *
+ * @param value The list, e.g. text/plain,text/html or text with the wildcard subtype.
+ * @param types The parsed types in lowercase, unchanged if the list is not valid.
+ * @return true if the list is valid, false otherwise.
+ */
+bool ArgumentParser::parsePartTypes(const std::string &value, std::vector<std::string> &types)
+{
+    std::vector<std::string> parsed;
+    size_t start = 0;
+    while (start <= value.size())
+    {
+        size_t end = value.find(',', start);
+        std::string type = value.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        size_t slash = type.find('/');
+        if (slash == 0 || slash == std::string::npos || slash + 1 == type.size() || type.find('/', slash + 1) != std::string::npos)
+        {
+            return false;
+        }
+
+        for (char &c : type)
+        {
+            c = tolower(static_cast<unsigned char>(c));
+        }
+        parsed.push_back(type);
+        start = end == std::string::npos ? value.size() + 1 : end + 1;
+    }
+
+    types = parsed;
+    return true;
 }
 
 /**
@@ -56,6 +273,37 @@ ArgumentParser::ParsedArgs ArgumentParser::parse()
         {"authfile", required_argument, nullptr, 'a'},
         {"mailbox", required_argument, nullptr, 'b'},
         {"outdir", required_argument, nullptr, 'o'},
+        {"batch-size", required_argument, nullptr, OPT_BATCH_SIZE},
+        {"batch-bytes", required_argument, nullptr, OPT_BATCH_BYTES},
+        {"pipeline", required_argument, nullptr, OPT_PIPELINE},
+        {"rebuild-index", no_argument, nullptr, OPT_REBUILD_INDEX},
+        {"prune", no_argument, nullptr, OPT_PRUNE},
+        {"subscribed", no_argument, nullptr, OPT_SUBSCRIBED},
+        {"connections", required_argument, nullptr, OPT_CONNECTIONS},
+        {"max-connections", required_argument, nullptr, OPT_MAX_CONNECTIONS},
+        {"daemon", required_argument, nullptr, OPT_DAEMON},
+        {"idle", no_argument, nullptr, OPT_IDLE},
+        {"compress", no_argument, nullptr, OPT_COMPRESS},
+        {"no-compress", no_argument, nullptr, OPT_NO_COMPRESS},
+        {"fsync", required_argument, nullptr, OPT_FSYNC},
+        {"storage", required_argument, nullptr, OPT_STORAGE},
+        {"dedup", required_argument, nullptr, OPT_DEDUP},
+        {"gzip", no_argument, nullptr, OPT_GZIP},
+        {"chunk-size", required_argument, nullptr, OPT_CHUNK_SIZE},
+        {"connect-timeout", required_argument, nullptr, OPT_CONNECT_TIMEOUT},
+        {"read-timeout", required_argument, nullptr, OPT_READ_TIMEOUT},
+        {"total-timeout", required_argument, nullptr, OPT_TOTAL_TIMEOUT},
+        {"rcvbuf", required_argument, nullptr, OPT_RCVBUF},
+        {"sndbuf", required_argument, nullptr, OPT_SNDBUF},
+        {"no-nodelay", no_argument, nullptr, OPT_NO_NODELAY},
+        {"keepalive", required_argument, nullptr, OPT_KEEPALIVE},
+        {"read-buffer", required_argument, nullptr, OPT_READ_BUFFER},
+        {"order", required_argument, nullptr, OPT_ORDER},
+        {"max-size", required_argument, nullptr, OPT_MAX_SIZE},
+        {"since", required_argument, nullptr, OPT_SINCE},
+        {"before", required_argument, nullptr, OPT_BEFORE},
+        {"parts", required_argument, nullptr, OPT_PARTS},
+        {"max-part-size", required_argument, nullptr, OPT_MAX_PART_SIZE},
         {nullptr, 0, nullptr, 0}};
 
     // Process command-line options using getopt_long
@@ -103,17 +351,145 @@ ArgumentParser::ParsedArgs ArgumentParser::parse()
             args.authfile = optarg;
             break;
         case 'b':
-            args.mailbox = optarg;
+            args.mailboxes.push_back(optarg);
             break;
         case 'o':
             args.outdir = optarg;
             break;
+        case OPT_BATCH_SIZE:
+            args.batch_size = std::stoul(optarg);
+            break;
+        case OPT_BATCH_BYTES:
+            args.batch_bytes = std::stoull(optarg);
+            break;
+        case OPT_PIPELINE:
+            args.pipeline_depth = std::stoul(optarg);
+            break;
+        case OPT_REBUILD_INDEX:
+            args.rebuild_index = true;
+            break;
+        case OPT_PRUNE:
+            args.prune_vanished = true;
+            break;
+        case OPT_SUBSCRIBED:
+            args.subscribed = true;
+            break;
+        case OPT_CONNECTIONS:
+            args.connections = std::stoul(optarg);
+            break;
+        case OPT_MAX_CONNECTIONS:
+            args.max_connections = std::stoul(optarg);
+            break;
+        case OPT_DAEMON:
+            args.daemon_config = optarg;
+            break;
+        case OPT_IDLE:
+            args.idle = true;
+            break;
+        case OPT_COMPRESS:
+            args.compress = CompressPolicy::Always;
+            break;
+        case OPT_NO_COMPRESS:
+            args.compress = CompressPolicy::Never;
+            break;
+        case OPT_FSYNC:
+            if (!parseFsyncPolicy(optarg, args.fsync))
+            {
+                std::cerr << "Error: Unknown fsync policy: " << optarg << "\n";
+                print_usage();
+                exit(1);
+            }
+            break;
+        case OPT_STORAGE:
+            if (!parseStorageFormat(optarg, args.storage))
+            {
+                std::cerr << "Error: Unknown storage format: " << optarg << "\n";
+                print_usage();
+                exit(1);
+            }
+            break;
+        case OPT_DEDUP:
+            args.dedup_dir = optarg;
+            break;
+        case OPT_GZIP:
+            args.gzip = true;
+            break;
+        case OPT_CHUNK_SIZE:
+            args.chunk_size = std::stoull(optarg);
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            args.connect_timeout = std::stoi(optarg);
+            break;
+        case OPT_READ_TIMEOUT:
+            args.read_timeout = std::stoi(optarg);
+            break;
+        case OPT_TOTAL_TIMEOUT:
+            args.total_timeout = std::stoi(optarg);
+            break;
+        case OPT_RCVBUF:
+            args.receive_buffer = std::stoi(optarg);
+            break;
+        case OPT_SNDBUF:
+            args.send_buffer = std::stoi(optarg);
+            break;
+        case OPT_NO_NODELAY:
+            args.tcp_nodelay = false;
+            break;
+        case OPT_KEEPALIVE:
+            args.keepalive = std::stoi(optarg);
+            break;
+        case OPT_READ_BUFFER:
+            args.read_buffer = std::stoul(optarg);
+            break;
+        case OPT_ORDER:
+            if (!parseFetchOrder(optarg, args.fetch_order))
+            {
+                std::cerr << "Error: Unknown fetch order: " << optarg << "\n";
+                print_usage();
+                exit(1);
+            }
+            break;
+        case OPT_MAX_SIZE:
+            args.max_size = std::stoull(optarg);
+            break;
+        case OPT_SINCE:
+        case OPT_BEFORE:
+            if (!parseDate(optarg, opt == OPT_SINCE ? args.since : args.before))
+            {
+                std::cerr << "Error: Invalid date: " << optarg << " (expected e.g. 1-Feb-2024 or 2024-02-01)\n";
+                print_usage();
+                exit(1);
+            }
+            break;
+        case OPT_PARTS:
+            if (!parsePartTypes(optarg, args.part_types))
+            {
+                std::cerr << "Error: Invalid MIME types: " << optarg << " (expected e.g. text/plain,text/html or text/*)\n";
+                print_usage();
+                exit(1);
+            }
+            break;
+        case OPT_MAX_PART_SIZE:
+            args.max_part_size = std::stoull(optarg);
+            break;
         default:
             print_usage();
             exit(1);
         }
     }
 
+    // The daemon mode takes the accounts from the config file
+    if (!args.daemon_config.empty())
+    {
+        if (argc != optind)
+        {
+            std::cerr << "Error: The server is given in the config file in the daemon mode.\n";
+            print_usage();
+            exit(1);
+        }
+        return args;
+    }
+
     // The last argument should be the server address
     if ((argc - optind) == 1) // Exactly one positional argument is expected
     {
@@ -133,6 +509,52 @@ ArgumentParser::ParsedArgs ArgumentParser::parse()
         args.port = args.use_tls ? 993 : 143;
     }
 
+    if (args.mailboxes.empty() && !args.subscribed)
+    {
+        args.mailboxes.push_back("INBOX");
+    }
+
+    if ((!args.dedup_dir.empty() || args.gzip) && args.storage == StorageFormat::Mbox)
+    {
+        std::cerr << "Error: Parameters --dedup and --gzip need a file per message, they cannot be used with --storage mbox.\n";
+        print_usage();
+        exit(1);
+    }
+
+    if (!args.part_types.empty() && args.headers_only)
+    {
+        std::cerr << "Error: Parameters --parts and -h cannot be used together.\n";
+        print_usage();
+        exit(1);
+    }
+
+    if (args.batch_size == 0 || args.pipeline_depth == 0 || args.connections == 0 || args.max_connections == 0)
+    {
+        std::cerr << "Error: Parameters --batch-size, --pipeline, --connections and --max-connections must be positive.\n";
+        print_usage();
+        exit(1);
+    }
+
+    if (args.connect_timeout <= 0 || args.read_timeout <= 0 || args.read_buffer < 4096)
+    {
+        std::cerr << "Error: Parameters --connect-timeout and --read-timeout must be positive, --read-buffer at least 4096.\n";
+        print_usage();
+        exit(1);
+    }
+
+    if (args.total_timeout < 0 || args.receive_buffer < 0 || args.send_buffer < 0 || args.keepalive < 0)
+    {
+        std::cerr << "Error: Parameters --total-timeout, --rcvbuf, --sndbuf and --keepalive must not be negative.\n";
+        print_usage();
+        exit(1);
+    }
+
+    if (args.connections > args.max_connections)
+    {
+        std::cerr << "Warning: Limiting --connections to " << args.max_connections << " per server.\n";
+        args.connections = args.max_connections;
+    }
+
     // Mandatory parameters validation
     if (args.authfile.empty() || args.outdir.empty())
     {
@@ -9,6 +9,7 @@
 #define ARGUMENTPARSER_H
 
 #include <string>
+#include <vector>
 
 /**
  * @class ArgumentParser
@@ -17,6 +18,52 @@
 class ArgumentParser
 {
 public:
+    /**
+     * @enum FsyncPolicy
+     * @brief When the downloaded messages are flushed to disk.
+     */
+    enum class FsyncPolicy
+    {
+        None,    /**< Left to the system, a crash may lose messages recorded as downloaded. */
+        Message, /**< Every message before it gets its final name. */
+        Batch,   /**< All messages of a FETCH batch at once, before the batch is recorded. */
+    };
+
+    /**
+     * @enum CompressPolicy
+     * @brief Which connections are compressed with COMPRESS DEFLATE when the server supports it.
+     */
+    enum class CompressPolicy
+    {
+        Never,  /**< No connection. */
+        Tls,    /**< Only TLS connections, plaintext ones write the message literals with splice(). */
+        Always, /**< Every connection, saving bandwidth at the cost of CPU and the splice() path. */
+    };
+
+    /**
+     * @enum StorageFormat
+     * @brief The layout the downloaded messages are stored in.
+     */
+    enum class StorageFormat
+    {
+        Flat,    /**< A file per message directly in the output directory. */
+        Maildir, /**< A Maildir per mailbox. */
+        HashedMaildir, /**< A Maildir-like directory per mailbox, with new/ split into subdirectories by UID. */
+        Mbox,    /**< An mbox file per mailbox. */
+    };
+
+    /**
+     * @enum FetchOrder
+     * @brief The order the missing messages are downloaded in.
+     */
+    enum class FetchOrder
+    {
+        Uid,      /**< By ascending UID, the order the messages arrived in. */
+        Newest,   /**< The most recent messages first, by INTERNALDATE. */
+        Smallest, /**< The smallest messages first, so most of the mailbox is there early. */
+        Packed,   /**< Batches of equal size in bytes, packed from the message sizes. */
+    };
+
     /**
      * @struct ParsedArgs
      * @brief A structure containing parsed command-line arguments.
@@ -31,8 +78,38 @@ public:
         bool new_only = false;                   /**< Whether to download only new messages. Defaults to false. */
         bool headers_only = false;               /**< Whether to download only headers. Defaults to false. */
         std::string authfile;                    /**< Path to the file containing login credentials. */
-        std::string mailbox = "INBOX";           /**< Mailbox to download from. Defaults to INBOX. */
+        std::vector<std::string> mailboxes;      /**< Mailboxes or LIST patterns to download from. Defaults to INBOX. */
+        bool subscribed = false;                 /**< Whether to download from all subscribed mailboxes. Defaults to false. */
         std::string outdir;                      /**< Output directory for the downloaded messages. */
+        size_t batch_size = 500;                 /**< Maximum number of UIDs in one FETCH batch. Defaults to 500. */
+        size_t batch_bytes = 0;                  /**< Maximum estimated size of one FETCH batch in bytes. Defaults to no limit. */
+        size_t chunk_size = 0;                   /**< Bytes of a message fetched at once, larger ones are resumable. 0 for whole messages. */
+        FetchOrder fetch_order = FetchOrder::Uid; /**< The order the messages are downloaded in. Defaults to by UID. */
+        size_t max_size = 0;                     /**< Size in bytes above which messages are skipped. Defaults to no limit. */
+        int since = 0;                           /**< Date (yyyymmdd) before which messages are skipped. Defaults to none. */
+        int before = 0;                          /**< Date (yyyymmdd) from which on messages are skipped. Defaults to none. */
+        std::vector<std::string> part_types;     /**< MIME types (e.g. text/plain) of the parts to download. Empty for whole messages. */
+        size_t max_part_size = 0;                /**< Size in bytes above which parts are skipped. Defaults to no limit. */
+        size_t pipeline_depth = 4;               /**< Number of FETCH batches in flight at once. Defaults to 4. */
+        bool rebuild_index = false;              /**< Whether to rebuild the sync state by scanning out_dir. Defaults to false. */
+        bool prune_vanished = false;             /**< Whether to delete local copies of messages gone from the server. Defaults to false. */
+        size_t connections = 1;                  /**< Number of connections downloading in parallel. Defaults to 1. */
+        size_t max_connections = 10;             /**< Maximum number of connections to one server. Defaults to 10. */
+        CompressPolicy compress = CompressPolicy::Tls; /**< Which connections are compressed. Defaults to the TLS ones. */
+        StorageFormat storage = StorageFormat::Flat; /**< The layout the messages are stored in. */
+        bool gzip = false;                       /**< Whether to store the messages gzip-compressed. Defaults to false. */
+        std::string dedup_dir;                   /**< Blob store shared by identical messages. Empty to keep every copy. */
+        FsyncPolicy fsync = FsyncPolicy::Batch;  /**< When the messages are flushed to disk. Defaults to once per batch. */
+        int connect_timeout = 5;                 /**< Seconds to connect to the server and get its greeting. Defaults to 5. */
+        int read_timeout = 5;                    /**< Seconds the server may stay silent during a command, raised for slow servers. Defaults to 5. */
+        int total_timeout = 0;                   /**< Seconds a synchronization may take. Defaults to no limit. */
+        int receive_buffer = 0;                  /**< SO_RCVBUF of the sockets in bytes. Defaults to the system tuning it. */
+        int send_buffer = 0;                     /**< SO_SNDBUF of the sockets in bytes. Defaults to the system tuning it. */
+        bool tcp_nodelay = true;                 /**< Whether to send commands at once (TCP_NODELAY). Defaults to true. */
+        int keepalive = 60;                      /**< Seconds of silence before TCP keepalive probes, 0 for none. Defaults to 60. */
+        size_t read_buffer = 65536;              /**< Bytes read from a socket at once. Defaults to 64 KiB. */
+        bool idle = false;                       /**< Whether to keep the mailbox in sync with IDLE until interrupted. Defaults to false. */
+        std::string daemon_config;               /**< Config file of the daemon mode. Empty to synchronize once. */
     };
 
     /**
@@ -48,6 +125,46 @@ public:
      */
     ParsedArgs parse();
 
+    /**
+     * @brief Parses the name of an fsync policy.
+     * @param value The name, one of none, message and batch.
+     * @param policy The parsed policy.
+     * @return true if the name is valid, false otherwise.
+     */
+    static bool parseFsyncPolicy(const std::string &value, FsyncPolicy &policy);
+
+    /**
+     * @brief Parses the name of a storage format.
+     * @param value The name, one of flat, maildir, maildir-hashed and mbox.
+     * @param format The parsed format.
+     * @return true if the name is valid, false otherwise.
+     */
+    static bool parseStorageFormat(const std::string &value, StorageFormat &format);
+
+    /**
+     * @brief Parses the name of a fetch order.
+     * @param value The name, one of uid, newest, smallest and packed.
+     * @param order The parsed order.
+     * @return true if the name is valid, false otherwise.
+     */
+    static bool parseFetchOrder(const std::string &value, FetchOrder &order);
+
+    /**
+     * @brief Parses a date in the IMAP format (e.g. 1-Feb-2024) or the ISO format (2024-02-01).
+     * @param value The date.
+     * @param date The parsed date as the number yyyymmdd, so that dates compare as numbers.
+     * @return true if the date is valid, false otherwise.
+     */
+    static bool parseDate(const std::string &value, int &date);
+
+    /**
+     * @brief Parses a comma separated list of MIME types, a subtype may be the wildcard *.
+     * @param value The list, e.g. text/plain,text/html or text with the wildcard subtype.
+     * @param types The parsed types in lowercase.
+     * @return true if the list is valid, false otherwise.
+     */
+    static bool parsePartTypes(const std::string &value, std::vector<std::string> &types);
+
 private:
     int argc;
     char **argv;
@@ -0,0 +1,890 @@
+/**
+ * @file Benchmark.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing the benchmarks of the performance sensitive parts, built by make bench.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "Helpers.cpp"
+#include "IMAPClient.cpp"
+#include "FetchHandler.cpp"
+
+/**
+ * @class BenchServer
+ * @brief A minimal IMAP server on the loopback interface serving one connection in its own thread.
+ *
+ * It answers UID FETCH with the messages of a synthetic corpus, the message of UID n being
+ * the corpus message (n - 1) modulo its size, supports COMPRESS DEFLATE (RFC 4978) and answers
+ * every other command with OK.
+ */
+class BenchServer
+{
+private:
+    const std::vector<std::string> &messages; // The corpus.
+    int listenFd;                             // The listening socket.
+    int port;                                 // The port it listens on.
+    int fd;                                   // The connection.
+    std::string input;                        // Received data not processed yet, decompressed.
+    bool compressing;                         // Whether COMPRESS DEFLATE is active.
+    z_stream deflater;                        // Compresses the data sent.
+    z_stream inflater;                        // Decompresses the data received.
+    std::atomic<uint64_t> wireBytes;          // The number of bytes written to the connection.
+    std::thread thread;                       // The thread serving the connection.
+
+    /**
+     * @brief Write data to the connection as it is.
+     * @exception std::runtime_error if the client closed the connection.
+     */
+    void sendRaw(const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t written = write(fd, data, length);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                throw std::runtime_error("Connection closed by the client");
+            }
+            data += written;
+            length -= written;
+            wireBytes += written;
+        }
+    }
+
+    /**
+     * @brief Write data to the connection, compressed if COMPRESS DEFLATE is active.
+     * @param flush Whether the data must reach the client now, e.g. at the end of a response.
+     */
+    void send(const char *data, size_t length, bool flush = false)
+    {
+        if (!compressing)
+        {
+            sendRaw(data, length);
+            return;
+        }
+
+        char buffer[65536];
+        deflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        deflater.avail_in = static_cast<uInt>(length);
+        do
+        {
+            deflater.next_out = reinterpret_cast<Bytef *>(buffer);
+            deflater.avail_out = sizeof(buffer);
+            deflate(&deflater, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+            sendRaw(buffer, sizeof(buffer) - deflater.avail_out);
+        } while (deflater.avail_out == 0);
+    }
+
+    void send(const std::string &data, bool flush = false)
+    {
+        send(data.data(), data.size(), flush);
+    }
+
+    /**
+     * @brief Read a command line.
+     * @param line The line without the CRLF.
+     * @return true if a line was read, false if the connection was closed.
+     */
+    bool readLine(std::string &line)
+    {
+        size_t end;
+        while ((end = input.find("\r\n")) == std::string::npos)
+        {
+            char buffer[4096];
+            ssize_t count = read(fd, buffer, sizeof(buffer));
+            if (count <= 0)
+            {
+                return false;
+            }
+            if (!compressing)
+            {
+                input.append(buffer, count);
+                continue;
+            }
+
+            char inflated[4096];
+            inflater.next_in = reinterpret_cast<Bytef *>(buffer);
+            inflater.avail_in = static_cast<uInt>(count);
+            do
+            {
+                inflater.next_out = reinterpret_cast<Bytef *>(inflated);
+                inflater.avail_out = sizeof(inflated);
+                inflate(&inflater, Z_SYNC_FLUSH);
+                input.append(inflated, sizeof(inflated) - inflater.avail_out);
+            } while (inflater.avail_out == 0);
+        }
+
+        line = input.substr(0, end);
+        input.erase(0, end + 2);
+        return true;
+    }
+
+    /**
+     * @brief Send the messages of a UID FETCH command, each as one FETCH response with a literal.
+     * @param tag The tag of the command.
+     * @param uids The sequence set of the command.
+     */
+    void fetch(const std::string &tag, const std::string &uids)
+    {
+        size_t sequence = 0;
+        UIDSet set = UIDSet::parse(uids);
+        for (const auto &range : set.getRanges())
+        {
+            for (uint64_t uid = range.first; uid <= range.second; ++uid)
+            {
+                const std::string &message = messages[(uid - 1) % messages.size()];
+                send("* " + std::to_string(++sequence) + " FETCH (UID " + std::to_string(uid) + " BODY[] {" +
+                     std::to_string(message.size()) + "}\r\n");
+                send(message);
+                send(")\r\n");
+            }
+        }
+        send(tag + " OK UID FETCH completed\r\n", true);
+    }
+
+    /**
+     * @brief Serve the connection until LOGOUT or until the client closes it.
+     */
+    void serve()
+    {
+        fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            return;
+        }
+
+        try
+        {
+            send("* OK Benchmark server ready\r\n");
+
+            std::string line;
+            while (readLine(line))
+            {
+                size_t space = line.find(' ');
+                std::string tag = line.substr(0, space);
+                std::string command = space == std::string::npos ? "" : line.substr(space + 1);
+
+                if (command.compare(0, 10, "UID FETCH ") == 0)
+                {
+                    fetch(tag, command.substr(10, command.find(' ', 10) - 10));
+                }
+                else if (command == "CAPABILITY")
+                {
+                    send("* CAPABILITY IMAP4rev1 COMPRESS=DEFLATE\r\n" + tag + " OK CAPABILITY completed\r\n", true);
+                }
+                else if (command == "COMPRESS DEFLATE")
+                {
+                    send(tag + " OK DEFLATE active\r\n", true);
+                    compressing = inflateInit2(&inflater, -15) == Z_OK &&
+                                  deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+                }
+                else if (command == "LOGOUT")
+                {
+                    send("* BYE Logging out\r\n" + tag + " OK LOGOUT completed\r\n", true);
+                    break;
+                }
+                else
+                {
+                    send(tag + " OK Completed\r\n", true);
+                }
+            }
+        }
+        catch (const std::exception &)
+        {
+            // The client went away, the benchmark reports its own failure
+        }
+        close(fd);
+        if (compressing)
+        {
+            inflateEnd(&inflater);
+            deflateEnd(&deflater);
+        }
+    }
+
+public:
+    /**
+     * @brief Constructs a BenchServer listening on an ephemeral port of 127.0.0.1.
+     * @param messages The corpus, must outlive the server.
+     * @exception std::runtime_error if the socket cannot be set up.
+     */
+    BenchServer(const std::vector<std::string> &messages) : messages(messages), port(0), fd(-1), compressing(false), deflater(), inflater(), wireBytes(0)
+    {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr *>(&address), length) < 0 || listen(listenFd, 1) < 0 ||
+            getsockname(listenFd, reinterpret_cast<sockaddr *>(&address), &length) < 0)
+        {
+            throw std::runtime_error("Unable to start the benchmark server");
+        }
+        port = ntohs(address.sin_port);
+        thread = std::thread([this]()
+                             { serve(); });
+    }
+
+    BenchServer(const BenchServer &) = delete;
+    BenchServer &operator=(const BenchServer &) = delete;
+
+    ~BenchServer()
+    {
+        shutdown(listenFd, SHUT_RDWR); // Ends an accept() still waiting for a client
+        thread.join();
+        close(listenFd);
+    }
+
+    /**
+     * @brief Get the port the server listens on.
+     */
+    int getPort() const
+    {
+        return port;
+    }
+
+    /**
+     * @brief Get the number of bytes written to the connection so far.
+     */
+    uint64_t getWireBytes() const
+    {
+        return wireBytes;
+    }
+};
+
+/**
+ * @class Benchmark
+ * @brief A class running benchmarks on synthetic data and printing one line per measurement.
+ *
+ * Every benchmark is a suite selected by its name on the command line, all of them run without
+ * any name. The data is generated from a fixed seed, so the results of two builds are comparable.
+ */
+class Benchmark
+{
+private:
+    /**
+     * @brief The time a piece of work took.
+     */
+    struct Timing
+    {
+        double seconds;    // The wall time.
+        double cpuSeconds; // The CPU time of the calling thread.
+    };
+
+    /**
+     * @brief How the messages are downloaded by download().
+     */
+    struct DownloadOptions
+    {
+        bool splice = true; // Whether literals may be moved to their files without passing through the client.
+        ArgumentParser::FsyncPolicy fsync = ArgumentParser::FsyncPolicy::None; // When the messages are flushed to disk.
+        bool gzip = false;  // Whether the messages are stored gzip-compressed.
+    };
+
+    /**
+     * @brief The outcome of download().
+     */
+    struct DownloadResult
+    {
+        Timing timing;             // The time of the download.
+        int saved = 0;             // The number of messages saved.
+        uint64_t diskBytes = 0;    // The size of the stored files.
+        uint64_t splicedBytes = 0; // The number of literal bytes moved to the files by splice.
+    };
+
+    std::mt19937 random; // The generator of the synthetic data.
+
+    static constexpr unsigned SEED = 2024; // The seed every suite starts from
+
+    /**
+     * @brief Get the CPU time the calling thread used so far, in user and kernel space.
+     * The benchmark server runs in a thread of its own, so this is the CPU time of the client.
+     * @return double The CPU time in seconds.
+     */
+    static double cpuTime()
+    {
+        timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return now.tv_sec + now.tv_nsec / 1e9;
+    }
+
+    /**
+     * @brief Measure a piece of work.
+     * @param work The work.
+     * @param repeat The number of times to run it, the timing is of one run.
+     * @return Timing The time one run took on average.
+     */
+    static Timing measure(const std::function<void()> &work, int repeat = 1)
+    {
+        auto started = std::chrono::steady_clock::now();
+        double cpuStarted = cpuTime();
+        for (int i = 0; i < repeat; ++i)
+        {
+            work();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return {seconds / repeat, (cpuTime() - cpuStarted) / repeat};
+    }
+
+    /**
+     * @brief Print one measurement.
+     * @param suite The name of the suite.
+     * @param name What was measured.
+     * @param value The result with its unit.
+     */
+    static void report(const std::string &suite, const std::string &name, const std::string &value)
+    {
+        std::cout << std::left << std::setw(10) << suite << std::setw(40) << name << value << std::endl;
+    }
+
+    /**
+     * @brief Format a duration.
+     * @param seconds The duration in seconds.
+     * @return std::string The duration in milliseconds.
+     */
+    static std::string milliseconds(double seconds)
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3) << seconds * 1000 << " ms";
+        return out.str();
+    }
+
+    /**
+     * @brief Format a throughput and the CPU time it took.
+     * @param bytes The number of bytes processed.
+     * @param timing The time it took.
+     * @return std::string The throughput in MB/s and the CPU time per GB.
+     */
+    static std::string throughput(uint64_t bytes, const Timing &timing)
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << bytes / 1e6 / timing.seconds << " MB/s, "
+            << std::setprecision(3) << timing.cpuSeconds / (bytes / 1e9) << " s CPU per GB";
+        return out.str();
+    }
+
+    /**
+     * @brief Generate a corpus of messages of 1 KiB to 512 KiB. Every other message has a base64
+     * attachment of random bytes, the text is made of a small vocabulary and has lines looking
+     * like the tagged completion of a command, like a FETCH response and like an mbox separator.
+     *
+     * @param count The number of messages.
+     * @return std::vector<std::string> The messages with CRLF line ends.
+     */
+    std::vector<std::string> generateCorpus(size_t count)
+    {
+        static const char *words[] = {"the", "message", "server", "meeting", "invoice", "please", "attached", "report",
+                                      "tomorrow", "regards", "thanks", "project", "update", "review", "schedule", "mailbox"};
+        static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        std::vector<std::string> corpus;
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t size = static_cast<size_t>(1024 * std::pow(2.0, std::uniform_real_distribution<double>(0, 9)(random)));
+            bool attachment = i % 2 == 1;
+            std::string message = "From: Sender " + std::to_string(i) + " <sender" + std::to_string(i) + "@example.com>\r\n"
+                                  "To: Recipient <recipient@example.com>\r\n"
+                                  "Subject: Benchmark message " + std::to_string(i) + "\r\n"
+                                  "Date: Fri, 15 Nov 2024 10:00:00 +0100\r\n"
+                                  "Message-ID: <" + std::to_string(i) + "@bench.example.com>\r\n"
+                                  "MIME-Version: 1.0\r\n"
+                                  "Content-Type: multipart/mixed; boundary=\"bench\"\r\n\r\n"
+                                  "--bench\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n";
+
+            // A fifth of a message with an attachment is text
+            size_t textEnd = attachment ? message.size() + size / 5 : size;
+            for (size_t line = 0; message.size() < textEnd; ++line)
+            {
+                if (line % 50 == 7)
+                {
+                    message += "A00" + std::to_string(line % 9 + 1) + " OK UID FETCH completed\r\n* " + std::to_string(line) +
+                               " FETCH (UID " + std::to_string(line) + " BODY[] {10}\r\nFrom the server\r\n";
+                }
+                std::string text;
+                while (text.size() < 70)
+                {
+                    text += std::string(text.empty() ? "" : " ") + words[random() % 16];
+                }
+                message += text + "\r\n";
+            }
+
+            if (attachment)
+            {
+                message += "--bench\r\nContent-Type: application/octet-stream\r\nContent-Transfer-Encoding: base64\r\n\r\n";
+                while (message.size() < size)
+                {
+                    for (int column = 0; column < 76; ++column)
+                    {
+                        message += base64[random() % 64];
+                    }
+                    message += "\r\n";
+                }
+            }
+            message += "--bench--\r\n";
+            corpus.push_back(std::move(message));
+        }
+        return corpus;
+    }
+
+    /**
+     * @brief Connect a client to a benchmark server.
+     * @param server The server.
+     * @return std::unique_ptr<IMAPClient> The connected client.
+     * @exception std::runtime_error if the connection failed.
+     */
+    static std::unique_ptr<IMAPClient> connectClient(const BenchServer &server)
+    {
+        auto client = std::make_unique<IMAPClient>(false);
+        IMAPClient::ConnectionOptions options;
+        options.readTimeout = 60;
+        if (!client->connect("127.0.0.1", server.getPort(), "", "", options))
+        {
+            throw std::runtime_error("Unable to connect to the benchmark server");
+        }
+        return client;
+    }
+
+    /**
+     * @brief Get the number of messages of a corpus whose total size reaches a given size.
+     * @param corpus The corpus, served repeatedly.
+     * @param bytes The total size.
+     * @param total The exact total size of the messages.
+     * @return size_t The number of messages.
+     */
+    static size_t countMessages(const std::vector<std::string> &corpus, uint64_t bytes, uint64_t &total)
+    {
+        size_t count = 0;
+        for (total = 0; total < bytes; ++count)
+        {
+            total += corpus[count % corpus.size()].size();
+        }
+        return count;
+    }
+
+    /**
+     * @brief Download messages from the loopback server into a new directory the way the
+     * synchronization does, in pipelined batches of 100 through a FetchHandler. The page cache
+     * and the writeback of earlier runs make single runs noisy, so the fastest of three is kept.
+     *
+     * @param corpus The corpus the server serves.
+     * @param count The number of messages.
+     * @param options How the messages are downloaded.
+     * @return DownloadResult The outcome of the download.
+     */
+    static DownloadResult download(const std::vector<std::string> &corpus, size_t count, const DownloadOptions &options)
+    {
+        DownloadResult fastest = downloadOnce(corpus, count, options);
+        for (int run = 1; run < 3; ++run)
+        {
+            DownloadResult result = downloadOnce(corpus, count, options);
+            if (result.timing.seconds < fastest.timing.seconds)
+            {
+                fastest = result;
+            }
+        }
+        return fastest;
+    }
+
+    /**
+     * @brief Create a new directory for the files of a benchmark, TMPDIR chooses the filesystem.
+     * @return std::string The path of the directory.
+     */
+    static std::string makeDirectory()
+    {
+        std::string directory = (std::filesystem::temp_directory_path() / "imapcl-bench-XXXXXX").string();
+        if (mkdtemp(directory.data()) == nullptr)
+        {
+            throw std::runtime_error("Unable to create a directory for the benchmark");
+        }
+        return directory;
+    }
+
+    /**
+     * @brief Download messages once, see download().
+     */
+    static DownloadResult downloadOnce(const std::vector<std::string> &corpus, size_t count, const DownloadOptions &options)
+    {
+        std::string directory = makeDirectory();
+        BenchServer server(corpus);
+        std::unique_ptr<IMAPClient> client = connectClient(server);
+        std::unique_ptr<Storage> storage = Storage::create(ArgumentParser::StorageFormat::Flat, directory, "INBOX", "bench", options.gzip);
+        SyncState syncState(directory, "INBOX", "bench");
+        syncState.setDurable(options.fsync != ArgumentParser::FsyncPolicy::None);
+        FetchHandler fetchHandler(*storage, false, syncState, options.fsync);
+
+        std::vector<std::string> commands;
+        UIDSet uids;
+        uids.addRange(1, static_cast<uint32_t>(count));
+        for (const UIDSet &batch : uids.split(100))
+        {
+            commands.push_back("UID FETCH " + batch.toString() + " " + Helpers::GetFetchItems(false));
+        }
+
+        DownloadResult result;
+        result.timing = measure([&]()
+                                { client->sendPipelinedCommands(
+                                      commands, 4,
+                                      [&fetchHandler](const std::string &line)
+                                      { fetchHandler.onLine(line); },
+                                      [&fetchHandler, &result](const char *data, size_t length)
+                                      {
+                                          result.splicedBytes += data == nullptr ? length : 0;
+                                          fetchHandler.onLiteral(data, length);
+                                      },
+                                      [&fetchHandler]()
+                                      { fetchHandler.flush(); },
+                                      options.splice ? IMAPClient::LiteralFileHandler([&fetchHandler]()
+                                                                                      { return fetchHandler.literalFile(); })
+                                                     : nullptr); });
+        client->logout();
+        result.saved = fetchHandler.getSavedCount();
+
+        for (const auto &entry : std::filesystem::recursive_directory_iterator(directory))
+        {
+            if (entry.is_regular_file() && entry.path().filename().string().find("syncstate") == std::string::npos)
+            {
+                result.diskBytes += entry.file_size();
+            }
+        }
+        std::filesystem::remove_all(directory);
+        return result;
+    }
+
+    /**
+     * @brief Generate the UIDs of a mailbox in which some messages were expunged.
+     * @param count The number of UIDs.
+     * @return std::vector<uint32_t> The UIDs in ascending order, about one in twenty skipped.
+     */
+    std::vector<uint32_t> generateUIDs(size_t count)
+    {
+        std::vector<uint32_t> uids;
+        uids.reserve(count);
+        for (uint32_t uid = 1; uids.size() < count; ++uid)
+        {
+            if (random() % 20 != 0)
+            {
+                uids.push_back(uid);
+            }
+        }
+        return uids;
+    }
+
+    /**
+     * @brief Measure the response framer of IMAPClient on a FETCH response of 1 GiB from the
+     * loopback server. The lines and literals are only counted, nothing is stored.
+     */
+    void benchFramer()
+    {
+        std::vector<std::string> corpus = generateCorpus(64);
+        uint64_t total;
+        size_t count = countMessages(corpus, 1ULL << 30, total);
+
+        BenchServer server(corpus);
+        std::unique_ptr<IMAPClient> client = connectClient(server);
+        size_t fetches = 0;
+        uint64_t literalBytes = 0;
+        std::string status;
+        Timing timing = measure([&]()
+                                { status = client->sendStreamingCommand(
+                                      "UID FETCH 1:" + std::to_string(count) + " (UID BODY[])",
+                                      [&fetches](const std::string &line)
+                                      { fetches += line.find(" FETCH (UID ") != std::string::npos; },
+                                      [&literalBytes](const char *, size_t length)
+                                      { literalBytes += length; }); });
+        client->logout();
+
+        std::string name = "FETCH of " + std::to_string(count) + " messages, " + std::to_string(total >> 20) + " MiB";
+        if (!Helpers::IsStatusOK(status) || fetches != count || literalBytes != total)
+        {
+            report("framer", name, "FAILED, " + std::to_string(fetches) + " responses with " + std::to_string(literalBytes) + " bytes");
+            return;
+        }
+        report("framer", name, throughput(server.getWireBytes(), timing));
+    }
+
+    /**
+     * @brief Measure the bytes on the wire and the time of a FETCH response of 128 MiB from the
+     * loopback server without and with COMPRESS DEFLATE. The server compresses at the default
+     * level of zlib and shares the machine with the client, so the wall time includes its work.
+     */
+    void benchCompress()
+    {
+        std::vector<std::string> corpus = generateCorpus(64);
+        uint64_t total;
+        size_t count = countMessages(corpus, 128ULL << 20, total);
+
+        for (bool compressed : {false, true})
+        {
+            BenchServer server(corpus);
+            std::unique_ptr<IMAPClient> client = connectClient(server);
+            if (compressed && !client->startCompression())
+            {
+                report("compress", "COMPRESS DEFLATE", "FAILED to start");
+                return;
+            }
+
+            uint64_t start = server.getWireBytes();
+            uint64_t literalBytes = 0;
+            std::string status;
+            Timing timing = measure([&]()
+                                    { status = client->sendStreamingCommand(
+                                          "UID FETCH 1:" + std::to_string(count) + " (UID BODY[])", nullptr,
+                                          [&literalBytes](const char *, size_t length)
+                                          { literalBytes += length; }); });
+            uint64_t wire = server.getWireBytes() - start;
+            client->logout();
+
+            std::string name = std::string(compressed ? "COMPRESS DEFLATE" : "uncompressed") + ", " + std::to_string(total >> 20) + " MiB";
+            if (!Helpers::IsStatusOK(status) || literalBytes != total)
+            {
+                report("compress", name, "FAILED, " + std::to_string(literalBytes) + " bytes received");
+                continue;
+            }
+
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(1) << wire / 1e6 << " MB on the wire, " << milliseconds(timing.seconds) << ", "
+                << std::setprecision(3) << timing.cpuSeconds / (total / 1e9) << " s client CPU per GB";
+            report("compress", name, out.str());
+        }
+    }
+
+    /**
+     * @brief Measure storing 256 MiB of messages from a plain connection with the literals spliced
+     * from the socket into the message files and with them written from the read buffer, the
+     * path of TLS and COMPRESS connections.
+     */
+    void benchSplice()
+    {
+        std::vector<std::string> corpus = generateCorpus(64);
+        uint64_t total;
+        size_t count = countMessages(corpus, 256ULL << 20, total);
+
+        for (bool splice : {true, false})
+        {
+            DownloadOptions options;
+            options.splice = splice;
+            DownloadResult result = download(corpus, count, options);
+
+            std::string name = std::string(splice ? "splice" : "write from buffer") + ", " + std::to_string(total >> 20) + " MiB";
+            if (result.saved != static_cast<int>(count) || result.diskBytes != total)
+            {
+                report("splice", name, "FAILED, " + std::to_string(result.saved) + " messages saved");
+                continue;
+            }
+            report("splice", name, throughput(total, result.timing) + ", " + std::to_string(result.splicedBytes * 100 / total) + " % spliced");
+        }
+    }
+
+    /**
+     * @brief Measure storing 1000 messages with every --fsync policy, the batches of 100 being
+     * committed to the sync state journal as in a synchronization.
+     */
+    void benchFsync()
+    {
+        std::vector<std::string> corpus = generateCorpus(64);
+        const size_t count = 1000;
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            total += corpus[i % corpus.size()].size();
+        }
+
+        const std::vector<std::pair<std::string, ArgumentParser::FsyncPolicy>> policies = {
+            {"none", ArgumentParser::FsyncPolicy::None},
+            {"batch", ArgumentParser::FsyncPolicy::Batch},
+            {"message", ArgumentParser::FsyncPolicy::Message},
+        };
+        for (const auto &policy : policies)
+        {
+            DownloadOptions options;
+            options.fsync = policy.second;
+            DownloadResult result = download(corpus, count, options);
+
+            std::string name = "--fsync " + policy.first + ", " + std::to_string(count) + " messages";
+            if (result.saved != static_cast<int>(count) || result.diskBytes != total)
+            {
+                report("fsync", name, "FAILED, " + std::to_string(result.saved) + " messages saved");
+                continue;
+            }
+
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(0) << count / result.timing.seconds << " messages/s, " << throughput(total, result.timing);
+            report("fsync", name, out.str());
+        }
+    }
+
+    /**
+     * @brief Measure the compression ratio and the throughput of storing 128 MiB of messages
+     * with --gzip, against storing them as they are.
+     */
+    void benchGzip()
+    {
+        std::vector<std::string> corpus = generateCorpus(64);
+        uint64_t total;
+        size_t count = countMessages(corpus, 128ULL << 20, total);
+
+        for (bool gzip : {false, true})
+        {
+            DownloadOptions options;
+            options.gzip = gzip;
+            DownloadResult result = download(corpus, count, options);
+
+            std::string name = std::string(gzip ? "--gzip" : "uncompressed") + ", " + std::to_string(total >> 20) + " MiB";
+            if (result.saved != static_cast<int>(count) || (!gzip && result.diskBytes != total))
+            {
+                report("gzip", name, "FAILED, " + std::to_string(result.saved) + " messages saved");
+                continue;
+            }
+
+            std::ostringstream out;
+            out << "ratio " << std::fixed << std::setprecision(2) << static_cast<double>(total) / result.diskBytes << ", "
+                << throughput(total, result.timing);
+            report("gzip", name, out.str());
+        }
+    }
+
+    /**
+     * @brief Measure the parts of a sync that grow with the number of UIDs in the mailbox:
+     * parsing the SEARCH response, the diff of a sync with nothing to download and
+     * recording the downloaded messages in any order.
+     */
+    void benchUIDSet()
+    {
+        std::string directory = makeDirectory(); // For the journal of the recorded messages
+        for (size_t count : {1000, 100000, 1000000})
+        {
+            std::string suffix = " (" + std::to_string(count) + " UIDs)";
+            int repeat = static_cast<int>(std::max<size_t>(1, 100000 / count));
+            std::vector<uint32_t> uids = generateUIDs(count);
+            UIDSet serverUIDs = UIDSet::fromUIDs(uids);
+
+            std::string search = "* SEARCH";
+            for (uint32_t uid : uids)
+            {
+                search += " " + std::to_string(uid);
+            }
+            search += "\r\nA004 OK SEARCH completed\r\n";
+            std::string esearch = "* ESEARCH (TAG \"A004\") UID ALL " + serverUIDs.toString() + "\r\nA004 OK SEARCH completed\r\n";
+
+            UIDSet parsed;
+            Timing timing = measure([&]()
+                                    { Helpers::GetMailServerUids(search, parsed); }, repeat);
+            report("uidset", "parse SEARCH" + suffix, milliseconds(timing.seconds));
+            timing = measure([&]()
+                             { Helpers::GetMailServerUids(esearch, parsed); }, repeat);
+            report("uidset", "parse ESEARCH" + suffix, milliseconds(timing.seconds));
+
+            // A sync of a mailbox downloaded completely before
+            SyncState state("", "bench", "bench");
+            state.setMessages(UIDSet(), serverUIDs, {});
+            UIDSet missing;
+            timing = measure([&]()
+                             { missing = Helpers::GetSynchronizingUIDs(false, false, state, serverUIDs); }, repeat);
+            report("uidset", "no-op sync diff" + suffix, milliseconds(timing.seconds));
+
+            // The order of --order newest, of parallel connections and of filled gaps
+            std::vector<uint32_t> shuffled = uids;
+            std::shuffle(shuffled.begin(), shuffled.end(), random);
+            timing = measure([&]()
+                             { UIDSet::fromUIDs(shuffled); }, repeat);
+            report("uidset", "fromUIDs, shuffled" + suffix, milliseconds(timing.seconds));
+            for (bool descending : {true, false})
+            {
+                const std::vector<uint32_t> &order = descending ? std::vector<uint32_t>(uids.rbegin(), uids.rend()) : shuffled;
+                timing = measure([&]()
+                                 {
+                                     SyncState recorded(directory, "bench", "bench");
+                                     SyncState::Batch batch;
+                                     for (uint32_t uid : order)
+                                     {
+                                         batch.addMessage(uid, false, 1000);
+                                     }
+                                     recorded.commit(batch);
+                                     recorded.getFullEmails();
+                                     std::filesystem::remove(directory + "/bench_syncstate_bench.journal"); }, repeat);
+                report("uidset", std::string("record ") + (descending ? "descending" : "shuffled") + suffix, milliseconds(timing.seconds));
+            }
+
+            if (!missing.empty())
+            {
+                report("uidset", "no-op sync diff" + suffix, "FAILED, found " + std::to_string(missing.size()) + " missing UIDs");
+            }
+        }
+        std::filesystem::remove_all(directory);
+    }
+
+public:
+    /**
+     * @brief Constructs a Benchmark generating its data from a fixed seed.
+     */
+    Benchmark() : random(SEED) {}
+
+    /**
+     * @brief Run the selected suites.
+     * @param names The names of the suites, all of them if empty.
+     * @return true if every name is known, false otherwise.
+     */
+    bool run(const std::vector<std::string> &names)
+    {
+        const std::vector<std::pair<std::string, std::function<void()>>> suites = {
+            {"framer", [this]()
+             { benchFramer(); }},
+            {"compress", [this]()
+             { benchCompress(); }},
+            {"splice", [this]()
+             { benchSplice(); }},
+            {"fsync", [this]()
+             { benchFsync(); }},
+            {"gzip", [this]()
+             { benchGzip(); }},
+            {"uidset", [this]()
+             { benchUIDSet(); }},
+        };
+
+        for (const std::string &name : names)
+        {
+            if (std::none_of(suites.begin(), suites.end(), [&name](const auto &suite)
+                             { return suite.first == name; }))
+            {
+                std::cerr << "Unknown benchmark: " << name << std::endl;
+                return false;
+            }
+        }
+
+        for (const auto &suite : suites)
+        {
+            if (names.empty() || std::find(names.begin(), names.end(), suite.first) != names.end())
+            {
+                random.seed(SEED); // The same data whichever suites ran before
+                suite.second();
+            }
+        }
+        return true;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    Benchmark benchmark;
+    return benchmark.run(std::vector<std::string>(argv + 1, argv + argc)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
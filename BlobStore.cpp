@@ -0,0 +1,151 @@
+/**
+ * @file BlobStore.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing a content-addressed store deduplicating the downloaded messages.
+ */
+
+#ifndef BLOBSTORE_CPP
+#define BLOBSTORE_CPP
+
+#include <string>
+#include <cerrno>
+#include <filesystem>
+#include <stdexcept>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+/**
+ * @class BlobStore
+ * @brief A directory holding one file per distinct message content, named by the SHA-256 of the
+ * content and spread over 256 subdirectories by its first byte, e.g. 3f/3fa2...
+ *
+ * Messages are not copied into the store, a new content becomes a blob by getting a second name
+ * there. A message whose content is in the store already is replaced by a hardlink to the blob,
+ * so any number of mailboxes and accounts share a single copy on disk. The store must be on the
+ * same filesystem as the output directories, otherwise every message is kept as a copy.
+ */
+class BlobStore
+{
+private:
+    std::string directory; // The directory of the store.
+
+public:
+    /**
+     * @class Digest
+     * @brief The SHA-256 of a message, computed while the message is written.
+     */
+    class Digest
+    {
+    private:
+        EVP_MD_CTX *context; // The hash being computed.
+
+    public:
+        Digest() : context(EVP_MD_CTX_new())
+        {
+            if (context == nullptr)
+            {
+                throw std::runtime_error("Unable to create SHA-256 context");
+            }
+        }
+
+        Digest(const Digest &) = delete;
+        Digest &operator=(const Digest &) = delete;
+
+        ~Digest()
+        {
+            EVP_MD_CTX_free(context);
+        }
+
+        /**
+         * @brief Start hashing a new content.
+         */
+        void reset()
+        {
+            EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+        }
+
+        /**
+         * @brief Hash the next chunk of the content.
+         * @param data The chunk.
+         * @param length The length of the chunk.
+         */
+        void update(const void *data, size_t length)
+        {
+            EVP_DigestUpdate(context, data, length);
+        }
+
+        /**
+         * @brief Finish hashing the content.
+         * @return std::string The hash as lowercase hex digits.
+         */
+        std::string finish()
+        {
+            static const char digits[] = "0123456789abcdef";
+            unsigned char hash[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+            EVP_DigestFinal_ex(context, hash, &length);
+
+            std::string hex;
+            for (unsigned int i = 0; i < length; ++i)
+            {
+                hex += digits[hash[i] >> 4];
+                hex += digits[hash[i] & 0xf];
+            }
+            return hex;
+        }
+    };
+
+    /**
+     * @brief Constructs a BlobStore object.
+     * @param directory The directory of the store, created when the first blob is added.
+     */
+    explicit BlobStore(const std::string &directory) : directory(directory) {}
+
+    /**
+     * @brief Deduplicate a complete message before it is stored. The message becomes a blob if its
+     * content is new, otherwise its file is replaced by a hardlink to the blob with the same content.
+     *
+     * @param path The file of the message.
+     * @param hash The SHA-256 of the message as computed by Digest.
+     * @return true if the file now links to an earlier copy, false if it keeps its own data.
+     */
+    bool share(const std::string &path, const std::string &hash)
+    {
+        std::string subdirectory = directory + "/" + hash.substr(0, 2);
+        std::string blob = subdirectory + "/" + hash;
+
+        if (link(path.c_str(), blob.c_str()) == 0)
+        {
+            return false; // The first copy of the content
+        }
+        if (errno == ENOENT)
+        {
+            std::error_code ec;
+            std::filesystem::create_directories(subdirectory, ec);
+            if (link(path.c_str(), blob.c_str()) == 0)
+            {
+                return false;
+            }
+        }
+        if (errno != EEXIST)
+        {
+            return false; // E.g. another filesystem, keep the copy
+        }
+
+        // Link the blob under a new name first, so the message file is replaced atomically
+        std::string linked = path + ".link";
+        if (link(blob.c_str(), linked.c_str()) != 0)
+        {
+            return false; // E.g. too many links to the blob
+        }
+        if (rename(linked.c_str(), path.c_str()) != 0)
+        {
+            unlink(linked.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
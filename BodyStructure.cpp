@@ -0,0 +1,450 @@
+/**
+ * @file BodyStructure.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing the MIME structure of a message, used to download only some of its parts.
+ */
+
+#ifndef BODYSTRUCTURE_CPP
+#define BODYSTRUCTURE_CPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include "Helpers.cpp"
+
+/**
+ * @class BodyStructure
+ * @brief The MIME structure of a message as reported by FETCH BODYSTRUCTURE (RFC 3501, section 7.4.2).
+ *
+ * The parts of the message are selected by their type and size. The selected ones are fetched
+ * one by one with BODY.PEEK[<section>], the others only with the MIME header of the part
+ * (BODY.PEEK[<section>.MIME]). The message is then put back together from the header, the
+ * boundaries of its multiparts and the fetched sections, so it stays a valid MIME message in which
+ * the skipped parts have their headers, an added X-Part-Skipped header and an empty body.
+ * The preamble and the epilogue of the multiparts are not kept.
+ */
+class BodyStructure
+{
+private:
+    /**
+     * @brief A part of the message.
+     */
+    struct Part
+    {
+        std::string section;     // The section number, e.g. 2.1, empty for the message itself.
+        std::string type;        // The media type in lowercase, multipart for a multipart.
+        std::string subtype;     // The media subtype in lowercase.
+        std::string boundary;    // The boundary of a multipart.
+        uint64_t size = 0;       // The size of the body of a single part in bytes.
+        bool wanted = true;      // Whether the body of a single part is fetched.
+        std::vector<Part> parts; // The parts of a multipart.
+    };
+
+    /**
+     * @brief A value of a parenthesized IMAP response: a list, a string, a number or NIL.
+     */
+    struct Value
+    {
+        bool list = false;         // Whether the value is a parenthesized list.
+        std::string text;          // The string, number or atom.
+        std::vector<Value> items;  // The items of a list.
+    };
+
+    Part root;           // The message.
+    std::string skipped; // The sections of the skipped parts, comma separated.
+
+    static constexpr int MAX_DEPTH = 64; // Deeper nesting is not parsed, so a hostile server cannot exhaust the stack
+
+    /**
+     * @brief Parse one value of a parenthesized IMAP response.
+     * @param text The response.
+     * @param pos The position of the value, moved past it.
+     * @param value The parsed value.
+     * @param depth The nesting level of the value.
+     * @return true if a complete value was parsed, false otherwise.
+     */
+    static bool parseValue(const std::string &text, size_t &pos, Value &value, int depth)
+    {
+        while (pos < text.size() && text[pos] == ' ')
+        {
+            ++pos;
+        }
+        if (pos >= text.size() || depth > MAX_DEPTH)
+        {
+            return false;
+        }
+
+        if (text[pos] == '(')
+        {
+            value.list = true;
+            ++pos;
+            while (true)
+            {
+                while (pos < text.size() && text[pos] == ' ')
+                {
+                    ++pos;
+                }
+                if (pos < text.size() && text[pos] == ')')
+                {
+                    ++pos;
+                    return true;
+                }
+
+                value.items.emplace_back();
+                if (!parseValue(text, pos, value.items.back(), depth + 1))
+                {
+                    return false;
+                }
+            }
+        }
+
+        if (text[pos] == '"')
+        {
+            for (++pos; pos < text.size() && text[pos] != '"'; ++pos)
+            {
+                if (text[pos] == '\\' && pos + 1 < text.size())
+                {
+                    ++pos;
+                }
+                value.text += text[pos];
+            }
+            return pos++ < text.size();
+        }
+
+        size_t end = text.find_first_of(" ()", pos);
+        value.text = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        pos = end == std::string::npos ? text.size() : end;
+        return !value.text.empty();
+    }
+
+    /**
+     * @brief Get a string of a value in lowercase.
+     */
+    static std::string lower(const Value &value)
+    {
+        std::string text = value.text;
+        std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+        return text;
+    }
+
+    /**
+     * @brief Build a part from its body structure.
+     * @param value The body structure of the part.
+     * @param section The section number of the part.
+     * @param part The built part.
+     * @return true if the structure is complete, false otherwise.
+     */
+    static bool buildPart(const Value &value, const std::string &section, Part &part)
+    {
+        if (!value.list || value.items.empty())
+        {
+            return false;
+        }
+        part.section = section;
+
+        if (value.items[0].list)
+        {
+            // (part part ... "subtype" ("boundary" "..." ...) ...)
+            part.type = "multipart";
+            size_t i = 0;
+            for (; i < value.items.size() && value.items[i].list; ++i)
+            {
+                part.parts.emplace_back();
+                std::string child = (section.empty() ? "" : section + ".") + std::to_string(i + 1);
+                if (!buildPart(value.items[i], child, part.parts.back()))
+                {
+                    return false;
+                }
+            }
+
+            if (i < value.items.size())
+            {
+                part.subtype = lower(value.items[i++]);
+            }
+            if (i < value.items.size() && value.items[i].list)
+            {
+                const std::vector<Value> &parameters = value.items[i].items;
+                for (size_t p = 0; p + 1 < parameters.size(); p += 2)
+                {
+                    if (lower(parameters[p]) == "boundary")
+                    {
+                        part.boundary = parameters[p + 1].text;
+                    }
+                }
+            }
+            return !part.boundary.empty();
+        }
+
+        // ("type" "subtype" (parameters) id description encoding size ...)
+        if (value.items.size() < 7 || value.items[6].text.empty() ||
+            !std::all_of(value.items[6].text.begin(), value.items[6].text.end(), ::isdigit))
+        {
+            return false;
+        }
+        part.type = lower(value.items[0]);
+        part.subtype = lower(value.items[1]);
+        part.size = std::stoull(value.items[6].text);
+        return true;
+    }
+
+    /**
+     * @brief Choose the single parts to fetch and collect the sections of the others.
+     * @param part The part to choose in.
+     * @param types The media types to fetch, with the subtype * for any subtype.
+     * @param maxSize The size above which parts are skipped, 0 for no limit.
+     */
+    void selectParts(Part &part, const std::vector<std::string> &types, uint64_t maxSize)
+    {
+        if (part.type == "multipart")
+        {
+            for (Part &child : part.parts)
+            {
+                selectParts(child, types, maxSize);
+            }
+            return;
+        }
+
+        bool typeWanted = std::any_of(types.begin(), types.end(), [&part](const std::string &type)
+                                      { return type == part.type + "/" + part.subtype || type == part.type + "/*"; });
+        part.wanted = typeWanted && (maxSize == 0 || part.size <= maxSize);
+        if (!part.wanted)
+        {
+            skipped += (skipped.empty() ? "" : ",") + part.section;
+        }
+    }
+
+    /**
+     * @brief Add the FETCH items of the parts of a multipart.
+     */
+    static void addFetchItems(const Part &multipart, std::string &items)
+    {
+        for (const Part &part : multipart.parts)
+        {
+            items += " BODY.PEEK[" + part.section + ".MIME]";
+            if (part.type == "multipart")
+            {
+                addFetchItems(part, items);
+            }
+            else if (part.wanted)
+            {
+                items += " BODY.PEEK[" + part.section + "]";
+            }
+        }
+    }
+
+    /**
+     * @brief Append a header block, marking the part it belongs to as skipped if it is.
+     */
+    static void appendHeader(const std::string &header, const Part &part, std::string &message)
+    {
+        if (part.type == "multipart" || part.wanted)
+        {
+            message += header;
+            return;
+        }
+
+        // Before the blank line ending the header
+        std::string marker = "X-Part-Skipped: " + std::to_string(part.size) + " bytes\r\n";
+        if (header.size() >= 4 && header.compare(header.size() - 4, 4, "\r\n\r\n") == 0)
+        {
+            message += header.substr(0, header.size() - 2) + marker + "\r\n";
+        }
+        else
+        {
+            message += header + marker + "\r\n";
+        }
+    }
+
+    /**
+     * @brief Append the body of a multipart, with its parts between the boundaries.
+     */
+    static void appendMultipart(const Part &multipart, const std::map<std::string, std::string> &sections, std::string &message)
+    {
+        for (const Part &part : multipart.parts)
+        {
+            message += "--" + multipart.boundary + "\r\n";
+            appendHeader(getSection(sections, part.section + ".MIME"), part, message);
+            if (part.type == "multipart")
+            {
+                appendMultipart(part, sections, message);
+            }
+            else if (part.wanted)
+            {
+                message += getSection(sections, part.section);
+            }
+            message += "\r\n";
+        }
+        message += "--" + multipart.boundary + "--\r\n";
+    }
+
+    /**
+     * @brief Get a fetched section, empty if the server sent none.
+     */
+    static std::string getSection(const std::map<std::string, std::string> &sections, const std::string &name)
+    {
+        auto section = sections.find(name);
+        return section == sections.end() ? "" : section->second;
+    }
+
+public:
+    class Collector;
+
+    /**
+     * @brief Parse the structure from a FETCH response.
+     * @param response The FETCH response holding BODYSTRUCTURE, without literals.
+     * @return true if the structure was parsed, false otherwise.
+     */
+    bool parse(const std::string &response)
+    {
+        size_t pos = response.find("BODYSTRUCTURE (");
+        if (pos == std::string::npos)
+        {
+            return false;
+        }
+
+        pos += 14;
+        Value value;
+        root = Part();
+        if (!parseValue(response, pos, value, 0) || !buildPart(value, "", root))
+        {
+            return false;
+        }
+        if (root.type != "multipart")
+        {
+            root.section = "1"; // The body of a single part message
+        }
+        return true;
+    }
+
+    /**
+     * @brief Choose the parts to fetch.
+     * @param types The media types to fetch in lowercase, with the subtype * for any subtype.
+     * @param maxSize The size above which parts are skipped, 0 for no limit.
+     * @return true if any part is skipped, false if the whole message is wanted.
+     */
+    bool select(const std::vector<std::string> &types, uint64_t maxSize)
+    {
+        skipped.clear();
+        selectParts(root, types, maxSize);
+        return !skipped.empty();
+    }
+
+    /**
+     * @brief Get the sections of the parts skipped by select().
+     * @return std::string The sections, comma separated, e.g. 2,3.1.
+     */
+    const std::string &getSkipped() const
+    {
+        return skipped;
+    }
+
+    /**
+     * @brief Get the FETCH data items of the header, the MIME headers and the selected parts.
+     * @return std::string The parenthesized data items.
+     */
+    std::string getFetchItems() const
+    {
+        std::string items = "(UID BODY.PEEK[HEADER]";
+        if (root.type == "multipart")
+        {
+            addFetchItems(root, items);
+        }
+        else if (root.wanted)
+        {
+            items += " BODY.PEEK[1]";
+        }
+        return items + ")";
+    }
+
+    /**
+     * @brief Put the message together from its fetched sections.
+     * @param sections The fetched sections by their names in uppercase, e.g. HEADER, 2.MIME and 2.
+     * @return std::string The message with the skipped parts left empty.
+     */
+    std::string assemble(const std::map<std::string, std::string> &sections) const
+    {
+        std::string message;
+        appendHeader(getSection(sections, "HEADER"), root, message);
+        if (root.type == "multipart")
+        {
+            appendMultipart(root, sections, message);
+        }
+        else if (root.wanted)
+        {
+            message += getSection(sections, "1");
+        }
+        return message;
+    }
+};
+
+/**
+ * @class BodyStructure::Collector
+ * @brief Collects the structures of the messages from the lines and literals of a streamed
+ * UID FETCH (UID BODYSTRUCTURE) response.
+ */
+class BodyStructure::Collector
+{
+private:
+    std::string response; // The current FETCH response, its literals turned into quoted strings.
+    std::string literal;  // The literal being read.
+    bool inLiteral;       // Whether the current line announced a literal.
+
+public:
+    std::map<uint32_t, BodyStructure> structures; /**< The structures parsed so far, by UID. */
+
+    Collector() : inLiteral(false) {}
+
+    /**
+     * @brief Handle a single line of the response.
+     * @param line The response line without the trailing CRLF.
+     */
+    void onLine(const std::string &line)
+    {
+        if (inLiteral)
+        {
+            // A string sent as a literal, e.g. a file name with special characters
+            response += '"';
+            for (char c : literal)
+            {
+                response += c == '"' || c == '\\' ? std::string("\\") + c : std::string(1, c);
+            }
+            response += '"';
+            literal.clear();
+        }
+        else if (line.compare(0, 2, "* ") != 0 || line.find(" FETCH (") == std::string::npos)
+        {
+            return;
+        }
+
+        size_t literalSize;
+        inLiteral = Helpers::ParseLiteralSize(line, literalSize);
+        response += inLiteral ? line.substr(0, line.rfind('{')) : line;
+        if (inLiteral)
+        {
+            return;
+        }
+
+        std::string uid;
+        BodyStructure structure;
+        if (Helpers::ParseFetchUID(response, uid) && structure.parse(response))
+        {
+            structures[std::stoul(uid)] = std::move(structure);
+        }
+        response.clear();
+    }
+
+    /**
+     * @brief Handle a chunk of the literal data of the response.
+     * @param data The literal data.
+     * @param length The length of the data.
+     */
+    void onLiteral(const char *data, size_t length)
+    {
+        literal.append(data, length);
+    }
+};
+
+#endif
@@ -0,0 +1,744 @@
+/**
+ * @file Daemon.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing the daemon mode, synchronizing many accounts periodically in one process.
+ */
+
+#ifndef DAEMON_CPP
+#define DAEMON_CPP
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <iomanip>
+#include <atomic>
+#include <csignal>
+#include <climits>
+#include "ArgumentParser.h"
+#include "Synchronizer.cpp"
+
+/**
+ * @struct DaemonAccount
+ * @brief One account of the daemon with its schedule and the state kept between its runs.
+ */
+struct DaemonAccount
+{
+    std::string name;                                         /**< The name of the account section. */
+    ArgumentParser::ParsedArgs args;                          /**< The options of the account. */
+    std::string login;                                        /**< The arguments of the LOGIN command, read once. */
+    int priority = 0;                                         /**< Due accounts with a higher priority run first. */
+    std::chrono::seconds interval{300};                       /**< The time between two runs. */
+    std::chrono::steady_clock::time_point due;                /**< When the account runs next. */
+    unsigned failures = 0;                                    /**< The number of failed runs in a row. */
+    bool running = false;                                     /**< Whether the account is being synchronized. */
+    std::map<std::string, std::unique_ptr<SyncState>> states; /**< The sync states kept between runs. */
+};
+
+/**
+ * @class Daemon
+ * @brief A class synchronizing the accounts of a config file again and again until it is stopped.
+ *
+ * A fixed number of workers take the due accounts, highest priority first and the longest
+ * overdue among equal priorities. The workers are tasks of one event loop, which drives the
+ * connections of all accounts from a single thread. The connections to one server are limited across all of its
+ * accounts, a due account waits while its server has no connection left. A failed account is
+ * retried after a delay doubling with every failure in a row.
+ *
+ * The config file consists of sections with "key = value" lines, lines starting
+ * with "#" or ";" are comments:
+ *
+ *     [daemon]
+ *     workers = 4
+ *     max-connections = 10
+ *     backoff-max = 3600
+ *     tls-sessions = /var/cache/imapcl/sessions
+ *     hostnames = /var/cache/imapcl/hostnames
+ *
+ *     [account alice]
+ *     server = imap.example.com
+ *     tls = yes
+ *     auth = /etc/imapcl/alice.auth
+ *     outdir = /var/mail/alice
+ *     mailbox = INBOX
+ *     mailbox = Archive/%
+ *     interval = 300
+ *     priority = 1
+ *
+ * An account accepts the options of the command line by their long names.
+ */
+class Daemon
+{
+private:
+    static constexpr std::chrono::seconds BACKOFF_BASE{30}; // The delay after the first failure
+
+    std::vector<std::unique_ptr<DaemonAccount>> accounts; // The accounts in the order of the config file
+    size_t workerCount;                                   // The number of accounts synchronized at once
+    size_t serverLimit;                                   // The maximum number of connections to one server
+    std::chrono::seconds backoffMax;                      // The maximum delay after failures
+    std::string sessionFile;                              // Where the TLS sessions are kept between runs
+    std::string hostnameFile;                             // Where the canonical hostnames are kept between runs
+    std::map<std::string, size_t> serverConnections;      // The connections in use by server
+    EventLoop loop;                                       // Drives the connections of all accounts
+    size_t finishedRuns;                                  // The number of account runs finished, idle workers wait for it to change
+
+    static inline std::atomic<bool> stopping{false}; // Set by SIGINT and SIGTERM
+
+    /**
+     * @brief Handle SIGINT and SIGTERM by letting the running accounts finish.
+     * @param signal The signal number.
+     */
+    static void onSignal(int)
+    {
+        stopping = true;
+    }
+
+    /**
+     * @brief Remove whitespace from both ends of a string.
+     * @param text The string.
+     * @return std::string The string without the whitespace.
+     */
+    static std::string trim(const std::string &text)
+    {
+        size_t first = text.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+        {
+            return "";
+        }
+        return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    /**
+     * @brief Parse a boolean value of the config file.
+     * @param value The value, "yes", "true", "1" or "no", "false", "0".
+     * @param result The parsed value.
+     * @return true if the value is valid, false otherwise.
+     */
+    static bool parseBool(const std::string &value, bool &result)
+    {
+        if (value == "yes" || value == "true" || value == "1")
+        {
+            result = true;
+            return true;
+        }
+        if (value == "no" || value == "false" || value == "0")
+        {
+            result = false;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Parse a positive number of the config file.
+     * @param value The value.
+     * @param result The parsed value.
+     * @return true if the value is a positive number, false otherwise.
+     */
+    static bool parsePositive(const std::string &value, size_t &result)
+    {
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return false;
+        }
+
+        try
+        {
+            result = std::stoull(value);
+        }
+        catch (const std::out_of_range &)
+        {
+            return false;
+        }
+        return result > 0;
+    }
+
+    /**
+     * @brief Apply one option of the [daemon] section.
+     * @param key The option name.
+     * @param value The option value.
+     * @return true if the option is valid, false otherwise.
+     */
+    bool setDaemonOption(const std::string &key, const std::string &value)
+    {
+        if (key == "tls-sessions" || key == "hostnames")
+        {
+            (key == "hostnames" ? hostnameFile : sessionFile) = value;
+            return !value.empty();
+        }
+
+        size_t number;
+        if (!parsePositive(value, number))
+        {
+            return false;
+        }
+
+        if (key == "workers")
+        {
+            workerCount = number;
+        }
+        else if (key == "max-connections")
+        {
+            serverLimit = number;
+        }
+        else if (key == "backoff-max")
+        {
+            backoffMax = std::chrono::seconds(number);
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Apply one option of an account section.
+     * @param account The account.
+     * @param key The option name.
+     * @param value The option value.
+     * @return true if the option is valid, false otherwise.
+     */
+    static bool setAccountOption(DaemonAccount &account, const std::string &key, const std::string &value)
+    {
+        ArgumentParser::ParsedArgs &args = account.args;
+        size_t number = 0;
+        bool flag = false;
+
+        if (key == "server")
+        {
+            args.server = value;
+        }
+        else if (key == "certfile")
+        {
+            args.certfile = value;
+        }
+        else if (key == "certaddr")
+        {
+            args.certaddr = value;
+        }
+        else if (key == "auth" || key == "authfile")
+        {
+            args.authfile = value;
+        }
+        else if (key == "outdir")
+        {
+            args.outdir = value;
+        }
+        else if (key == "mailbox")
+        {
+            args.mailboxes.push_back(value);
+        }
+        else if (key == "fsync")
+        {
+            return ArgumentParser::parseFsyncPolicy(value, args.fsync);
+        }
+        else if (key == "storage")
+        {
+            return ArgumentParser::parseStorageFormat(value, args.storage);
+        }
+        else if (key == "dedup")
+        {
+            args.dedup_dir = value;
+        }
+        else if (key == "chunk-size")
+        {
+            args.chunk_size = 0;
+            return value == "0" || parsePositive(value, args.chunk_size);
+        }
+        else if (key == "order")
+        {
+            return ArgumentParser::parseFetchOrder(value, args.fetch_order);
+        }
+        else if (key == "max-size")
+        {
+            args.max_size = 0;
+            return value == "0" || parsePositive(value, args.max_size);
+        }
+        else if (key == "since")
+        {
+            return ArgumentParser::parseDate(value, args.since);
+        }
+        else if (key == "before")
+        {
+            return ArgumentParser::parseDate(value, args.before);
+        }
+        else if (key == "parts")
+        {
+            return ArgumentParser::parsePartTypes(value, args.part_types);
+        }
+        else if (key == "max-part-size")
+        {
+            args.max_part_size = 0;
+            return value == "0" || parsePositive(value, args.max_part_size);
+        }
+        else if (key == "priority")
+        {
+            try
+            {
+                account.priority = std::stoi(value);
+            }
+            catch (const std::exception &)
+            {
+                return false;
+            }
+        }
+        else if (key == "tls" || key == "subscribed" || key == "headers" || key == "new" || key == "prune" ||
+                 key == "compress" || key == "gzip" || key == "nodelay")
+        {
+            if (!parseBool(value, flag))
+            {
+                return false;
+            }
+
+            if (key == "tls")
+            {
+                args.use_tls = flag;
+            }
+            else if (key == "subscribed")
+            {
+                args.subscribed = flag;
+            }
+            else if (key == "headers")
+            {
+                args.headers_only = flag;
+            }
+            else if (key == "new")
+            {
+                args.new_only = flag;
+            }
+            else if (key == "compress")
+            {
+                args.compress = flag ? ArgumentParser::CompressPolicy::Always : ArgumentParser::CompressPolicy::Never;
+            }
+            else if (key == "gzip")
+            {
+                args.gzip = flag;
+            }
+            else if (key == "nodelay")
+            {
+                args.tcp_nodelay = flag;
+            }
+            else
+            {
+                args.prune_vanished = flag;
+            }
+        }
+        else if (key == "total-timeout" || key == "rcvbuf" || key == "sndbuf" || key == "keepalive")
+        {
+            if (value != "0" && (!parsePositive(value, number) || number > static_cast<size_t>(INT_MAX)))
+            {
+                return false;
+            }
+
+            if (key == "total-timeout")
+            {
+                args.total_timeout = static_cast<int>(number);
+            }
+            else if (key == "rcvbuf")
+            {
+                args.receive_buffer = static_cast<int>(number);
+            }
+            else if (key == "sndbuf")
+            {
+                args.send_buffer = static_cast<int>(number);
+            }
+            else
+            {
+                args.keepalive = static_cast<int>(number);
+            }
+        }
+        else if (key == "port" || key == "batch-size" || key == "batch-bytes" || key == "pipeline" ||
+                 key == "connections" || key == "interval" || key == "connect-timeout" || key == "read-timeout" ||
+                 key == "read-buffer")
+        {
+            if (!parsePositive(value, number))
+            {
+                return false;
+            }
+
+            if (key == "port")
+            {
+                args.port = static_cast<int>(number);
+            }
+            else if (key == "batch-size")
+            {
+                args.batch_size = number;
+            }
+            else if (key == "batch-bytes")
+            {
+                args.batch_bytes = number;
+            }
+            else if (key == "pipeline")
+            {
+                args.pipeline_depth = number;
+            }
+            else if (key == "connections")
+            {
+                args.connections = number;
+            }
+            else if (key == "connect-timeout")
+            {
+                args.connect_timeout = static_cast<int>(number);
+            }
+            else if (key == "read-timeout")
+            {
+                args.read_timeout = static_cast<int>(number);
+            }
+            else if (key == "read-buffer")
+            {
+                args.read_buffer = number;
+            }
+            else
+            {
+                account.interval = std::chrono::seconds(number);
+            }
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Check the options of a complete account section and fill in the defaults.
+     * @param account The account.
+     * @return true if the account can be synchronized, false otherwise.
+     */
+    bool finishAccount(DaemonAccount &account)
+    {
+        ArgumentParser::ParsedArgs &args = account.args;
+
+        if (args.server.empty() || args.authfile.empty() || args.outdir.empty())
+        {
+            std::cerr << "Error: Account " << account.name << " needs server, auth and outdir." << std::endl;
+            return false;
+        }
+
+        if (args.port == 0)
+        {
+            args.port = args.use_tls ? 993 : 143;
+        }
+
+        if ((!args.dedup_dir.empty() || args.gzip) && args.storage == ArgumentParser::StorageFormat::Mbox)
+        {
+            std::cerr << "Error: Account " << account.name << " cannot use dedup or gzip with the mbox storage." << std::endl;
+            return false;
+        }
+
+        if (!args.part_types.empty() && args.headers_only)
+        {
+            std::cerr << "Error: Account " << account.name << " cannot use parts and headers together." << std::endl;
+            return false;
+        }
+
+        if (args.mailboxes.empty() && !args.subscribed)
+        {
+            args.mailboxes.push_back("INBOX");
+        }
+
+        account.login = Helpers::parseLogin(args.authfile);
+        return true;
+    }
+
+    /**
+     * @brief Get the key the connection limit of an account is counted under.
+     * @param account The account.
+     * @return std::string The server and the port of the account.
+     */
+    static std::string serverKey(const DaemonAccount &account)
+    {
+        return account.args.server + ":" + std::to_string(account.args.port);
+    }
+
+    /**
+     * @brief Write one line of a report.
+     * @param out The stream to write to.
+     * @param message The line without the newline.
+     */
+    void report(std::ostream &out, const std::string &message)
+    {
+        out << message << std::endl;
+    }
+
+    /**
+     * @brief Take the due account to synchronize next and reserve connections to its server for it.
+     *
+     * @param connections The number of connections reserved.
+     * @return DaemonAccount* The account, nullptr if no account can run now.
+     */
+    DaemonAccount *takeAccount(size_t &connections)
+    {
+        auto now = std::chrono::steady_clock::now();
+        DaemonAccount *next = nullptr;
+
+        for (const auto &account : accounts)
+        {
+            if (account->running || account->due > now || serverConnections[serverKey(*account)] >= serverLimit)
+            {
+                continue;
+            }
+
+            if (!next || account->priority > next->priority ||
+                (account->priority == next->priority && account->due < next->due))
+            {
+                next = account.get();
+            }
+        }
+
+        if (next)
+        {
+            size_t &used = serverConnections[serverKey(*next)];
+            connections = std::min(next->args.connections, serverLimit - used);
+            used += connections;
+            next->running = true;
+        }
+
+        return next;
+    }
+
+    /**
+     * @brief Get the time the next idle account becomes due, at most a second from now so that
+     * a stop request is noticed.
+     *
+     * @return std::chrono::steady_clock::time_point The time to wait until.
+     */
+    std::chrono::steady_clock::time_point nextWakeUp()
+    {
+        auto wakeUp = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+        for (const auto &account : accounts)
+        {
+            if (!account->running && account->due < wakeUp)
+            {
+                wakeUp = account->due;
+            }
+        }
+
+        return wakeUp;
+    }
+
+    /**
+     * @brief Synchronize all mailboxes of an account once.
+     * @param account The account.
+     * @param connections The number of connections the account may use.
+     * @return true if every mailbox was synchronized, false otherwise.
+     */
+    bool syncAccount(DaemonAccount &account, size_t connections)
+    {
+        ArgumentParser::ParsedArgs args = account.args;
+        args.connections = connections;
+
+        std::unique_ptr<IMAPClient> client = Synchronizer::openConnection(args, account.login, &loop);
+        if (!client)
+        {
+            return false;
+        }
+
+        Synchronizer synchronizer(*client, args, account.login);
+        synchronizer.keepStates(account.states);
+        std::vector<MailboxStats> results;
+        try
+        {
+            results = synchronizer.run(synchronizer.listMailboxes());
+        }
+        catch (const IMAPClient::ConnectionError &)
+        {
+            // Nothing listed, the account is retried later
+        }
+
+        synchronizer.logout();
+
+        int downloaded = 0;
+        bool success = !results.empty();
+        for (const MailboxStats &stats : results)
+        {
+            downloaded += stats.downloaded;
+            success = success && stats.success;
+        }
+
+        report(std::cout, "Account " + account.name + ": " + (success ? "OK" : "FAILED") + ", " +
+                              std::to_string(results.size()) + " mailboxes, " + std::to_string(downloaded) + " downloaded");
+        return success;
+    }
+
+    /**
+     * @brief Synchronize due accounts until the daemon is stopped.
+     */
+    void workLoop()
+    {
+        while (!stopping)
+        {
+            size_t connections = 0;
+            DaemonAccount *account = takeAccount(connections);
+            if (!account)
+            {
+                // The other workers go on meanwhile, a finished run may free connections to a server
+                size_t seen = finishedRuns;
+                loop.runUntil([this, seen]()
+                              { return stopping || finishedRuns != seen; }, -1, -1, nextWakeUp());
+                continue;
+            }
+
+            bool success = syncAccount(*account, connections);
+
+            serverConnections[serverKey(*account)] -= connections;
+            account->running = false;
+
+            if (success)
+            {
+                account->failures = 0;
+                account->due = std::chrono::steady_clock::now() + account->interval;
+            }
+            else
+            {
+                // 30 s, 60 s, 120 s, ... up to backoffMax
+                ++account->failures;
+                std::chrono::seconds delay = backoffMax;
+                if (account->failures < 32)
+                {
+                    delay = std::min<std::chrono::seconds>(backoffMax, BACKOFF_BASE * (1LL << (account->failures - 1)));
+                }
+                account->due = std::chrono::steady_clock::now() + delay;
+                report(std::cerr, "Account " + account->name + ": retrying in " + std::to_string(delay.count()) + " s");
+            }
+
+            ++finishedRuns;
+        }
+    }
+
+public:
+    /**
+     * @brief Constructs a Daemon without accounts.
+     */
+    Daemon() : workerCount(4), serverLimit(10), backoffMax(3600), finishedRuns(0) {}
+
+    /**
+     * @brief Load the accounts from a config file and read their login files.
+     * @param path The path to the config file.
+     * @return true if the config file is valid and lists at least one account, false otherwise.
+     */
+    bool load(const std::string &path)
+    {
+        std::ifstream file(path);
+        if (!file.is_open())
+        {
+            std::cerr << "Error: Failed to open config file: " << path << std::endl;
+            return false;
+        }
+
+        std::string line;
+        size_t lineNumber = 0;
+        bool inDaemon = false;
+        DaemonAccount *account = nullptr;
+
+        while (std::getline(file, line))
+        {
+            ++lineNumber;
+            line = trim(line);
+            if (line.empty() || line.front() == '#' || line.front() == ';')
+            {
+                continue;
+            }
+
+            if (line.front() == '[' && line.back() == ']')
+            {
+                if (account && !finishAccount(*account))
+                {
+                    return false;
+                }
+
+                std::string section = trim(line.substr(1, line.size() - 2));
+                inDaemon = section == "daemon";
+                account = nullptr;
+
+                if (section.rfind("account ", 0) == 0 && !trim(section.substr(8)).empty())
+                {
+                    accounts.push_back(std::make_unique<DaemonAccount>());
+                    account = accounts.back().get();
+                    account->name = trim(section.substr(8));
+                }
+                else if (!inDaemon)
+                {
+                    std::cerr << "Error: " << path << ":" << lineNumber << ": Unknown section " << line << std::endl;
+                    return false;
+                }
+                continue;
+            }
+
+            size_t equals = line.find('=');
+            std::string key = trim(line.substr(0, equals));
+            std::string value = equals == std::string::npos ? "" : trim(line.substr(equals + 1));
+
+            bool valid = equals != std::string::npos &&
+                         (inDaemon ? setDaemonOption(key, value) : account && setAccountOption(*account, key, value));
+            if (!valid)
+            {
+                std::cerr << "Error: " << path << ":" << lineNumber << ": Invalid option " << line << std::endl;
+                return false;
+            }
+        }
+
+        if (account && !finishAccount(*account))
+        {
+            return false;
+        }
+
+        if (accounts.empty())
+        {
+            std::cerr << "Error: No account in config file: " << path << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Synchronize the accounts until SIGINT or SIGTERM. The accounts being synchronized
+     * when the signal arrives are finished first.
+     *
+     * @return int The exit code of the program.
+     */
+    int run()
+    {
+        stopping = false;
+        if (!sessionFile.empty())
+        {
+            IMAPClient::setSessionFile(sessionFile);
+        }
+        if (!hostnameFile.empty())
+        {
+            IMAPClient::setHostnameFile(hostnameFile);
+        }
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+
+        auto now = std::chrono::steady_clock::now();
+        for (const auto &account : accounts)
+        {
+            account->due = now;
+        }
+
+        size_t workers = std::min(workerCount, accounts.size());
+        size_t finished = 0;
+        for (size_t i = 0; i < workers; ++i)
+        {
+            loop.spawn([this, &finished]()
+                       {
+                           workLoop();
+                           ++finished; });
+        }
+
+        loop.runUntil([&finished, workers]()
+                      { return finished == workers; }, -1, -1);
+
+        return EXIT_SUCCESS;
+    }
+};
+
+#endif
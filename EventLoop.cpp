@@ -0,0 +1,425 @@
+/**
+ * @file EventLoop.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing an epoll based event loop driving non-blocking connections.
+ */
+
+#ifndef EVENTLOOP_CPP
+#define EVENTLOOP_CPP
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @class EventLoop
+ * @brief A class waiting for readiness of many file descriptors at once and calling their handlers.
+ *
+ * The descriptors are watched level-triggered, so a handler does not have to drain a descriptor
+ * completely. Data already buffered in user space (e.g. decrypted TLS records) does not wake up
+ * epoll, so handlers report such descriptors with markReady() to be called again without waiting.
+ *
+ * Code written against blocking calls runs as tasks started with spawn(), each on its own stack.
+ * A task waiting in runUntil() is parked while the loop runs the descriptors and the other tasks,
+ * so one thread drives any number of connections. Outside of a task, runUntil() runs the loop and
+ * the tasks itself. Every wait has its own idle timer, measured on the descriptor it waits for.
+ */
+class EventLoop
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @struct Wait
+     * @brief A condition waited for in runUntil() with the limits that end the wait early.
+     */
+    struct Wait
+    {
+        const std::function<bool()> &done; // The condition
+        int fd;                            // The descriptor whose silence counts, -1 for none
+        int idleTimeoutMs;                 // The maximum silence of fd in milliseconds, -1 for no limit
+        Clock::time_point deadline;        // When the wait gives up
+        Clock::time_point started;         // When the wait started
+    };
+
+    /**
+     * @struct Task
+     * @brief A task with its own stack, see spawn().
+     */
+    struct Task
+    {
+        std::function<void()> body; // The work of the task
+        ucontext_t context;         // Where the task continues
+        char *stack = nullptr;      // The stack of the task, with a guard page at its low end
+        bool finished = false;      // Whether the body returned
+        const Wait *wait = nullptr; // What the task waits for, nullptr if it can run
+        bool result = false;        // Whether the condition held when the wait ended
+    };
+
+    static constexpr size_t TASK_STACK_SIZE = 8 * 1024 * 1024; // Reserved, not committed, like the stack of a thread
+
+    static inline thread_local EventLoop *starting = nullptr; // The loop starting a task, read by enter()
+
+    int epoll_fd;                                                    // The epoll instance
+    std::unordered_map<int, std::function<void(uint32_t)>> handlers; // Handlers by file descriptor
+    std::unordered_map<int, Clock::time_point> activity;             // When each descriptor last had an event
+    std::vector<int> ready;                                          // Descriptors to call again without waiting
+    std::vector<std::unique_ptr<Task>> tasks;                        // The tasks that have not finished
+    Task *current;                                                   // The task running now, nullptr outside of tasks
+    ucontext_t scheduler;                                            // Where a task returns to when it waits or finishes
+
+    /**
+     * @brief Check whether a wait is over.
+     * @param wait The wait
+     * @return 1 if the condition holds, -1 if the wait timed out, 0 if it goes on
+     */
+    int check(const Wait &wait) const
+    {
+        if (wait.done())
+        {
+            return 1;
+        }
+        return Clock::now() >= expiry(wait) ? -1 : 0;
+    }
+
+    /**
+     * @brief Get when a wait times out, at the idle timeout of its descriptor or its deadline.
+     * @param wait The wait
+     * @return The point in time
+     */
+    Clock::time_point expiry(const Wait &wait) const
+    {
+        if (wait.idleTimeoutMs < 0)
+        {
+            return wait.deadline;
+        }
+
+        Clock::time_point lastEvent = wait.started;
+        auto event = activity.find(wait.fd);
+        if (event != activity.end())
+        {
+            lastEvent = std::max(lastEvent, event->second);
+        }
+        return std::min(wait.deadline, lastEvent + std::chrono::milliseconds(wait.idleTimeoutMs));
+    }
+
+    /**
+     * @brief Entry point of a task, runs its body and returns to the scheduler for good.
+     * An exception leaving the body terminates the program, as one leaving a thread would.
+     */
+    static void enter() noexcept
+    {
+        EventLoop *loop = starting;
+        Task *task = loop->current;
+        task->body();
+        task->finished = true;
+        setcontext(&loop->scheduler);
+    }
+
+    /**
+     * @brief Run a task until it waits or finishes.
+     * @param task The task
+     */
+    void resume(Task &task)
+    {
+        if (task.stack == nullptr)
+        {
+            void *stack = mmap(nullptr, TASK_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+            if (stack == MAP_FAILED)
+            {
+                throw std::runtime_error("Unable to allocate the stack of a task");
+            }
+            task.stack = static_cast<char *>(stack);
+            mprotect(task.stack, sysconf(_SC_PAGESIZE), PROT_NONE); // Overflowing the stack faults instead of corrupting memory
+
+            getcontext(&task.context);
+            task.context.uc_stack.ss_sp = task.stack;
+            task.context.uc_stack.ss_size = TASK_STACK_SIZE;
+            task.context.uc_link = nullptr;
+            makecontext(&task.context, &EventLoop::enter, 0);
+            starting = this;
+        }
+
+        current = &task;
+        swapcontext(&scheduler, &task.context);
+        current = nullptr;
+    }
+
+    /**
+     * @brief Run every task whose wait is over and drop the finished ones.
+     * @return true if any task ran, false otherwise
+     */
+    bool runTasks()
+    {
+        bool ran = false;
+
+        // Tasks spawned meanwhile are appended and run in the same pass
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            Task &task = *tasks[i];
+            if (task.wait)
+            {
+                int state = check(*task.wait);
+                if (state == 0)
+                {
+                    continue;
+                }
+                task.result = state > 0;
+                task.wait = nullptr;
+            }
+
+            resume(task);
+            ran = true;
+        }
+
+        for (auto task = tasks.begin(); task != tasks.end();)
+        {
+            if ((*task)->finished)
+            {
+                munmap((*task)->stack, TASK_STACK_SIZE);
+                task = tasks.erase(task);
+            }
+            else
+            {
+                ++task;
+            }
+        }
+
+        return ran;
+    }
+
+public:
+    /**
+     * @brief Construct a new EventLoop object.
+     * @exception std::runtime_error if the epoll instance cannot be created.
+     */
+    EventLoop() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), current(nullptr)
+    {
+        if (epoll_fd < 0)
+        {
+            throw std::runtime_error("Unable to create epoll instance");
+        }
+    }
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    ~EventLoop()
+    {
+        for (const auto &task : tasks)
+        {
+            if (task->stack)
+            {
+                munmap(task->stack, TASK_STACK_SIZE);
+            }
+        }
+        close(epoll_fd);
+    }
+
+    /**
+     * @brief Start watching a file descriptor.
+     *
+     * @param fd The file descriptor
+     * @param events The epoll events to wait for, e.g. EPOLLIN
+     * @param handler Callback receiving the events that occurred
+     * @return true if the descriptor is watched, false otherwise
+     */
+    bool add(int fd, uint32_t events, std::function<void(uint32_t)> handler)
+    {
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            return false;
+        }
+
+        handlers[fd] = std::move(handler);
+        activity[fd] = Clock::now();
+        return true;
+    }
+
+    /**
+     * @brief Change the events a file descriptor is watched for.
+     *
+     * @param fd The file descriptor
+     * @param events The epoll events to wait for
+     */
+    void modify(int fd, uint32_t events)
+    {
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    /**
+     * @brief Stop watching a file descriptor. Must be called before the descriptor is closed.
+     *
+     * @param fd The file descriptor
+     */
+    void remove(int fd)
+    {
+        if (handlers.erase(fd) > 0)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        activity.erase(fd);
+    }
+
+    /**
+     * @brief Call the handler of a file descriptor again in the next iteration, as if it was readable.
+     *
+     * @param fd The file descriptor
+     */
+    void markReady(int fd)
+    {
+        ready.push_back(fd);
+    }
+
+    /**
+     * @brief Wait for events once and call the handlers of the descriptors they occurred on.
+     *
+     * @param timeoutMs The maximum time to wait in milliseconds, -1 to wait indefinitely
+     * @return true if any handler was called, false if the wait timed out
+     */
+    bool runOnce(int timeoutMs)
+    {
+        std::vector<std::pair<int, uint32_t>> occurred;
+
+        struct epoll_event events[64];
+        int count = epoll_wait(epoll_fd, events, 64, ready.empty() ? timeoutMs : 0);
+        if (count < 0 && errno != EINTR)
+        {
+            throw std::runtime_error("epoll_wait() failed");
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            // epoll_event is packed, its fields cannot be bound to references
+            int fd = events[i].data.fd;
+            uint32_t flags = events[i].events;
+            occurred.emplace_back(fd, flags);
+        }
+        for (int fd : ready)
+        {
+            occurred.emplace_back(fd, EPOLLIN);
+        }
+        ready.clear();
+
+        for (const auto &event : occurred)
+        {
+            // An earlier handler may have removed the descriptor
+            auto handler = handlers.find(event.first);
+            if (handler != handlers.end())
+            {
+                activity[event.first] = Clock::now();
+                std::function<void(uint32_t)> callback = handler->second;
+                callback(event.second);
+            }
+        }
+
+        return !occurred.empty();
+    }
+
+    /**
+     * @brief Start a task. It runs on its own stack the next time the loop runs, and may call
+     * runUntil() to wait without blocking the other tasks. The tasks all run in the thread that
+     * runs the loop, so they must not wait while holding a lock or inside a catch handler, whose
+     * exception the C++ runtime keeps per thread.
+     *
+     * @param body The work of the task
+     */
+    void spawn(std::function<void()> body)
+    {
+        tasks.push_back(std::make_unique<Task>());
+        tasks.back()->body = std::move(body);
+    }
+
+    /**
+     * @brief Run the loop until a condition holds. Called from a task, only the task waits
+     * while the loop goes on, otherwise the loop and the tasks run here until then.
+     *
+     * @param done The condition, checked after every iteration
+     * @param fd The descriptor whose silence ends the wait, -1 for none
+     * @param idleTimeoutMs The maximum time without an event on fd in milliseconds, -1 for no limit
+     * @param deadline The point in time to give up at even if events keep occurring
+     * @return true if the condition holds, false if fd stayed silent for idleTimeoutMs or the deadline passed
+     */
+    bool runUntil(const std::function<bool()> &done, int fd, int idleTimeoutMs,
+                  Clock::time_point deadline = Clock::time_point::max())
+    {
+        Wait wait{done, fd, idleTimeoutMs, deadline, Clock::now()};
+
+        if (current)
+        {
+            int state = check(wait);
+            if (state != 0)
+            {
+                return state > 0;
+            }
+
+            Task *task = current;
+            task->wait = &wait;
+            swapcontext(&task->context, &scheduler);
+            return task->result;
+        }
+
+        while (true)
+        {
+            int state = check(wait);
+            if (state != 0)
+            {
+                return state > 0;
+            }
+
+            // A task that ran may have changed what the others wait for, so look again at once
+            if (runTasks())
+            {
+                runOnce(0);
+                continue;
+            }
+
+            Clock::time_point wakeUp = expiry(wait);
+            for (const auto &task : tasks)
+            {
+                if (task->wait)
+                {
+                    wakeUp = std::min(wakeUp, expiry(*task->wait));
+                }
+            }
+
+            long long timeoutMs = -1;
+            if (wakeUp != Clock::time_point::max())
+            {
+                timeoutMs = std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(wakeUp - Clock::now()).count() + 1);
+            }
+            runOnce(static_cast<int>(std::min<long long>(timeoutMs, std::numeric_limits<int>::max())));
+        }
+    }
+
+    /**
+     * @brief Wait until a point in time, running the loop meanwhile like runUntil().
+     * @param until The point in time
+     */
+    void sleepUntil(Clock::time_point until)
+    {
+        runUntil([]()
+                 { return false; }, -1, -1, until);
+    }
+};
+
+#endif
@@ -0,0 +1,470 @@
+/**
+ * @file FetchHandler.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing a handler that saves the messages of a streamed UID FETCH response.
+ */
+
+#ifndef FETCHHANDLER_CPP
+#define FETCHHANDLER_CPP
+
+#include <iostream>
+#include <string>
+#include <set>
+#include <map>
+#include <regex>
+#include <vector>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Helpers.cpp"
+#include "EmailMessage.cpp"
+#include "BodyStructure.cpp"
+
+/**
+ * @class FetchHandler
+ * @brief A class consuming the lines and literals of a UID FETCH response as they arrive
+ * and writing every message body straight to its file.
+ *
+ * With chunks enabled, the messages are fetched with RFC822.SIZE BODY[]<0.chunk>. A message larger
+ * than the chunk is kept in a partial file and reported by takeIncomplete(), its next chunk is
+ * requested after resume() until the last one completes it.
+ *
+ * The messages announced by expectParts() are fetched section by section instead. Their sections
+ * are kept in memory until the FETCH response ends and the message is put back together from them.
+ *
+ * The saved messages are recorded in the sync state by flush(), once their files are on disk.
+ */
+class FetchHandler
+{
+private:
+    EmailMessage message;   // The message currently being written.
+    EmailMessage partsMessage; // The message with some parts currently being written.
+    SyncState &syncState;   // The sync state the saved messages are recorded in.
+    SyncState::Batch batch; // The messages saved since the last flush(), recorded once they are on disk.
+    ArgumentParser::FsyncPolicy fsync; // When the saved messages are flushed to disk.
+    std::set<std::string> unflushed;   // The files written since the last flush() with the Batch policy.
+    bool headersOnly;       // Whether only the headers are fetched.
+    uint64_t messageSize;   // The number of bytes of the current message written so far.
+    bool inFetch;           // Whether a FETCH response is being read.
+    bool hasBody;           // Whether the current FETCH response carried the message body.
+    bool failed;            // Whether saving the current message failed.
+    std::string fetchItems; // The lines of the current FETCH response, literals excluded.
+    int savedCount;         // The number of messages saved and recorded so far.
+    int failedCount;        // The number of messages that could not be saved so far.
+    int fetchCount;         // The number of FETCH responses seen so far.
+    uint64_t chunkSize;     // The number of bytes fetched at once, 0 to fetch whole messages.
+    std::string partialPrefix; // The path of the partial files without the UID.
+    uint32_t resumedUid;    // The message the next FETCH response continues, 0 for none.
+    uint64_t literalBytes;  // The number of bytes of the current literal written so far.
+    std::vector<std::pair<uint32_t, uint64_t>> incomplete; // Messages kept in partial files, with their sizes so far.
+    std::map<uint32_t, BodyStructure> structures;  // The messages fetched section by section, by UID.
+    std::map<std::string, std::string> sections;   // The sections of the current FETCH response, by name in uppercase.
+    std::string *section;   // The section the current literal belongs to, nullptr if it is a message.
+
+    /**
+     * @brief Save or throw away the message of the FETCH response that just ended.
+     */
+    void finishFetch()
+    {
+        inFetch = false;
+        saveMessage();
+        resumedUid = 0;
+    }
+
+    /**
+     * @brief Save, keep for the next chunk or throw away the message of the current FETCH response.
+     */
+    void saveMessage()
+    {
+        std::string uid;
+        if (!structures.empty() && fetchItems.find("BODY[HEADER]") != std::string::npos && Helpers::ParseFetchUID(fetchItems, uid) &&
+            structures.count(std::stoul(uid)) > 0)
+        {
+            saveParts(std::stoul(uid));
+            return;
+        }
+
+        if (!hasBody && resumedUid != 0 && fetchItems.find("BODY[]") != std::string::npos)
+        {
+            // The previous chunk ended with the message, the server sent an empty string or NIL
+            startBody(0);
+        }
+        else if (!hasBody)
+        {
+            return; // E.g. an unsolicited flag update
+        }
+
+        if (failed)
+        {
+            message.discard();
+            ++failedCount;
+        }
+        else if (!Helpers::ParseFetchUID(fetchItems, uid))
+        {
+            std::cerr << "Error: Failed to process email " << fetchCount << ": UID missing in server response" << std::endl;
+            message.discard();
+            ++failedCount;
+        }
+        else if (mayContinue(literalBytes, messageSize))
+        {
+            // Possibly more to come, the next chunk continues the partial file
+            try
+            {
+                message.suspend(getPartialPath(std::stoul(uid)));
+                incomplete.emplace_back(std::stoul(uid), messageSize);
+            }
+            catch (const std::exception &ex)
+            {
+                std::cerr << "Error: Failed to process email " << fetchCount << ": " << ex.what() << std::endl;
+                message.discard();
+                ++failedCount;
+            }
+        }
+        else
+        {
+            try
+            {
+                flushSaved(message.saveToFile(uid, fsync));
+                batch.addMessage(std::stoul(uid), headersOnly, messageSize);
+            }
+            catch (const std::exception &ex)
+            {
+                std::cerr << "Error: Failed to process email " << fetchCount << ": " << ex.what() << std::endl;
+                message.discard();
+                ++failedCount;
+            }
+        }
+    }
+
+    /**
+     * @brief Put a message fetched section by section together and save it.
+     * @param uid The UID of the message.
+     */
+    void saveParts(uint32_t uid)
+    {
+        // Sections the server sent as quoted strings instead of literals, e.g. empty ones
+        static const std::regex quoted_regex(R"re(BODY\[([^\]]+)\] "((?:[^"\\]|\\.)*)")re");
+        static const std::regex escape_regex(R"(\\(.))");
+        for (auto match = std::sregex_iterator(fetchItems.begin(), fetchItems.end(), quoted_regex); match != std::sregex_iterator(); ++match)
+        {
+            std::string value = std::regex_replace((*match)[2].str(), escape_regex, "$1");
+            sections[getSectionName((*match)[1].str())] = value;
+        }
+
+        auto structure = structures.find(uid);
+        try
+        {
+            if (failed)
+            {
+                throw std::runtime_error("Incomplete response");
+            }
+
+            std::string data = structure->second.assemble(sections);
+            partsMessage.begin();
+            partsMessage.append(data.data(), data.size());
+            flushSaved(partsMessage.saveToFile(std::to_string(uid), fsync));
+            batch.addParts(uid, data.size(), structure->second.getSkipped());
+        }
+        catch (const std::exception &ex)
+        {
+            std::cerr << "Error: Failed to process email " << fetchCount << ": " << ex.what() << std::endl;
+            partsMessage.discard();
+            ++failedCount;
+        }
+        structures.erase(structure);
+    }
+
+    /**
+     * @brief Get the name of a section as it is kept, the section number with the part specifier in uppercase.
+     * @param name The name from a FETCH response, e.g. 2.mime.
+     * @return std::string The name, e.g. 2.MIME.
+     */
+    static std::string getSectionName(std::string name)
+    {
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        return name;
+    }
+
+    /**
+     * @brief Flush a saved message according to the fsync policy, or remember it for flush().
+     * @param path The file the message was saved in.
+     */
+    void flushSaved(const std::string &path)
+    {
+        std::string directory = std::filesystem::path(path).parent_path().string();
+        if (fsync == ArgumentParser::FsyncPolicy::Batch)
+        {
+            unflushed.insert(path);
+        }
+        else if (fsync == ArgumentParser::FsyncPolicy::Message && !SyncState::syncPath(directory))
+        {
+            throw std::runtime_error("Unable to write directory: " + directory);
+        }
+    }
+
+    /**
+     * @brief Start writing the body of the current FETCH response.
+     * @param literalSize The size of the body.
+     */
+    void startBody(size_t literalSize)
+    {
+        hasBody = true;
+        literalBytes = 0;
+        try
+        {
+            if (resumedUid == 0)
+            {
+                // A message which may be continued is kept uncompressed
+                messageSize = 0;
+                message.begin(mayContinue(literalSize, literalSize));
+                return;
+            }
+
+            messageSize = message.resume(getPartialPath(resumedUid));
+            if (literalSize > 0 && fetchItems.find("BODY[]<" + std::to_string(messageSize) + ">") == std::string::npos)
+            {
+                throw std::runtime_error("The server did not continue the message at byte " + std::to_string(messageSize));
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            std::cerr << "Error: Failed to process email " << fetchCount << ": " << ex.what() << std::endl;
+            failed = true;
+        }
+    }
+
+    /**
+     * @brief Check whether the message of the current FETCH response continues after its chunk.
+     * A chunk shorter than chunkSize ends the message, so does one reaching its RFC822.SIZE.
+     * @param literalSize The size of the chunk.
+     * @param end The byte of the message the chunk ends at.
+     * @return true if the next chunk has to be fetched, false if the message is complete.
+     */
+    bool mayContinue(uint64_t literalSize, uint64_t end) const
+    {
+        uint64_t size;
+        return chunkSize != 0 && literalSize == chunkSize && (!Helpers::ParseFetchSize(fetchItems, size) || end < size);
+    }
+
+    /**
+     * @brief Get the partial file of a message.
+     * @param uid The UID of the message.
+     * @return std::string The path of the partial file.
+     */
+    std::string getPartialPath(uint32_t uid) const
+    {
+        return partialPrefix + std::to_string(uid);
+    }
+
+public:
+    /**
+     * @brief Constructs a FetchHandler saving the messages of the given mailbox.
+     * @param storage The storage of the mailbox.
+     * @param headersOnly Whether only the headers are fetched.
+     * @param syncState The sync state to record the saved messages in.
+     * @param fsync When the saved messages are flushed to disk.
+     * @param blobStore The store to deduplicate the messages in, nullptr to keep every copy.
+     */
+    FetchHandler(Storage &storage, bool headersOnly, SyncState &syncState, ArgumentParser::FsyncPolicy fsync,
+                 BlobStore *blobStore = nullptr)
+        : message(storage, headersOnly ? Storage::Content::Headers : Storage::Content::Full, blobStore),
+          partsMessage(storage, Storage::Content::Parts, blobStore), syncState(syncState), fsync(fsync),
+          headersOnly(headersOnly), messageSize(0), inFetch(false), hasBody(false), failed(false), savedCount(0), failedCount(0), fetchCount(0),
+          chunkSize(0), resumedUid(0), literalBytes(0), section(nullptr) {}
+
+    /**
+     * @brief Fetch the messages in chunks, keeping the incomplete ones in partial files.
+     * @param chunkSize The number of bytes fetched at once, must match the FETCH commands.
+     * @param partialPrefix The path of the partial files without the UID.
+     */
+    void setChunks(uint64_t chunkSize, const std::string &partialPrefix)
+    {
+        this->chunkSize = chunkSize;
+        this->partialPrefix = partialPrefix;
+    }
+
+    /**
+     * @brief Announce a message fetched section by section with the FETCH items of its structure.
+     * @param uid The UID of the message.
+     * @param structure The structure of the message, with the parts to fetch selected.
+     */
+    void expectParts(uint32_t uid, const BodyStructure &structure)
+    {
+        structures[uid] = structure;
+    }
+
+    /**
+     * @brief Continue a message kept in its partial file with the body of the next FETCH response.
+     * @param uid The UID of the message.
+     */
+    void resume(uint32_t uid)
+    {
+        resumedUid = uid;
+    }
+
+    /**
+     * @brief Get the messages kept in partial files since the last call.
+     * @return The UIDs of the messages with the number of bytes downloaded so far.
+     */
+    std::vector<std::pair<uint32_t, uint64_t>> takeIncomplete()
+    {
+        std::vector<std::pair<uint32_t, uint64_t>> taken;
+        taken.swap(incomplete);
+        return taken;
+    }
+
+    /**
+     * @brief Handle a single line of the FETCH response.
+     * @param line The response line without the trailing CRLF.
+     */
+    void onLine(const std::string &line)
+    {
+        if (!inFetch)
+        {
+            // Skip untagged responses like EXISTS, RECENT, EXPUNGE
+            if (line.find("* ") != 0 || line.find(" FETCH (") == std::string::npos)
+            {
+                return;
+            }
+
+            inFetch = true;
+            hasBody = false;
+            failed = false;
+            fetchItems.clear();
+            sections.clear();
+            ++fetchCount;
+        }
+
+        fetchItems += line;
+        section = nullptr;
+
+        // A section of a message fetched section by section, e.g. BODY[2.MIME] {83}
+        static const std::regex section_regex(R"(BODY\[([^\]]+)\] \{\d+\+?\}$)");
+        std::smatch match;
+        size_t literalSize;
+        if (!headersOnly && !structures.empty() && std::regex_search(line, match, section_regex))
+        {
+            section = &sections[getSectionName(match.str(1))];
+        }
+        else if (Helpers::ParseLiteralSize(line, literalSize))
+        {
+            // The literal that follows is the message itself
+            startBody(literalSize);
+        }
+        else
+        {
+            finishFetch();
+        }
+    }
+
+    /**
+     * @brief Handle a chunk of the literal data of the FETCH response.
+     * @param data The literal data, nullptr if the connection wrote it to the message file itself.
+     * @param length The length of the data.
+     */
+    void onLiteral(const char *data, size_t length)
+    {
+        if (failed)
+        {
+            return; // Keep draining the literal so the connection stays in sync
+        }
+
+        if (section != nullptr)
+        {
+            section->append(data, length);
+            return;
+        }
+
+        if (data == nullptr)
+        {
+            message.appended(length);
+            messageSize += length;
+            literalBytes += length;
+            return;
+        }
+
+        try
+        {
+            message.append(data, length);
+            messageSize += length;
+            literalBytes += length;
+        }
+        catch (const std::exception &ex)
+        {
+            std::cerr << "Error: Failed to process email " << fetchCount << ": " << ex.what() << std::endl;
+            failed = true;
+        }
+    }
+
+    /**
+     * @brief Get the file the current literal may be written to directly.
+     * @return The file descriptor of the message file, -1 if the literal must be passed to onLiteral().
+     */
+    int literalFile() const
+    {
+        return failed || section != nullptr ? -1 : message.getFileDescriptor();
+    }
+
+    /**
+     * @brief Flush the messages saved since the last call to disk and record them in the sync state.
+     * The writeback of every message was started when it was saved, so this mostly waits for it.
+     * If any of them could not be flushed, none of them is recorded, so they are downloaded again.
+     * @return true if all of them are on disk, false otherwise
+     */
+    bool flush()
+    {
+        bool flushed = true;
+        std::set<std::string> directories;
+        for (const std::string &path : unflushed)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            flushed = fd >= 0 && fdatasync(fd) == 0 && flushed;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            directories.insert(std::filesystem::path(path).parent_path().string());
+        }
+
+        // The new names of the messages are in their directories
+        for (const std::string &directory : directories)
+        {
+            flushed = SyncState::syncPath(directory) && flushed;
+        }
+        unflushed.clear();
+
+        if (!flushed)
+        {
+            std::cerr << "Error: Unable to write the downloaded messages to disk" << std::endl;
+            failedCount += batch.size();
+            batch.clear();
+            return false;
+        }
+
+        savedCount += batch.size();
+        syncState.commit(batch);
+        return true;
+    }
+
+    /**
+     * @brief Get the number of messages saved and recorded so far.
+     * @return The number of saved messages.
+     */
+    int getSavedCount() const
+    {
+        return savedCount;
+    }
+
+    /**
+     * @brief Get the number of messages that could not be saved or flushed so far.
+     * They are not recorded in the sync state, so the mailbox must not count as synchronized.
+     * @return The number of failed messages.
+     */
+    int getFailedCount() const
+    {
+        return failedCount;
+    }
+};
+
+#endif
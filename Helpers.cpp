@@ -5,16 +5,38 @@
  * @brief A file implementing a class for helper functions that are used repeatedly.
  */
 
+#ifndef HELPERS_CPP
+#define HELPERS_CPP
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <map>
 #include <regex>
 #include <filesystem>
+#include <algorithm>
+#include <unordered_map>
+#include "UIDSet.cpp"
+#include "SyncState.cpp"
+#include "Storage.cpp"
+#include "ArgumentParser.h"
 
 namespace fs = std::filesystem;
 
+/**
+ * @struct MessageInfo
+ * @brief What the server reports about a message before it is downloaded.
+ */
+struct MessageInfo
+{
+    uint32_t uid = 0;     /**< The UID of the message. */
+    size_t size = 0;      /**< The RFC822.SIZE of the message. */
+    int date = 0;         /**< The day of the INTERNALDATE as yyyymmdd, 0 if unknown. */
+    bool deleted = false; /**< Whether the message is flagged \Deleted, i.e. about to be expunged. */
+};
+
 class Helpers
 {
 public:
@@ -56,126 +78,677 @@ public:
     }
 
     /**
-     * @brief Get the local UIDs from the output directory.
+     * @brief Load the sync state of the mailbox, or rebuild it by scanning the storage
+     * when there is none yet or a rebuild is requested.
      *
+     * @param state The sync state to load.
      * @param outputDir The directory where the emails are saved.
-     * @param mailbox The mailbox name.
-     * @param canonicalHostname The canonical hostname of the mail server.
-     * @param headersOnly UIDs with only headers downloaded.
-     * @param fullEmails UIDs with full emails downloaded.
+     * @param storage The storage of the mailbox.
+     * @param rebuild Whether to rebuild the state from the storage even if it exists.
+     */
+    static void LoadSyncState(SyncState &state, const std::string &outputDir, Storage &storage, bool rebuild)
+    {
+        // Create directory if it doesn't exist
+        if (!fs::exists(outputDir))
+        {
+            fs::create_directories(outputDir);
+        }
+
+        if (!rebuild && state.load())
+        {
+            return;
+        }
+
+        UIDSet headerOnlyUIDs, fullEmailUIDs;
+        std::unordered_map<uint32_t, uint64_t> sizes;
+        storage.scan(headerOnlyUIDs, fullEmailUIDs, sizes);
+
+        state.reset(0);
+        state.setMessages(headerOnlyUIDs, fullEmailUIDs, sizes);
+        state.save();
+    }
+
+    /**
+     * @brief Get the UIDs from the mail server response to UID SEARCH, either as a plain
+     * SEARCH list or as the sequence set of an ESEARCH (RFC 4731) response.
+     *
+     * @param serverResponse The server response.
+     * @param uids The set of UIDs, empty if the response lists none.
+     * @return true if the UIDs were parsed, false if the response holds an invalid UID.
      */
-    static void GetLocalUIDs(const std::string &outputDir, const std::string &mailbox, const std::string &canonicalHostname,
-                             std::vector<int> &headersOnly, std::vector<int> &fullEmails)
+    static bool GetMailServerUids(const std::string &serverResponse, UIDSet &uids)
     {
-        std::string filePrefix = outputDir + "/" + canonicalHostname + "_" + mailbox + "_";
-        for (const auto &entry : fs::directory_iterator(outputDir))
+        uids = UIDSet();
+
+        // The response is scanned by hand, a regular expression over a SEARCH line
+        // with hundreds of thousands of UIDs is slow and recurses deep enough to crash
+        size_t lineStart = FindResponseLine(serverResponse, "* SEARCH");
+        if (lineStart != std::string::npos)
         {
-            if (entry.is_regular_file())
+            std::vector<uint32_t> found;
+            size_t lineEnd = serverResponse.find("\r\n", lineStart);
+            if (lineEnd == std::string::npos)
             {
-                std::string filePath = entry.path().string();
-                if (filePath.find(filePrefix) == 0)
-                {
-                    std::string uidStr = filePath.substr(filePrefix.length(), filePath.length() - filePrefix.length() - 4);
+                lineEnd = serverResponse.size();
+            }
 
-                    // Check if it's a header-only file
-                    if (filePath.substr(filePath.length() - 12) == "_headers.eml")
+            uint64_t uid = 0;
+            bool inNumber = false;
+            for (size_t i = lineStart + 8; i <= lineEnd; ++i)
+            {
+                if (i < lineEnd && isdigit(static_cast<unsigned char>(serverResponse[i])))
+                {
+                    uid = uid * 10 + (serverResponse[i] - '0');
+                    if (uid > UINT32_MAX)
                     {
-                        headersOnly.push_back(std::stoi(uidStr));
+                        return false;
                     }
-                    else if (filePath.substr(filePath.length() - 4) == ".eml")
+                    inNumber = true;
+                }
+                else if (inNumber)
+                {
+                    if (uid == 0)
                     {
-                        fullEmails.push_back(std::stoi(uidStr));
+                        return false;
                     }
+                    found.push_back(static_cast<uint32_t>(uid));
+                    uid = 0;
+                    inNumber = false;
                 }
             }
+
+            uids = UIDSet::fromUIDs(std::move(found));
+            return true;
         }
+
+        lineStart = FindResponseLine(serverResponse, "* ESEARCH ");
+        if (lineStart != std::string::npos)
+        {
+            size_t lineEnd = serverResponse.find("\r\n", lineStart);
+            std::string line = serverResponse.substr(lineStart, lineEnd == std::string::npos ? std::string::npos : lineEnd - lineStart);
+
+            size_t all = line.find(" ALL ");
+            if (all != std::string::npos)
+            {
+                size_t setStart = all + 5;
+                try
+                {
+                    uids = UIDSet::parse(line.substr(setStart, line.find(' ', setStart) - setStart));
+                }
+                catch (const std::exception &)
+                {
+                    return false; // std::invalid_argument or std::out_of_range
+                }
+            }
+        }
+
+        return true;
     }
 
     /**
-     * @brief Get the UIDs from the mail server response.
+     * @brief Find an untagged response line by its beginning.
      *
-     * @return std::vector<int> The list of UIDs.
+     * @param response The server response.
+     * @param prefix The beginning of the line, e.g. "* SEARCH".
+     * @param from The position to search from, either 0 or the position of a CRLF.
+     * @return size_t The position of the line, std::string::npos if not found.
      */
-    static std::vector<int> GetMailServerUids(const std::string &serverResponse)
+    static size_t FindResponseLine(const std::string &response, const std::string &prefix, size_t from = 0)
     {
-        std::vector<int> serverUIDs;
-        std::regex uid_regex(R"(\* SEARCH( (\d+))+)");
-        std::smatch match;
-        std::string::const_iterator searchStart(serverResponse.cbegin());
+        if (from == 0 && response.compare(0, prefix.size(), prefix) == 0)
+        {
+            return 0;
+        }
+
+        size_t pos = response.find("\r\n" + prefix, from);
+        return pos == std::string::npos ? pos : pos + 2;
+    }
 
-        if (std::regex_search(searchStart, serverResponse.cend(), match, uid_regex))
+    /**
+     * @brief Get the UIDs to fetch for synchronizing the mailbox.
+     *
+     * @param headersOnly Fetch only the headers.
+     * @param parts Fetch only some parts of the messages.
+     * @param state The sync state with the UIDs downloaded already.
+     * @param serverUIDs The UIDs in the mailbox on the server.
+     * @return UIDSet The missing or upgradeable UIDs.
+     */
+    static UIDSet GetSynchronizingUIDs(bool headersOnly, bool parts, const SyncState &state, const UIDSet &serverUIDs)
+    {
+        if (headersOnly)
         {
-            std::string uidList = match[0].str(); // This captures the whole line with UIDs
-            std::istringstream iss(uidList);
-            std::string uid;
-            // Skip the '* SEARCH' part by reading the first two segments which are '* SEARCH'
-            iss >> uid; // Read '*'
-            iss >> uid; // Read 'SEARCH'
+            // Find UIDs that are missing completely (for headers)
+            return serverUIDs.subtract(state.getHeadersOnly().unite(state.getFullEmails()));
+        }
+        if (parts)
+        {
+            // Find UIDs that are missing completely or have only headers (to upgrade to some parts)
+            return serverUIDs.subtract(state.getFullEmails()).subtract(state.getPartEmails());
+        }
+
+        // Find UIDs that are either missing completely or have only headers (to upgrade)
+        return serverUIDs.subtract(state.getFullEmails());
+    }
 
-            while (iss >> uid)
+    /**
+     * @brief Get the SELECT command for the mailbox. With CONDSTORE (RFC 7162) the server reports
+     * its HIGHESTMODSEQ, with QRESYNC and a known previous state it also reports the messages
+     * changed and the UIDs vanished since then.
+     *
+     * @param mailbox The mailbox name.
+     * @param state The loaded sync state of the mailbox.
+     * @param condstore Whether the server supports CONDSTORE.
+     * @param qresync Whether QRESYNC has been enabled.
+     * @return std::string The SELECT command.
+     */
+    static std::string GetSelectCommand(const std::string &mailbox, const SyncState &state, bool condstore, bool qresync)
+    {
+        if (qresync && state.getUIDValidity() != 0 && state.getHighestModSeq() != 0)
+        {
+            return "SELECT " + mailbox + " (QRESYNC (" + std::to_string(state.getUIDValidity()) + " " +
+                   std::to_string(state.getHighestModSeq()) + "))";
+        }
+
+        if (condstore || qresync)
+        {
+            return "SELECT " + mailbox + " (CONDSTORE)";
+        }
+
+        return "SELECT " + mailbox;
+    }
+
+    /**
+     * @brief Quote a mailbox name as an IMAP quoted string, so that names with spaces
+     * or other special characters can be sent in commands.
+     *
+     * @param mailbox The mailbox name.
+     * @return std::string The quoted name.
+     */
+    static std::string QuoteString(const std::string &mailbox)
+    {
+        std::string quoted = "\"";
+        for (char c : mailbox)
+        {
+            if (c == '"' || c == '\\')
             {
-                serverUIDs.push_back(std::stoi(uid));
+                quoted += '\\';
             }
+            quoted += c;
         }
 
-        return serverUIDs;
+        return quoted + "\"";
     }
 
     /**
-     * @brief Get the FETCH command for synchronizing the mailbox based on missing UIDs.
+     * @brief Get the name of a mailbox as used in the local file names. The hierarchy
+     * delimiter "/" cannot be part of a file name, so it is escaped along with "%".
      *
-     * @param headersOnly Fetch only the headers.
      * @param mailbox The mailbox name.
-     * @param outputDir The directory where the emails are saved.
-     * @param uidResponse The response from the UID FETCH command.
-     * @param canonicalHostname The canonical hostname of the mail server.
-     * @return std::string The FETCH command for missing or upgradeable UIDs.
+     * @return std::string The name safe to use in a file name.
      */
-    static std::string GetSynchronizingFetch(bool headersOnly, const std::string &mailbox, const std::string &outputDir,
-                                             const std::string &uidResponse, const std::string &canonicalHostname)
+    static std::string GetMailboxFileName(const std::string &mailbox)
     {
-        std::vector<int> headerOnlyUIDs, fullEmailUIDs;
-        GetLocalUIDs(outputDir, mailbox, canonicalHostname, headerOnlyUIDs, fullEmailUIDs);
-        std::vector<int> serverUIDs = GetMailServerUids(uidResponse);
-        std::vector<int> fetchUIDs;
+        std::string name;
+        for (char c : mailbox)
+        {
+            if (c == '/')
+            {
+                name += "%2F";
+            }
+            else if (c == '%')
+            {
+                name += "%25";
+            }
+            else
+            {
+                name += c;
+            }
+        }
 
-        if (headersOnly)
+        return name;
+    }
+
+    /**
+     * @brief Get the selectable mailboxes from the response to LIST or LSUB.
+     *
+     * The name is the last field of each "* LIST (flags) delimiter name" line and can be
+     * an atom, a quoted string or a literal. Mailboxes flagged \\Noselect or \\NonExistent are skipped.
+     *
+     * @param response The server response.
+     * @return std::vector<std::string> The mailbox names in the order of the response.
+     */
+    static std::vector<std::string> ParseListResponse(const std::string &response)
+    {
+        std::vector<std::string> mailboxes;
+        size_t pos = 0;
+
+        while (pos < response.size())
         {
-            // Find UIDs that are missing completely (for headers)
-            for (int serverUID : serverUIDs)
+            size_t lineEnd = response.find("\r\n", pos);
+            if (lineEnd == std::string::npos)
             {
-                if (std::find(headerOnlyUIDs.begin(), headerOnlyUIDs.end(), serverUID) == headerOnlyUIDs.end() &&
-                    std::find(fullEmailUIDs.begin(), fullEmailUIDs.end(), serverUID) == fullEmailUIDs.end())
+                lineEnd = response.size();
+            }
+
+            std::string line = response.substr(pos, lineEnd - pos);
+            pos = lineEnd + 2;
+
+            if (line.rfind("* LIST ", 0) != 0 && line.rfind("* LSUB ", 0) != 0)
+            {
+                continue;
+            }
+
+            size_t flagsEnd = line.find(')');
+            if (flagsEnd == std::string::npos)
+            {
+                continue;
+            }
+
+            std::string flags = line.substr(0, flagsEnd);
+            std::transform(flags.begin(), flags.end(), flags.begin(), ::toupper);
+            bool selectable = flags.find("\\NOSELECT") == std::string::npos && flags.find("\\NONEXISTENT") == std::string::npos;
+
+            // Skip the delimiter, which is a quoted character like "/" or "\\." or NIL
+            size_t nameStart = flagsEnd + 2;
+            if (nameStart < line.size() && line[nameStart] == '"')
+            {
+                nameStart += line[nameStart + 1] == '\\' ? 4 : 3;
+            }
+            else
+            {
+                nameStart += 3;
+            }
+            ++nameStart;
+
+            if (nameStart >= line.size())
+            {
+                continue;
+            }
+
+            std::string name;
+            size_t literalSize;
+            if (ParseLiteralSize(line, literalSize) && line[nameStart] == '{')
+            {
+                // The name follows the line as a literal
+                name = response.substr(pos, literalSize);
+                pos += literalSize;
+                size_t restEnd = response.find("\r\n", pos);
+                pos = restEnd == std::string::npos ? response.size() : restEnd + 2;
+            }
+            else if (line[nameStart] == '"')
+            {
+                for (size_t i = nameStart + 1; i < line.size() && line[i] != '"'; ++i)
                 {
-                    fetchUIDs.push_back(serverUID);
+                    if (line[i] == '\\' && i + 1 < line.size())
+                    {
+                        ++i;
+                    }
+                    name += line[i];
                 }
             }
+            else
+            {
+                name = line.substr(nameStart);
+            }
+
+            if (selectable && !name.empty())
+            {
+                mailboxes.push_back(name);
+            }
         }
-        else
+
+        return mailboxes;
+    }
+
+    /**
+     * @brief Get the UIDVALIDITY from the response to SELECT.
+     *
+     * @param selectResponse The response from the SELECT command.
+     * @return uint32_t The UIDVALIDITY, 0 if the response does not contain it.
+     */
+    static uint32_t GetUIDValidity(const std::string &selectResponse)
+    {
+        std::regex uidvalidity_regex(R"(\[UIDVALIDITY (\d+)\])");
+        std::smatch match;
+
+        if (std::regex_search(selectResponse, match, uidvalidity_regex))
+        {
+            return std::stoul(match.str(1));
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Get the HIGHESTMODSEQ from the response to SELECT.
+     *
+     * @param selectResponse The response from the SELECT command.
+     * @return uint64_t The HIGHESTMODSEQ, 0 if the server does not support it for the mailbox.
+     */
+    static uint64_t GetHighestModSeq(const std::string &selectResponse)
+    {
+        std::regex modseq_regex(R"(\[HIGHESTMODSEQ (\d+)\])");
+        std::smatch match;
+
+        if (std::regex_search(selectResponse, match, modseq_regex))
         {
-            // Find UIDs that are either missing completely or have only headers (to upgrade)
-            for (int serverUID : serverUIDs)
+            return std::stoull(match.str(1));
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Get the UIDs reported by VANISHED responses (RFC 7162).
+     *
+     * @param response The server response.
+     * @param vanished The UIDs expunged from the mailbox.
+     * @return true if the UIDs were parsed, false if a VANISHED response holds an invalid set.
+     */
+    static bool GetVanishedUIDs(const std::string &response, UIDSet &vanished)
+    {
+        vanished = UIDSet();
+        std::string prefix = "* VANISHED ";
+        size_t pos = FindResponseLine(response, prefix);
+
+        while (pos != std::string::npos)
+        {
+            size_t lineEnd = response.find("\r\n", pos);
+            std::string uids = response.substr(pos + prefix.size(), lineEnd == std::string::npos ? std::string::npos : lineEnd - pos - prefix.size());
+
+            if (uids.compare(0, 10, "(EARLIER) ") == 0)
             {
-                if (std::find(fullEmailUIDs.begin(), fullEmailUIDs.end(), serverUID) == fullEmailUIDs.end())
+                uids = uids.substr(10);
+            }
+            try
+            {
+                vanished = vanished.unite(UIDSet::parse(uids));
+            }
+            catch (const std::exception &)
+            {
+                return false; // std::invalid_argument or std::out_of_range
+            }
+
+            if (lineEnd == std::string::npos)
+            {
+                break;
+            }
+            pos = FindResponseLine(response, prefix, lineEnd);
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Get the UIDs of the untagged FETCH responses in a response, e.g. the messages
+     * reported as changed by a QRESYNC SELECT.
+     *
+     * @param response The server response.
+     * @return UIDSet The UIDs of the FETCH responses.
+     */
+    static UIDSet GetFetchedUIDs(const std::string &response)
+    {
+        std::vector<uint32_t> uids;
+        std::istringstream stream(response);
+        std::string line;
+        std::string uid;
+
+        while (std::getline(stream, line))
+        {
+            if (line.compare(0, 2, "* ") == 0 && line.find(" FETCH (") != std::string::npos && ParseFetchUID(line, uid))
+            {
+                uids.push_back(std::stoul(uid));
+            }
+        }
+
+        return UIDSet::fromUIDs(std::move(uids));
+    }
+
+    /**
+     * @brief Get the FETCH data items for downloading messages.
+     *
+     * @param headersOnly Fetch only the headers.
+     * @param chunkSize Fetch only chunkSize bytes and the size of every message, 0 for whole messages.
+     * @param offset The byte of the message the chunk starts at.
+     * @return std::string The parenthesized list of data items.
+     */
+    static std::string GetFetchItems(bool headersOnly, size_t chunkSize = 0, uint64_t offset = 0)
+    {
+        if (headersOnly)
+        {
+            return "(UID BODY.PEEK[HEADER])";
+        }
+        if (chunkSize > 0)
+        {
+            return "(UID RFC822.SIZE BODY[]<" + std::to_string(offset) + "." + std::to_string(chunkSize) + ">)";
+        }
+        return "(UID BODY[])";
+    }
+
+    /**
+     * @brief Get the messages whose download stopped in the middle, kept in partial files.
+     *
+     * @param partialPrefix The path of the partial files without the UID.
+     * @param uids The UIDs to look for.
+     * @return std::map<uint32_t, uint64_t> The number of bytes downloaded by UID.
+     */
+    static std::map<uint32_t, uint64_t> GetPartialDownloads(const std::string &partialPrefix, const UIDSet &uids)
+    {
+        std::map<uint32_t, uint64_t> partials;
+        fs::path prefix(partialPrefix);
+        std::string namePrefix = prefix.filename().string();
+        std::error_code ec;
+
+        for (const auto &entry : fs::directory_iterator(prefix.parent_path(), ec))
+        {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, namePrefix.length(), namePrefix) != 0 || name.length() == namePrefix.length() ||
+                name.find_first_not_of("0123456789", namePrefix.length()) != std::string::npos)
+            {
+                continue;
+            }
+
+            uint32_t uid = std::stoul(name.substr(namePrefix.length()));
+            if (uids.contains(uid))
+            {
+                partials[uid] = entry.file_size();
+            }
+        }
+
+        return partials;
+    }
+
+    /**
+     * @brief Split the UIDs to fetch into batches of UID FETCH commands.
+     *
+     * A batch is closed once it holds batchSize UIDs or, when batchBytes is set,
+     * once the known RFC822.SIZE of its messages reaches batchBytes. The UIDs of
+     * a batch are sent as a sequence set, so consecutive UIDs collapse into ranges.
+     *
+     * @param uids The UIDs to fetch.
+     * @param items The FETCH data items.
+     * @param batchSize The maximum number of UIDs in one batch.
+     * @param batchBytes The maximum estimated size of one batch in bytes, 0 for no limit.
+     * @param sizes The known RFC822.SIZE of the messages by UID.
+     * @return std::vector<std::string> The UID FETCH commands.
+     */
+    static std::vector<std::string> GetBatchedFetches(const UIDSet &uids, const std::string &items, size_t batchSize,
+                                                      size_t batchBytes, const std::map<uint32_t, size_t> &sizes)
+    {
+        std::vector<std::string> commands;
+        UIDSet batch;
+        size_t uidCount = 0;
+        size_t byteCount = 0;
+
+        for (const auto &range : uids.getRanges())
+        {
+            for (uint64_t uid = range.first; uid <= range.second; ++uid)
+            {
+                batch.add(uid);
+                ++uidCount;
+
+                auto size = sizes.find(uid);
+                if (size != sizes.end())
+                {
+                    byteCount += size->second;
+                }
+
+                if (uidCount >= batchSize || (batchBytes > 0 && byteCount >= batchBytes))
                 {
-                    fetchUIDs.push_back(serverUID);
+                    commands.push_back("UID FETCH " + batch.toString() + " " + items);
+                    batch = UIDSet();
+                    uidCount = 0;
+                    byteCount = 0;
                 }
             }
         }
 
-        if (!fetchUIDs.empty())
+        if (uidCount > 0)
         {
-            std::string uidList = std::to_string(fetchUIDs[0]);
-            for (size_t i = 1; i < fetchUIDs.size(); ++i)
+            commands.push_back("UID FETCH " + batch.toString() + " " + items);
+        }
+
+        return commands;
+    }
+
+    /**
+     * @brief Parse the size, date and flags of a message from a FETCH response line.
+     *
+     * @param line The FETCH response line with the items UID RFC822.SIZE INTERNALDATE FLAGS.
+     * @param messages The map to update the message in, by UID; the items missing in the line are left unchanged.
+     */
+    static void ParseFetchInfo(const std::string &line, std::map<uint32_t, MessageInfo> &messages)
+    {
+        static const std::regex size_regex(R"(RFC822\.SIZE (\d+))");
+        static const std::regex date_regex(R"(INTERNALDATE " ?(\d{1,2}-[A-Za-z]{3}-\d{4}))");
+        static const std::regex flags_regex(R"(FLAGS \(([^)]*)\))");
+        std::smatch match;
+        std::string uid;
+
+        if (!ParseFetchUID(line, uid))
+        {
+            return;
+        }
+        MessageInfo &info = messages[std::stoul(uid)];
+        info.uid = std::stoul(uid);
+
+        if (std::regex_search(line, match, size_regex))
+        {
+            info.size = std::stoull(match.str(1));
+        }
+        if (std::regex_search(line, match, date_regex))
+        {
+            ArgumentParser::parseDate(match.str(1), info.date);
+        }
+        if (std::regex_search(line, match, flags_regex))
+        {
+            std::string flags = match.str(1);
+            std::transform(flags.begin(), flags.end(), flags.begin(), ::tolower);
+            info.deleted = (" " + flags + " ").find(" \\deleted ") != std::string::npos;
+        }
+    }
+
+    /**
+     * @brief Group messages into FETCH batches in the given order.
+     *
+     * The sequential orders fill every batch with the next messages until it holds batchSize
+     * messages or batchBytes bytes. The packed order puts the largest messages first into the
+     * fullest batch they still fit in (best fit decreasing), so the batches come out about
+     * batchBytes each. Messages flagged \Deleted are about to be expunged, so they come last.
+     *
+     * @param messages The messages to download.
+     * @param order The order to download them in.
+     * @param batchSize The maximum number of messages in one batch.
+     * @param batchBytes The size in bytes a batch is closed at, 0 for no limit; the capacity of a packed batch.
+     * @return std::vector<UIDSet> The UIDs of the batches, in the order to fetch them.
+     */
+    static std::vector<UIDSet> GetOrderedBatches(std::vector<MessageInfo> messages, ArgumentParser::FetchOrder order,
+                                                 size_t batchSize, size_t batchBytes)
+    {
+        using Order = ArgumentParser::FetchOrder;
+        auto deletedLast = std::stable_partition(messages.begin(), messages.end(), [](const MessageInfo &message)
+                                                 { return !message.deleted; });
+        std::vector<UIDSet> batches;
+
+        for (auto group : {std::make_pair(messages.begin(), deletedLast), std::make_pair(deletedLast, messages.end())})
+        {
+            std::vector<MessageInfo> ordered(group.first, group.second);
+
+            if (order == Order::Newest)
+            {
+                std::sort(ordered.begin(), ordered.end(), [](const MessageInfo &a, const MessageInfo &b)
+                          { return a.date != b.date ? a.date > b.date : a.uid > b.uid; });
+            }
+            else if (order == Order::Smallest)
+            {
+                std::sort(ordered.begin(), ordered.end(), [](const MessageInfo &a, const MessageInfo &b)
+                          { return a.size != b.size ? a.size < b.size : a.uid < b.uid; });
+            }
+            else if (order == Order::Packed)
             {
-                uidList += "," + std::to_string(fetchUIDs[i]);
+                std::sort(ordered.begin(), ordered.end(), [](const MessageInfo &a, const MessageInfo &b)
+                          { return a.size != b.size ? a.size > b.size : a.uid < b.uid; });
+
+                // The batches that can take more messages, by their free space
+                std::multimap<size_t, size_t> open;
+                std::vector<size_t> counts;
+                size_t first = batches.size();
+
+                for (const MessageInfo &message : ordered)
+                {
+                    auto fit = open.lower_bound(message.size);
+                    size_t batch;
+                    size_t free;
+                    if (fit == open.end())
+                    {
+                        batch = batches.size();
+                        batches.emplace_back();
+                        counts.push_back(0);
+                        free = batchBytes > message.size ? batchBytes - message.size : 0;
+                    }
+                    else
+                    {
+                        batch = fit->second;
+                        free = fit->first - message.size;
+                        open.erase(fit);
+                    }
+
+                    batches[batch].add(message.uid);
+                    if (++counts[batch - first] < batchSize && free > 0)
+                    {
+                        open.emplace(free, batch);
+                    }
+                }
+                continue;
+            }
+            else
+            {
+                std::sort(ordered.begin(), ordered.end(), [](const MessageInfo &a, const MessageInfo &b)
+                          { return a.uid < b.uid; });
             }
 
-            // Generate the FETCH command
-            return headersOnly ? "UID FETCH " + uidList + " (UID BODY.PEEK[HEADER])" : "UID FETCH " + uidList + " (UID BODY[])";
+            UIDSet batch;
+            size_t count = 0;
+            size_t bytes = 0;
+            for (const MessageInfo &message : ordered)
+            {
+                batch.add(message.uid);
+                bytes += message.size;
+                if (++count >= batchSize || (batchBytes > 0 && bytes >= batchBytes))
+                {
+                    batches.push_back(std::move(batch));
+                    batch = UIDSet();
+                    count = 0;
+                    bytes = 0;
+                }
+            }
+            if (count > 0)
+            {
+                batches.push_back(std::move(batch));
+            }
         }
 
-        return "";
+        return batches;
     }
 
     /**
@@ -185,15 +758,12 @@ public:
      * @param outputDir The directory where the UIDVALIDITY file is saved.
      * @param uidvalidity The UIDVALIDITY string from the SELECT command.
      * @param canonicalHostname The canonical hostname of the mail server.
+     * @param state The sync state of the mailbox.
+     * @param storage The storage of the mailbox.
      */
-    static void EnsureUIDValidity(const std::string &mailbox, const std::string &outputDir, const std::string &uidvalidity, const std::string &canonicalHostname)
+    static void EnsureUIDValidity(const std::string &mailbox, const std::string &outputDir, const std::string &uidvalidity,
+                                  const std::string &canonicalHostname, SyncState &state, Storage &storage)
     {
-        // Create directory if it doesn't exist
-        if (!fs::exists(outputDir))
-        {
-            fs::create_directories(outputDir);
-        }
-
         // File path for saving the UIDVALIDITY
         std::string file_path = outputDir + "/" + canonicalHostname + "_uidvalidity_" + mailbox;
 
@@ -210,22 +780,18 @@ public:
 
                 if (saved_uidvalidity == uidvalidity)
                 {
+                    if (state.getUIDValidity() != std::stoul(uidvalidity))
+                    {
+                        state.setUIDValidity(std::stoul(uidvalidity));
+                        state.save();
+                    }
                     return; // UIDVALIDITY matches, no further action needed
                 }
                 else
                 {
-                    // UIDVALIDITY mismatch: delete local mailbox files
-                    for (const auto &entry : fs::directory_iterator(outputDir))
-                    {
-                        if (entry.is_regular_file())
-                        {
-                            std::string filePath = entry.path().string();
-                            if (filePath.find(outputDir + "/" + canonicalHostname + "_" + mailbox) == 0)
-                            {
-                                fs::remove(filePath);
-                            }
-                        }
-                    }
+                    // UIDVALIDITY mismatch: delete the local mailbox files listed in the sync state
+                    storage.remove(state.getFullEmails().unite(state.getHeadersOnly()));
+                    state.reset(0);
                 }
             }
             else
@@ -235,6 +801,9 @@ public:
             }
         }
 
+        state.setUIDValidity(std::stoul(uidvalidity));
+        state.save();
+
         // Create or overwrite the UIDVALIDITY file
         std::ofstream uidvalidity_file(file_path);
         if (uidvalidity_file.is_open())
@@ -257,12 +826,15 @@ public:
      * @param outputDir The directory where the UIDVALIDITY file is saved.
      * @param selectResponse The response from the SELECT command.
      * @param canonicalHostname The canonical hostname of the mail server.
+     * @param state The loaded sync state of the mailbox.
+     * @param storage The storage of the mailbox.
      * @return true if the UIDVALIDITY was found and handled, false otherwise.
      */
-    static bool HandleUIDValidity(const std::string &mailbox, const std::string &outputDir, const std::string &selectResponse, const std::string &canonicalHostname)
+    static bool HandleUIDValidity(const std::string &mailbox, const std::string &outputDir, const std::string &selectResponse,
+                                  const std::string &canonicalHostname, SyncState &state, Storage &storage)
     {
-        // Check for NO or BAD response
-        if ((selectResponse.find("NO") != std::string::npos) || (selectResponse.find("BAD") != std::string::npos))
+        // Check for NO or BAD response, untagged lines like "* OK [NOMODSEQ]" must not count
+        if (!IsStatusOK(GetStatusLine(selectResponse)))
         {
             std::cerr << "Error: Unexpected response from server." << std::endl;
             return false;
@@ -276,7 +848,7 @@ public:
         {
             std::string uidvalidity = match.str(1);
 
-            EnsureUIDValidity(mailbox, outputDir, uidvalidity, canonicalHostname);
+            EnsureUIDValidity(mailbox, outputDir, uidvalidity, canonicalHostname, state, storage);
         }
         else
         {
@@ -316,96 +888,117 @@ public:
     }
 
     /**
-     * @brief Parse the IMAP response to extract the raw emails and UIDs.
+     * @brief Parse the size of the literal announced at the end of a response line, e.g. "{1234}".
      *
-     * @param fetchResponse The response from the FETCH command.
-     * @param rawEmails The vector to store the raw email strings.
-     * @param UIDs The vector to store the UIDs.
-     * @return true if the parsing was successful, false otherwise.
+     * @param line The response line without the trailing CRLF.
+     * @param size The announced literal size in bytes.
+     * @return true if the line announces a literal, false otherwise.
      */
-    static bool ParseImapResponse(const std::string &fetchResponse, std::vector<std::string> &rawEmails, std::vector<std::string> &UIDs)
+    static bool ParseLiteralSize(const std::string &line, size_t &size)
     {
-        std::istringstream stream(fetchResponse);
-        std::string line;
-        std::string currentEmail;
-        bool readingBody = false;
-        int expectedBodySize = 0;
-        std::string currentUID;
+        if (line.empty() || line.back() != '}')
+        {
+            return false;
+        }
 
-        while (std::getline(stream, line))
+        size_t open = line.rfind('{');
+        if (open == std::string::npos || open + 2 > line.size() - 1)
         {
-            // Check for error tags in the response
-            if (!readingBody && ((line.find("NO") != std::string::npos) || (line.find("BAD") != std::string::npos)))
-            {
-                std::cerr << "Error in server response: " << line << std::endl;
-                return false; // Stop parsing on error
-            }
+            return false;
+        }
 
-            // Skip untagged responses like EXISTS, RECENT, EXPUNGE
-            if (line.find("* ") == 0 && (line.find("EXISTS") != std::string::npos || line.find("RECENT") != std::string::npos || line.find("EXPUNGE") != std::string::npos))
-            {
-                continue;
-            }
-            // Check for the start of a new FETCH response
-            if (line.find("FETCH (UID ") != std::string::npos)
-            {
-                // Store the previous email if we were reading a body
-                if (!currentEmail.empty() && readingBody && expectedBodySize == 0)
-                {
-                    rawEmails.push_back(currentEmail);
-                    currentEmail.clear();
-                }
+        std::string digits = line.substr(open + 1, line.size() - open - 2);
+        if (!digits.empty() && digits.back() == '+')
+        {
+            digits.pop_back(); // Non-synchronizing literal (RFC 7888)
+        }
 
-                // Find and extract the UID
-                size_t uidStart = line.find("UID ") + 4;
-                size_t uidEnd = line.find(" ", uidStart);
-                currentUID = line.substr(uidStart, uidEnd - uidStart);
-                UIDs.push_back(currentUID);
+        if (digits.empty() || !std::all_of(digits.begin(), digits.end(), ::isdigit))
+        {
+            return false;
+        }
 
-                // Check for the body size
-                size_t bodyStart = line.find("{");
-                if (bodyStart != std::string::npos)
-                {
-                    size_t bodyEnd = line.find("}", bodyStart);
-                    expectedBodySize = std::stoi(line.substr(bodyStart + 1, bodyEnd - bodyStart - 1));
-                    readingBody = true;
-                }
-            }
-            else if (readingBody)
-            {
-                currentEmail += line + "\n";
-                expectedBodySize -= line.length() + 1;
+        size = std::stoull(digits);
+        return true;
+    }
 
-                if (expectedBodySize <= 0)
-                {
-                    rawEmails.push_back(currentEmail);
-                    currentEmail.clear();
-                    readingBody = false;
-                }
-            }
+    /**
+     * @brief Find the UID in the data items of a FETCH response.
+     *
+     * @param fetchItems The FETCH response lines, literals excluded.
+     * @param uid The UID found.
+     * @return true if the UID was found, false otherwise.
+     */
+    static bool ParseFetchUID(const std::string &fetchItems, std::string &uid)
+    {
+        static const std::regex uid_regex(R"([( ]UID (\d+))");
+        std::smatch match;
+
+        if (std::regex_search(fetchItems, match, uid_regex))
+        {
+            uid = match.str(1);
+            return true;
         }
 
-        // Handle the last email in case it was not added
-        if (!currentEmail.empty() && readingBody && expectedBodySize == 0)
+        return false;
+    }
+
+    /**
+     * @brief Find the RFC822.SIZE in the data items of a FETCH response.
+     *
+     * @param fetchItems The FETCH response lines, literals excluded.
+     * @param size The size found.
+     * @return true if the size was found, false otherwise.
+     */
+    static bool ParseFetchSize(const std::string &fetchItems, uint64_t &size)
+    {
+        static const std::regex size_regex(R"([( ]RFC822\.SIZE (\d{1,19}))");
+        std::smatch match;
+
+        if (std::regex_search(fetchItems, match, size_regex))
         {
-            rawEmails.push_back(currentEmail);
+            size = std::stoull(match.str(1));
+            return true;
         }
 
-        return true;
+        return false;
     }
 
     /**
-     * @brief Check if headerfile exists and delete it. Used for upgrading from headers to full emails.
+     * @brief Check whether a tagged completion line reports success.
      *
-     * @param filename The name of the file to check and delete.
+     * @param statusLine The tagged line, e.g. "A005 OK FETCH completed".
+     * @return true if the status is OK, false for NO, BAD or anything unexpected.
      */
-    static void CheckIfHeaderFileExistsAndDelete(const std::string &filename)
+    static bool IsStatusOK(const std::string &statusLine)
     {
-        std::string headerfile = filename + "_headers.eml";
+        std::istringstream iss(statusLine);
+        std::string tag;
+        std::string status;
+        iss >> tag >> status;
+
+        return status == "OK";
+    }
 
-        if (fs::exists(headerfile))
+    /**
+     * @brief Get the tagged completion line of a response.
+     *
+     * @param response The full server response.
+     * @return std::string The last line of the response.
+     */
+    static std::string GetStatusLine(const std::string &response)
+    {
+        size_t end = response.size();
+        if (end >= 2 && response.compare(end - 2, 2, "\r\n") == 0)
         {
-            fs::remove(headerfile);
+            end -= 2;
         }
+
+        size_t start = response.rfind("\r\n", end == 0 ? 0 : end - 1);
+        start = start == std::string::npos ? 0 : start + 2;
+
+        return response.substr(start, end - start);
     }
-};
\ No newline at end of file
+};
+
+#endif
@@ -5,142 +5,1398 @@
  * @brief A file implementing an abstraction for an IMAP client using OpenSSL.
  */
 
+#ifndef IMAPCLIENT_CPP
+#define IMAPCLIENT_CPP
+
 #include <iostream>
 #include <iomanip>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
+#include <zlib.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sstream>
 #include <cstring>
+#include <fstream>
 #include <fcntl.h>
 #include <regex>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include "Helpers.cpp"
+#include "EventLoop.cpp"
+
+/**
+ * @class IMAPClient
+ * @brief An IMAP client class that can connect to an IMAP server using regular sockets or SSL.
+ *
+ * The socket is non-blocking and driven by an EventLoop, which may be shared by many clients.
+ * Commands are sent with sendCommandAsync() and complete through callbacks as their responses
+ * arrive. The blocking methods like sendCommand() run the event loop until their command completes,
+ * and throw a ConnectionError if the connection is lost or times out meanwhile.
+ */
+class IMAPClient
+{
+public:
+    using LineHandler = std::function<void(const std::string &)>;     // Receives a response line without CRLF
+    using LiteralHandler = std::function<void(const char *, size_t)>; // Receives a chunk of literal data
+    using DoneHandler = std::function<void(const std::string &)>;     // Receives the tagged completion line
+    using LiteralFileHandler = std::function<int()>;                  // Gives a file the literal may be moved to directly
+
+    /**
+     * @class ConnectionError
+     * @brief The connection was lost while a blocking method waited for the server. Every command
+     * in flight has completed with a NO generated locally, the client cannot be used any more.
+     */
+    class ConnectionError : public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    /**
+     * @struct ConnectionOptions
+     * @brief How a connection is tuned for the link to the server.
+     */
+    struct ConnectionOptions
+    {
+        int connectTimeout = 5;        // Seconds to resolve the server, connect and get the greeting
+        int readTimeout = 5;           // Seconds the server may stay silent during a command, raised for slow servers
+        size_t readBufferSize = 65536; // Bytes read from the socket at once
+        int receiveBuffer = 0;         // SO_RCVBUF in bytes, 0 to let the system tune it
+        int sendBuffer = 0;            // SO_SNDBUF in bytes, 0 to let the system tune it
+        bool noDelay = true;           // Whether to send commands at once (TCP_NODELAY) instead of coalescing them
+        int keepAlive = 60;            // Seconds of silence before TCP keepalive probes, 0 for none
+    };
+
+private:
+    /**
+     * @struct PendingCommand
+     * @brief A command sent to the server that has not completed yet.
+     */
+    struct PendingCommand
+    {
+        std::string tag;                  // The tag of the command, "*" for the server greeting
+        LineHandler onLine;               // Callback for the untagged lines of the response
+        LiteralHandler onLiteral;         // Callback for the literal data of the response
+        DoneHandler onDone;               // Callback for the completion line
+        LiteralFileHandler onLiteralFile; // Callback for the file the literal data goes to, if any
+        std::chrono::steady_clock::time_point sent; // When the command was sent to an idle connection, zero if it was not
+    };
+
+    /**
+     * @struct ResolvedHost
+     * @brief A cached resolution of a server name.
+     */
+    struct ResolvedHost
+    {
+        std::vector<sockaddr_storage> addresses;       // The addresses of the server in the order to try them
+        std::string canonicalName;                     // The name the address resolves back to
+        std::chrono::steady_clock::time_point expires; // When the entry has to be resolved again
+    };
+
+    /**
+     * @struct KnownHostname
+     * @brief A canonical hostname found by a reverse lookup, kept between runs.
+     */
+    struct KnownHostname
+    {
+        std::string address;       // The address that was looked up
+        std::string canonicalName; // The name it resolved to
+    };
+
+    static inline std::mutex shared_mutex;                             // Guards the process-wide caches below
+    static inline std::map<std::string, ResolvedHost> resolved_hosts;  // Resolved servers by name
+    static inline std::map<std::string, SSL_CTX *> contexts;           // TLS contexts by certificate locations
+    static inline std::map<std::string, SSL_SESSION *> sessions;       // Resumable TLS sessions by server and port
+    static inline std::string session_file;                            // Where the sessions are kept between runs
+    static inline std::map<std::string, KnownHostname> known_hostnames; // Reverse lookups by server name
+    static inline std::string hostname_file;                           // Where the reverse lookups are kept between runs
+    static constexpr std::chrono::seconds RESOLVE_LIFETIME{300};       // How long a resolved server is reused
+    static constexpr std::chrono::milliseconds CONNECTION_ATTEMPT_DELAY{250}; // Head start of an address (RFC 8305)
+    static constexpr std::chrono::seconds IDLE_LIMIT{29 * 60};         // How long IDLE lasts before it is renewed
+    static constexpr int READ_TIMEOUT_RTOS = 4;                        // Retransmission timeouts of the latency a read may take
+
+    int socket_fd;       // Socket file descriptor
+    SSL *ssl;            // SSL structure
+    bool use_tls;        // Whether to use SSL/TLS
+    std::string session_key; // The key of the TLS session of the connection in sessions
+    int command_counter; // Counter for IMAP commands (tagged)
+    std::string capabilities; // Capabilities announced by the server, separated and surrounded by spaces
+    ConnectionOptions options; // How the connection is tuned
+    double latency;           // Smoothed time from sending a command to its first response line in seconds (RFC 6298 SRTT)
+    double latencyVariation;  // Smoothed variation of the latency in seconds (RFC 6298 RTTVAR)
+    std::chrono::steady_clock::time_point deadline; // When the blocking methods give up, max for never
+
+    std::unique_ptr<EventLoop> own_loop; // The event loop of the client unless a shared one was given
+    EventLoop *loop;                     // The event loop driving the socket
+    uint32_t watched_events;             // The epoll events currently watched on the socket
+    bool handshaking;                    // Whether the TLS handshake is in progress
+    bool handshake_wants_write;          // Whether the TLS handshake waits for the socket to be writable
+    bool read_wants_write;               // Whether a TLS read waits for the socket to be writable
+    bool write_wants_read;               // Whether a TLS write waits for the socket to be readable
+    bool failed;                         // Whether the connection failed or was closed
+    bool aborted;                        // Whether commands were completed locally because of the failure
+    std::string failure;                 // Why the connection failed
+
+    std::vector<char> read_buffer; // Data received from the server, not consumed yet
+    size_t read_start;             // Start of the unconsumed data in read_buffer
+    size_t read_end;               // End of the unconsumed data in read_buffer
+    std::string write_buffer;      // Data for the socket not sent yet, compressed if compressing
+    size_t write_offset;           // Start of the unsent data in write_buffer
+
+    bool compressing;                 // Whether COMPRESS DEFLATE (RFC 4978) is active
+    z_stream inflater;                // Decompresses the data received from the server
+    z_stream deflater;                // Compresses the data sent to the server
+    std::vector<char> compressed_in;  // Compressed data received from the server
+    bool inflate_pending;             // Whether the inflater may produce output without reading the socket
+
+    std::deque<PendingCommand> pending; // Commands in flight, oldest first
+    std::string line_buffer;            // The response line being received
+    size_t literal_remaining;           // The number of literal bytes still to be received
+    LiteralHandler literal_sink;        // Callback for the literal being received
+    bool continuation;                  // Whether the next line continues a response after a literal
+    LiteralFileHandler literal_file;    // Callback for the file the literal being received goes to
+    int splice_pipe[2];                 // Pipe moving literals from the socket to their files in the kernel
+
+    /**
+     * @brief Generate the tag of the next command.
+     * @return The tag
+     */
+    std::string nextTag()
+    {
+        std::stringstream tag;
+        tag << "A" << std::setw(3) << std::setfill('0') << command_counter++;
+        return tag.str();
+    }
+
+    /**
+     * @brief Watch the socket for the events the connection currently waits for.
+     */
+    void updateEvents()
+    {
+        if (socket_fd == -1 || failed)
+        {
+            return;
+        }
+
+        bool want_write = handshaking ? handshake_wants_write
+                                      : read_wants_write || (write_offset < write_buffer.size() && !write_wants_read);
+        uint32_t events = want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+
+        if (events != watched_events)
+        {
+            loop->modify(socket_fd, events);
+            watched_events = events;
+        }
+    }
+
+    /**
+     * @brief Mark the connection as failed and complete every pending command with a NO
+     * status line generated locally, so that no caller keeps waiting for it.
+     *
+     * @param message The error message
+     */
+    void fail(const std::string &message)
+    {
+        if (failed)
+        {
+            return;
+        }
+
+        failed = true;
+        failure = message;
+        loop->remove(socket_fd);
+
+        if (pending.empty())
+        {
+            return; // E.g. closed after LOGOUT, only an error if another command is sent
+        }
+        std::cerr << "Error: " << message << std::endl;
+        aborted = true;
+
+        std::deque<PendingCommand> abortedCommands;
+        abortedCommands.swap(pending);
+        for (PendingCommand &command : abortedCommands)
+        {
+            if (command.onDone)
+            {
+                command.onDone(command.tag + " NO " + message);
+            }
+        }
+    }
+
+    /**
+     * @brief Continue the TLS handshake as far as the socket allows.
+     */
+    void continueHandshake()
+    {
+        int result = SSL_connect(ssl);
+        if (result == 1)
+        {
+            handshaking = false;
+            flushWrites();
+            readAvailable(); // The greeting may have arrived with the last handshake record
+            return;
+        }
+
+        int error = SSL_get_error(ssl, result);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+        {
+            handshake_wants_write = error == SSL_ERROR_WANT_WRITE;
+            updateEvents();
+            return;
+        }
+
+        ERR_print_errors_fp(stderr);
+        fail("SSL/TLS handshake failed.");
+    }
+
+    /**
+     * @brief Queue data for the server, compressing it if compression is active. The data is
+     * flushed through the compressor at once, so the server can act on every command right away.
+     *
+     * @param data The data to send
+     */
+    void queueWrite(const std::string &data)
+    {
+        if (!compressing)
+        {
+            write_buffer.append(data);
+            return;
+        }
+
+        deflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+        deflater.avail_in = static_cast<uInt>(data.size());
+
+        char chunk[4096];
+        do
+        {
+            deflater.next_out = reinterpret_cast<Bytef *>(chunk);
+            deflater.avail_out = sizeof(chunk);
+            deflate(&deflater, Z_SYNC_FLUSH);
+            write_buffer.append(chunk, sizeof(chunk) - deflater.avail_out);
+        } while (deflater.avail_out == 0);
+    }
+
+    /**
+     * @brief Read from the socket, through TLS if it is used, without blocking.
+     *
+     * @param buffer The buffer to read into
+     * @param size The size of the buffer
+     * @return The number of bytes read, 0 if nothing is available now, -1 if the connection failed
+     */
+    ssize_t receive(char *buffer, size_t size)
+    {
+        ssize_t bytes_read;
+
+        if (use_tls)
+        {
+            bytes_read = SSL_read(ssl, buffer, static_cast<int>(std::min<size_t>(size, INT32_MAX)));
+            if (bytes_read <= 0)
+            {
+                int error = SSL_get_error(ssl, bytes_read);
+                if (error == SSL_ERROR_WANT_READ)
+                {
+                    return 0;
+                }
+                if (error == SSL_ERROR_WANT_WRITE)
+                {
+                    read_wants_write = true; // E.g. a renegotiation, continue once writable
+                    updateEvents();
+                    return 0;
+                }
+                fail(error == SSL_ERROR_ZERO_RETURN || error == SSL_ERROR_SYSCALL ? "Connection closed by server."
+                                                                                    : "Error reading from server.");
+                return -1;
+            }
+        }
+        else
+        {
+            bytes_read = recv(socket_fd, buffer, size, 0);
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+                return 0;
+            }
+            if (bytes_read <= 0)
+            {
+                fail(bytes_read == 0 ? "Connection closed by server." : "Error reading from server.");
+                return -1;
+            }
+        }
+
+        return bytes_read;
+    }
+
+    /**
+     * @brief Send as much of the queued commands as the socket accepts without blocking.
+     */
+    void flushWrites()
+    {
+        while (!handshaking && !failed && write_offset < write_buffer.size())
+        {
+            const char *data = write_buffer.data() + write_offset;
+            size_t length = write_buffer.size() - write_offset;
+            ssize_t written;
+
+            if (use_tls)
+            {
+                written = SSL_write(ssl, data, static_cast<int>(std::min<size_t>(length, INT32_MAX)));
+                if (written <= 0)
+                {
+                    int error = SSL_get_error(ssl, written);
+                    if (error == SSL_ERROR_WANT_WRITE)
+                    {
+                        break; // Continue once the socket is writable
+                    }
+                    if (error == SSL_ERROR_WANT_READ)
+                    {
+                        write_wants_read = true; // Continue once the socket is readable
+                        break;
+                    }
+                    fail("Error writing to server.");
+                    return;
+                }
+            }
+            else
+            {
+                written = send(socket_fd, data, length, MSG_NOSIGNAL);
+                if (written < 0)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        break;
+                    }
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    fail("Error writing to server.");
+                    return;
+                }
+            }
+
+            write_offset += written;
+        }
+
+        if (write_offset == write_buffer.size())
+        {
+            write_buffer.clear();
+            write_offset = 0;
+        }
+
+        updateEvents();
+    }
+
+    /**
+     * @brief Create the pipe literals are spliced through, unless it exists already.
+     * @return true if the pipe exists, false otherwise
+     */
+    bool openSplicePipe()
+    {
+        return splice_pipe[0] >= 0 || pipe2(splice_pipe, O_CLOEXEC) == 0;
+    }
+
+    /**
+     * @brief Move the next part of the literal being received from the socket to a file through
+     * the splice pipe. The literal handler is called with no data and the number of bytes moved.
+     * Bytes the file does not take are passed to the literal handler as usual, so it sees the error.
+     *
+     * @param fd The file descriptor of the file
+     * @return The number of bytes received, 0 if nothing is available now, -1 if the connection failed
+     */
+    ssize_t spliceLiteral(int fd)
+    {
+        ssize_t received = splice(socket_fd, nullptr, splice_pipe[1], nullptr, std::min<size_t>(literal_remaining, 65536),
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (received < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return 0;
+        }
+        if (received <= 0)
+        {
+            fail(received == 0 ? "Connection closed by server." : "Error reading from server.");
+            return -1;
+        }
+        literal_remaining -= received;
+
+        size_t left = received;
+        while (left > 0)
+        {
+            ssize_t written = splice(splice_pipe[0], nullptr, fd, nullptr, left, SPLICE_F_MOVE);
+            if (written <= 0)
+            {
+                break;
+            }
+            left -= written;
+        }
+
+        if (literal_sink && left < static_cast<size_t>(received))
+        {
+            literal_sink(nullptr, received - left);
+        }
+
+        while (left > 0)
+        {
+            ssize_t bytes_read = read(splice_pipe[0], read_buffer.data(), std::min(left, read_buffer.size()));
+            if (bytes_read <= 0)
+            {
+                fail("Error reading from server.");
+                return -1;
+            }
+            left -= bytes_read;
+            if (literal_sink)
+            {
+                literal_sink(read_buffer.data(), bytes_read);
+            }
+        }
+
+        return received;
+    }
+
+    /**
+     * @brief Read what the socket has without blocking and process it.
+     */
+    void readAvailable()
+    {
+        // Bound the work per event, so that one busy connection does not starve the others
+        for (int reads = 0; reads < 16 && !failed; ++reads)
+        {
+            processBuffer();
+            if (failed)
+            {
+                return;
+            }
+
+            read_start = 0;
+            read_end = 0;
+
+            // Literals of a plain connection go from the socket to their files without being copied
+            if (literal_remaining > 0 && literal_file && !use_tls && !compressing && openSplicePipe())
+            {
+                int fd = literal_file();
+                if (fd >= 0)
+                {
+                    if (spliceLiteral(fd) <= 0)
+                    {
+                        return;
+                    }
+                    continue;
+                }
+            }
+
+            if (!compressing)
+            {
+                ssize_t bytes_read = receive(read_buffer.data(), read_buffer.size());
+                if (bytes_read <= 0)
+                {
+                    return;
+                }
+                read_end = bytes_read;
+                continue;
+            }
+
+            // The inflater may still hold input or output from the last read
+            if (inflater.avail_in == 0 && !inflate_pending)
+            {
+                ssize_t bytes_read = receive(compressed_in.data(), compressed_in.size());
+                if (bytes_read <= 0)
+                {
+                    return;
+                }
+                inflater.next_in = reinterpret_cast<Bytef *>(compressed_in.data());
+                inflater.avail_in = static_cast<uInt>(bytes_read);
+            }
+
+            inflater.next_out = reinterpret_cast<Bytef *>(read_buffer.data());
+            inflater.avail_out = static_cast<uInt>(read_buffer.size());
+            int result = inflate(&inflater, Z_SYNC_FLUSH);
+            if (result != Z_OK && result != Z_BUF_ERROR)
+            {
+                fail("Error decompressing data from server.");
+                return;
+            }
+
+            read_end = read_buffer.size() - inflater.avail_out;
+            inflate_pending = inflater.avail_in > 0 || inflater.avail_out == 0;
+        }
+
+        processBuffer();
+
+        // Data left inside OpenSSL or zlib would never wake up epoll, more data on the socket would
+        if (!failed && ((use_tls && SSL_pending(ssl) > 0) || (compressing && inflate_pending)))
+        {
+            loop->markReady(socket_fd);
+        }
+    }
+
+    /**
+     * @brief Split the received data into response lines and literals and pass them on.
+     * The position is advanced before every callback, so a callback may itself run the event loop.
+     */
+    void processBuffer()
+    {
+        while (read_start < read_end && !failed)
+        {
+            const char *begin = read_buffer.data() + read_start;
+            size_t available = read_end - read_start;
+
+            if (literal_remaining > 0)
+            {
+                size_t chunk = std::min(literal_remaining, available);
+                read_start += chunk;
+                literal_remaining -= chunk;
+                if (literal_sink)
+                {
+                    literal_sink(begin, chunk);
+                }
+                continue;
+            }
+
+            const char *newline = static_cast<const char *>(memchr(begin, '\n', available));
+            if (newline == nullptr)
+            {
+                line_buffer.append(begin, available);
+                read_start = read_end;
+                return;
+            }
+
+            line_buffer.append(begin, newline - begin);
+            read_start += newline - begin + 1;
+
+            std::string line = std::move(line_buffer);
+            line_buffer.clear();
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+
+            handleLine(line);
+        }
+    }
+
+    /**
+     * @brief Pass a response line to the command it belongs to.
+     * @param line The line without the trailing CRLF
+     */
+    void handleLine(const std::string &line)
+    {
+        if (pending.empty())
+        {
+            return; // Unsolicited data, e.g. the BYE after LOGOUT completed
+        }
+
+        if (pending.front().sent != std::chrono::steady_clock::time_point())
+        {
+            measureLatency(std::chrono::steady_clock::now() - pending.front().sent);
+            pending.front().sent = std::chrono::steady_clock::time_point();
+        }
+
+        bool completion = pending.front().tag == "*" || // The greeting is a single line
+                          (!continuation && line.compare(0, 2, "* ") != 0 && line.compare(0, 2, "+ ") != 0);
+
+        if (completion)
+        {
+            continuation = false;
+
+            auto command = pending.begin();
+            if (command->tag != "*")
+            {
+                std::string tag = line.substr(0, line.find(' '));
+                command = std::find_if(pending.begin(), pending.end(), [&tag](const PendingCommand &pendingCommand)
+                                       { return pendingCommand.tag == tag; });
+                if (command == pending.end())
+                {
+                    return; // Not one of ours
+                }
+            }
+
+            DoneHandler onDone = std::move(command->onDone);
+            pending.erase(command);
+            if (onDone)
+            {
+                onDone(line);
+            }
+            return;
+        }
+
+        // Untagged data of pipelined commands arrives in order, so it belongs to the oldest one
+        const PendingCommand &command = pending.front();
+        literal_sink = command.onLiteral;
+        literal_file = command.onLiteralFile;
+
+        size_t literal_size;
+        continuation = Helpers::ParseLiteralSize(line, literal_size);
+        literal_remaining = continuation ? literal_size : 0;
+
+        if (command.onLine)
+        {
+            command.onLine(line);
+        }
+    }
+
+    /**
+     * @brief Handle the events of the socket.
+     * @param events The epoll events that occurred
+     */
+    void onSocketEvent(uint32_t events)
+    {
+        if (handshaking)
+        {
+            continueHandshake();
+            return;
+        }
+
+        if ((events & EPOLLOUT) && read_wants_write)
+        {
+            read_wants_write = false;
+        }
+        if ((events & EPOLLIN) && write_wants_read)
+        {
+            write_wants_read = false;
+        }
+
+        if (write_offset < write_buffer.size())
+        {
+            flushWrites();
+        }
+        readAvailable();
+    }
+
+    /**
+     * @brief Record the latency of a command sent to an idle connection, i.e. the round trip
+     * plus the time the server took to start its response.
+     *
+     * @param sample The time from sending the command to its first response line
+     */
+    void measureLatency(std::chrono::steady_clock::duration sample)
+    {
+        double seconds = std::chrono::duration<double>(sample).count();
+        if (latency == 0)
+        {
+            latency = seconds;
+            latencyVariation = seconds / 2;
+            return;
+        }
+
+        latencyVariation = 0.75 * latencyVariation + 0.25 * std::abs(latency - seconds);
+        latency = 0.875 * latency + 0.125 * seconds;
+    }
+
+    /**
+     * @brief Get how long the server may stay silent during a command. Follows the latencies
+     * measured so far, so slow servers and long links get more time, but never less than configured.
+     *
+     * @return The timeout in milliseconds
+     */
+    int getReadTimeout() const
+    {
+        double retransmission = latency + 4 * latencyVariation; // RTO of RFC 6298
+        return static_cast<int>(1000 * std::max<double>(options.readTimeout, READ_TIMEOUT_RTOS * retransmission));
+    }
+
+    /**
+     * @brief Run the event loop until a command completes. A connection that fails, stays
+     * silent for too long or reaches the deadline is given up, so that the caller can continue
+     * on a new one.
+     *
+     * @param done Condition that holds once the command completed
+     * @throws ConnectionError if the command was aborted because the connection failed
+     */
+    void waitFor(const std::function<bool()> &done)
+    {
+        if (!loop->runUntil([&]()
+                            { return done() || failed; }, socket_fd, getReadTimeout(), deadline))
+        {
+            fail(std::chrono::steady_clock::now() >= deadline ? "Time limit reached." : "Read operation timed out.");
+        }
+
+        if (aborted || !done())
+        {
+            throw ConnectionError(failure);
+        }
+    }
+
+    /**
+     * @brief Get the length of a socket address.
+     * @param address The address
+     * @return The length of the address of its family
+     */
+    static socklen_t addressLength(const sockaddr_storage &address)
+    {
+        return address.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    }
+
+    /**
+     * @brief Look up the addresses of a server without waiting longer than the timeout, also
+     * when the resolver does not answer.
+     *
+     * The lookup runs asynchronously in getaddrinfo_a() only so that it can be given up after the
+     * timeout, the calling thread still blocks in gai_suspend() until it completes or times out.
+     *
+     * @param server The server address
+     * @param timeout The timeout in seconds
+     * @param addresses The addresses, IPv6 and IPv4 interleaved as RFC 8305 recommends
+     * @return true if the server was resolved, false otherwise
+     */
+    static bool lookUpAddresses(const std::string &server, int timeout, std::vector<sockaddr_storage> &addresses)
+    {
+        // The request must stay valid until the resolver is done with it, even after a timeout
+        struct Lookup
+        {
+            std::string name;
+            struct addrinfo hints;
+            struct gaicb request;
+        };
+        Lookup *lookup = new Lookup();
+        lookup->name = server;
+        lookup->hints.ai_family = AF_UNSPEC;
+        lookup->hints.ai_socktype = SOCK_STREAM;
+        lookup->hints.ai_flags = AI_ADDRCONFIG;
+        lookup->request.ar_name = lookup->name.c_str();
+        lookup->request.ar_request = &lookup->hints;
+
+        struct gaicb *requests[] = {&lookup->request};
+        if (getaddrinfo_a(GAI_NOWAIT, requests, 1, nullptr) != 0)
+        {
+            std::cerr << "Error: Failed to resolve hostname." << std::endl;
+            delete lookup;
+            return false;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+        while (gai_error(&lookup->request) == EAI_INPROGRESS && std::chrono::steady_clock::now() < deadline)
+        {
+            auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+            struct timespec wait = {static_cast<time_t>(remaining.count() / 1000000000), static_cast<long>(remaining.count() % 1000000000)};
+            gai_suspend(requests, 1, &wait);
+        }
+
+        int result = gai_error(&lookup->request);
+        if (result == EAI_INPROGRESS)
+        {
+            std::cerr << "Error: Resolving hostname timed out." << std::endl;
+            if (gai_cancel(&lookup->request) == EAI_CANCELED)
+            {
+                delete lookup;
+            }
+            return false; // Otherwise the resolver still uses the request, it is left to it
+        }
+        if (result != 0)
+        {
+            std::cerr << "Error: Failed to resolve hostname." << std::endl;
+            delete lookup;
+            return false;
+        }
+
+        // Alternate the families, starting with the one the resolver prefers
+        std::vector<sockaddr_storage> preferred, other;
+        int preferredFamily = lookup->request.ar_result->ai_family;
+        for (struct addrinfo *entry = lookup->request.ar_result; entry != nullptr; entry = entry->ai_next)
+        {
+            if (entry->ai_family != AF_INET && entry->ai_family != AF_INET6)
+            {
+                continue;
+            }
+            sockaddr_storage address = {};
+            memcpy(&address, entry->ai_addr, entry->ai_addrlen);
+            (entry->ai_family == preferredFamily ? preferred : other).push_back(address);
+        }
+        freeaddrinfo(lookup->request.ar_result);
+        delete lookup;
+
+        addresses.clear();
+        for (size_t i = 0; i < std::max(preferred.size(), other.size()); ++i)
+        {
+            if (i < preferred.size())
+            {
+                addresses.push_back(preferred[i]);
+            }
+            if (i < other.size())
+            {
+                addresses.push_back(other[i]);
+            }
+        }
+
+        return !addresses.empty();
+    }
+
+    /**
+     * @brief Write the known canonical hostnames to the hostname file. Must be called with
+     * shared_mutex locked.
+     */
+    static void saveHostnames()
+    {
+        if (hostname_file.empty())
+        {
+            return;
+        }
+
+        std::string temporary = hostname_file + ".tmp";
+        std::ofstream file(temporary);
+        for (const auto &known : known_hostnames)
+        {
+            file << known.first << " " << known.second.address << " " << known.second.canonicalName << "\n";
+        }
+        file.close();
+
+        if (file.fail() || rename(temporary.c_str(), hostname_file.c_str()) != 0)
+        {
+            std::cerr << "Failed to write hostname cache: " << hostname_file << std::endl;
+            unlink(temporary.c_str());
+        }
+    }
+
+    /**
+     * @brief Find the canonical hostname of a server by a reverse lookup. The lookup is only done
+     * when the address is new, its result is kept in the hostname file, so that slow PTR records
+     * do not delay every run.
+     *
+     * @param server The server address
+     * @param addresses The addresses of the server
+     * @return The canonical hostname, the server address if the lookup failed
+     */
+    static std::string findCanonicalName(const std::string &server, const std::vector<sockaddr_storage> &addresses)
+    {
+        // An IPv4 address is looked up if there is one, as the original client did
+        const sockaddr_storage *address = &addresses.front();
+        for (const sockaddr_storage &candidate : addresses)
+        {
+            if (candidate.ss_family == AF_INET)
+            {
+                address = &candidate;
+                break;
+            }
+        }
+
+        char numeric[NI_MAXHOST];
+        if (getnameinfo((const struct sockaddr *)address, addressLength(*address), numeric, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0)
+        {
+            numeric[0] = '\0';
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(shared_mutex);
+            auto known = known_hostnames.find(server);
+            if (known != known_hostnames.end())
+            {
+                for (const sockaddr_storage &candidate : addresses)
+                {
+                    char text[NI_MAXHOST];
+                    if (getnameinfo((const struct sockaddr *)&candidate, addressLength(candidate), text, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) == 0 &&
+                        known->second.address == text)
+                    {
+                        return known->second.canonicalName;
+                    }
+                }
+            }
+        }
+
+        // Get the canonical hostname of the server
+        char hostname[NI_MAXHOST];
+        int result = getnameinfo((const struct sockaddr *)address, addressLength(*address), hostname, NI_MAXHOST, NULL, 0, 0);
+        if (result != 0)
+        {
+            std::cerr << "Error: Failed to get canonical hostname: " << gai_strerror(result) << std::endl;
+            return server;
+        }
+
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        if (numeric[0] != '\0')
+        {
+            known_hostnames[server] = {numeric, hostname};
+            saveHostnames();
+        }
+        return std::string(hostname);
+    }
+
+    /**
+     * @brief Resolve a server name and the canonical hostname of its address. The results are
+     * shared by all connections of the process for a few minutes, so a long-running process does
+     * not repeat the lookups for every connection.
+     *
+     * @param server The server address
+     * @param timeout The timeout of the lookup in seconds
+     * @param host The resolved server
+     * @return true if the server was resolved, false otherwise
+     */
+    static bool resolveHost(const std::string &server, int timeout, ResolvedHost &host)
+    {
+        {
+            std::lock_guard<std::mutex> lock(shared_mutex);
+            auto cached = resolved_hosts.find(server);
+            if (cached != resolved_hosts.end() && cached->second.expires > std::chrono::steady_clock::now())
+            {
+                host = cached->second;
+                return true;
+            }
+        }
+
+        // The lookups run without the lock, so that a slow one does not hold up other servers
+        if (!lookUpAddresses(server, timeout, host.addresses))
+        {
+            return false;
+        }
+        host.canonicalName = findCanonicalName(server, host.addresses);
+        host.expires = std::chrono::steady_clock::now() + RESOLVE_LIFETIME;
+
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        resolved_hosts[server] = host;
+        return true;
+    }
+
+    /**
+     * @brief Apply the socket options of a connection. Runs before connect(), the receive buffer
+     * determines the TCP window scale negotiated in the handshake.
+     *
+     * @param fd The socket
+     * @param options The options of the connection
+     */
+    static void tuneSocket(int fd, const ConnectionOptions &options)
+    {
+        int enabled = 1;
+
+        // A fixed buffer size turns off the autotuning of the system, so it is only set when asked for
+        if (options.receiveBuffer > 0)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.receiveBuffer, sizeof(options.receiveBuffer));
+        }
+        if (options.sendBuffer > 0)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.sendBuffer, sizeof(options.sendBuffer));
+        }
+
+        // Pipelined commands are small writes, Nagle's algorithm would hold them back until the previous one is acknowledged
+        if (options.noDelay)
+        {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+        }
+
+        // Keeps NAT mappings of idle connections alive and detects dead ones, e.g. during IDLE
+        if (options.keepAlive > 0)
+        {
+            int interval = std::max(options.keepAlive / 4, 1);
+            int probes = 4;
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &options.keepAlive, sizeof(options.keepAlive));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+        }
+    }
+
+    /**
+     * @brief Connect to the first address that accepts the connection. The addresses are tried
+     * in order, each one gets a head start before the next attempt starts in parallel, and
+     * a failed attempt starts the next one at once (happy eyeballs, RFC 8305). The attempts
+     * are watched by the event loop, so the other connections of the loop go on meanwhile.
+     *
+     * @param addresses The addresses to try
+     * @param port The port number
+     * @param options The options of the connection, with the timeout of the whole connection
+     * @return The connected non-blocking socket, -1 if no address accepted the connection
+     */
+    int connectToAny(const std::vector<sockaddr_storage> &addresses, int port, const ConnectionOptions &options)
+    {
+        int timeout = options.connectTimeout;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+        auto nextAttempt = std::chrono::steady_clock::now();
+        std::vector<int> attempts;  // The sockets still connecting
+        std::vector<int> completed; // The sockets whose connection attempt ended, reported by the loop
+        size_t next = 0;
+        int connected = -1;
+
+        while (connected < 0)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                break;
+            }
+
+            if (next < addresses.size() && (now >= nextAttempt || attempts.empty()))
+            {
+                sockaddr_storage address = addresses[next++];
+                if (address.ss_family == AF_INET6)
+                {
+                    reinterpret_cast<sockaddr_in6 *>(&address)->sin6_port = htons(port);
+                }
+                else
+                {
+                    reinterpret_cast<sockaddr_in *>(&address)->sin_port = htons(port);
+                }
+
+                int fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                {
+                    continue;
+                }
+                tuneSocket(fd, options);
+
+                int result = ::connect(fd, (const struct sockaddr *)&address, addressLength(address));
+                if (result == 0)
+                {
+                    connected = fd;
+                    break;
+                }
+                if (errno != EINPROGRESS || !loop->add(fd, EPOLLOUT, [fd, &completed](uint32_t)
+                                                       {
+                                                           if (std::find(completed.begin(), completed.end(), fd) == completed.end())
+                                                           {
+                                                               completed.push_back(fd);
+                                                           } }))
+                {
+                    close(fd);
+                    continue;
+                }
+
+                attempts.push_back(fd);
+                nextAttempt = now + CONNECTION_ATTEMPT_DELAY;
+                continue;
+            }
+
+            if (attempts.empty())
+            {
+                break;
+            }
+
+            auto wakeUp = next < addresses.size() ? std::min(deadline, nextAttempt) : deadline;
+            loop->runUntil([&completed]()
+                           { return !completed.empty(); }, -1, -1, wakeUp);
+
+            for (int fd : completed)
+            {
+                loop->remove(fd);
+                attempts.erase(std::find(attempts.begin(), attempts.end(), fd));
+
+                int connect_error = 0;
+                socklen_t error_length = sizeof(connect_error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &connect_error, &error_length);
+                if (connect_error == 0 && connected < 0)
+                {
+                    connected = fd;
+                }
+                else
+                {
+                    close(fd);
+                    nextAttempt = std::chrono::steady_clock::now(); // Try the next address right away
+                }
+            }
+            completed.clear();
+        }
+
+        for (int fd : attempts)
+        {
+            loop->remove(fd);
+            close(fd);
+        }
+
+        if (connected < 0)
+        {
+            std::cerr << (std::chrono::steady_clock::now() >= deadline ? "Connection timed out." : "Connection refused.") << std::endl;
+        }
+        return connected;
+    }
+
+    /**
+     * @brief Get the TLS context for the given certificate locations. The context is created and
+     * the certificates are loaded once per process, all connections share it.
+     *
+     * @param certfile The path to the certificate file
+     * @param certaddr The path to the certificate store
+     * @return The context, nullptr if it could not be created
+     */
+    static SSL_CTX *getSharedContext(const std::string &certfile, const std::string &certaddr)
+    {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+
+        std::string key = certfile + "\n" + certaddr;
+        auto cached = contexts.find(key);
+        if (cached != contexts.end())
+        {
+            return cached->second;
+        }
+
+        if (contexts.empty())
+        {
+            SSL_load_error_strings();
+            OpenSSL_add_all_algorithms();
+            SSL_library_init();
+        }
+
+        SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+        if (!ctx)
+        {
+            ERR_print_errors_fp(stderr);
+            return nullptr;
+        }
+
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+        // New sessions are only handed to onNewSession(), the connections look them up in sessions
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, onNewSession);
+
+        if (!SSL_CTX_load_verify_locations(ctx, certfile.empty() ? nullptr : certfile.c_str(), certaddr.c_str()))
+        {
+            std::cerr << "Error: Failed to load certificates." << std::endl;
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
 
-/**
- * @brief An IMAP client class that can connect to an IMAP server using regular sockets or SSL.
- */
-class IMAPClient
-{
-private:
-    int socket_fd;       // Socket file descriptor
-    SSL *ssl;            // SSL structure
-    SSL_CTX *ctx;        // SSL context
-    bool use_tls;        // Whether to use SSL/TLS
-    int command_counter; // Counter for IMAP commands (tagged)
+        contexts[key] = ctx;
+        return ctx;
+    }
+
+    /**
+     * @brief Keep a session the server established for resumption and persist it. Called by OpenSSL
+     * after the handshake, or later for TLS 1.3 session tickets.
+     *
+     * @param ssl The connection the session belongs to
+     * @param session The session
+     * @return 1 as the reference to the session is kept, 0 otherwise
+     */
+    static int onNewSession(SSL *ssl, SSL_SESSION *session)
+    {
+        IMAPClient *client = static_cast<IMAPClient *>(SSL_get_app_data(ssl));
+        if (!client || client->session_key.empty())
+        {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        SSL_SESSION *&cached = sessions[client->session_key];
+        if (cached)
+        {
+            SSL_SESSION_free(cached);
+        }
+        cached = session;
+
+        saveSessions();
+        return 1;
+    }
+
+    /**
+     * @brief Write the resumable sessions to the session file, readable by the owner only, and
+     * replace the old file atomically. Must be called with shared_mutex locked.
+     */
+    static void saveSessions()
+    {
+        if (session_file.empty())
+        {
+            return;
+        }
+
+        std::string temporary = session_file + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        FILE *file = fd < 0 ? nullptr : fdopen(fd, "w");
+        if (!file)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            std::cerr << "Failed to write TLS sessions: " << session_file << std::endl;
+            return;
+        }
+
+        bool written = true;
+        for (const auto &session : sessions)
+        {
+            written = written && fprintf(file, "%s\n", session.first.c_str()) > 0 &&
+                      PEM_write_SSL_SESSION(file, session.second) == 1;
+        }
+
+        if (fclose(file) != 0 || !written || rename(temporary.c_str(), session_file.c_str()) != 0)
+        {
+            std::cerr << "Failed to write TLS sessions: " << session_file << std::endl;
+            unlink(temporary.c_str());
+        }
+    }
 
 public:
     std::string canonical_hostname; // The canonical hostname of the server (meaning the fully qualified domain name)
 
     /**
-     * @brief Construct a new IMAPClient object.
+     * @brief Construct a new IMAPClient object with its own event loop.
      * Sets socket_fd to -1 and initializes the SSL context and structure to nullptr.
      */
-    IMAPClient(bool use_tls)
-        : socket_fd(-1), ssl(nullptr), ctx(nullptr), use_tls(use_tls), command_counter(1) {}
+    IMAPClient(bool use_tls) : IMAPClient(use_tls, nullptr) {}
+
+    /**
+     * @brief Construct a new IMAPClient object driven by a shared event loop, so that one thread
+     * can run many connections at once. Each connection whose blocking methods are called
+     * concurrently must run in its own task of the loop, see EventLoop::spawn().
+     *
+     * @param use_tls Whether to use SSL/TLS
+     * @param sharedLoop The event loop, nullptr to create one for the client
+     */
+    IMAPClient(bool use_tls, EventLoop *sharedLoop)
+        : socket_fd(-1), ssl(nullptr), use_tls(use_tls), command_counter(1),
+          latency(0), latencyVariation(0), deadline(std::chrono::steady_clock::time_point::max()),
+          own_loop(sharedLoop ? nullptr : new EventLoop()), loop(sharedLoop ? sharedLoop : own_loop.get()),
+          watched_events(0), handshaking(false), handshake_wants_write(false), read_wants_write(false),
+          write_wants_read(false), failed(false), aborted(false), read_buffer(65536), read_start(0), read_end(0), write_offset(0),
+          compressing(false), inflater(), deflater(), compressed_in(16384), inflate_pending(false),
+          literal_remaining(0), continuation(false), splice_pipe{-1, -1} {}
+
+    IMAPClient(const IMAPClient &) = delete;
+    IMAPClient &operator=(const IMAPClient &) = delete;
+
+    ~IMAPClient()
+    {
+        disconnect();
+    }
 
     /**
      * @brief Connect to an IMAP server using regular sockets and optional SSL and read the server greeting.
      *
      * @param server The server address
      * @param port The port number
-     * @param timeout The connection timeout in seconds
      * @param certfile The path to the certificate file
      * @param certaddr The path to the certificate store
+     * @param options How the connection is tuned, with the connection timeout
      * @return true if the connection was successful, false otherwise
      */
-    bool connect(const std::string &server, int port, int timeout, const std::string &certfile, const std::string &certaddr)
+    bool connect(const std::string &server, int port, const std::string &certfile, const std::string &certaddr,
+                 const ConnectionOptions &options)
     {
-        struct sockaddr_in server_addr;
-        struct hostent *host;
+        bool greeted = false;
+        if (!connectAsync(server, port, certfile, certaddr, options, [&greeted](const std::string &)
+                          { greeted = true; }))
+        {
+            return false;
+        }
 
-        if ((host = gethostbyname(server.c_str())) == nullptr)
+        if (!loop->runUntil([&]()
+                            { return greeted || failed; }, socket_fd, options.connectTimeout * 1000))
         {
-            std::cerr << "Error: Failed to resolve hostname." << std::endl;
+            std::cerr << "Error: Read operation timed out." << std::endl;
+            disconnect();
             return false;
         }
 
-        socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (socket_fd < 0)
+        if (failed)
         {
-            std::cerr << "Error: Failed to create socket." << std::endl;
+            disconnect();
             return false;
         }
 
-        // Set send and receive timeout on the socket using setsockopt
-        struct timeval timeout_val;
-        timeout_val.tv_sec = timeout;
-        timeout_val.tv_usec = 0;
+        return true;
+    }
 
-        // Set socket to non-blocking mode for timeout handling
-        fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+    /**
+     * @brief Keep the TLS sessions in a file, so that later runs resume them instead of doing
+     * a full handshake. The sessions already in the file are loaded, expired ones are dropped.
+     *
+     * @param path The path to the file
+     */
+    static void setSessionFile(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        session_file = path;
 
-        // Set up server address structure
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(port);
-        memcpy(&server_addr.sin_addr.s_addr, host->h_addr, host->h_length);
+        FILE *file = fopen(path.c_str(), "r");
+        if (!file)
+        {
+            return; // No sessions yet
+        }
 
-        // Attempt to connect
-        int result = ::connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
-        if (result < 0 && errno != EINPROGRESS)
+        char key[1024];
+        while (fgets(key, sizeof(key), file))
         {
-            std::cerr << "Error: Connection failed right away." << std::endl;
-            close(socket_fd);
-            return false;
+            key[strcspn(key, "\r\n")] = '\0';
+
+            SSL_SESSION *session = PEM_read_SSL_SESSION(file, nullptr, nullptr, nullptr);
+            if (!session)
+            {
+                break;
+            }
+
+            if (!SSL_SESSION_is_resumable(session) ||
+                SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(nullptr) ||
+                sessions.count(key) > 0)
+            {
+                SSL_SESSION_free(session);
+                continue;
+            }
+            sessions[key] = session;
         }
 
-        // Wait for the connection to complete or timeout
-        fd_set fdset;
-        FD_ZERO(&fdset);
-        FD_SET(socket_fd, &fdset);
+        fclose(file);
+    }
+
+    /**
+     * @brief Keep the canonical hostnames found by reverse lookups in a file, so that later runs
+     * only look up addresses that changed.
+     *
+     * @param path The path to the file
+     */
+    static void setHostnameFile(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        hostname_file = path;
 
-        result = select(socket_fd + 1, nullptr, &fdset, nullptr, &timeout_val);
-        if (result <= 0)
+        std::ifstream file(path);
+        std::string server;
+        KnownHostname known;
+        while (file >> server >> known.address >> known.canonicalName)
         {
-            std::cerr << (result == 0 ? "Connection timed out." : "Connection failed due to select() error.") << std::endl;
-            close(socket_fd);
-            return false;
+            known_hostnames[server] = known;
         }
+    }
 
-        // Set socket back to blocking mode
-        fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+    /**
+     * @brief Open the TCP connection to an IMAP server and start the TLS handshake and the
+     * reading of the greeting in the event loop.
+     *
+     * @param server The server address
+     * @param port The port number
+     * @param certfile The path to the certificate file
+     * @param certaddr The path to the certificate store
+     * @param options How the connection is tuned, with the connection timeout
+     * @param onGreeting Callback for the greeting line, or a NO line if the connection failed
+     * @return true if the TCP connection was established, false otherwise
+     */
+    bool connectAsync(const std::string &server, int port, const std::string &certfile, const std::string &certaddr,
+                      const ConnectionOptions &options, const DoneHandler &onGreeting)
+    {
+        this->options = options;
+        read_buffer.resize(std::max<size_t>(options.readBufferSize, 4096));
 
-        // Get the canonical hostname of the server
-        char hostname[NI_MAXHOST];
-        result = getnameinfo((struct sockaddr *)&server_addr, sizeof(server_addr), hostname, NI_MAXHOST, NULL, 0, 0);
-        if (result != 0)
+        ResolvedHost host;
+        if (!resolveHost(server, options.connectTimeout, host))
         {
-            std::cerr << "Error: Failed to get canonical hostname: " << gai_strerror(result) << std::endl;
-            canonical_hostname = server;
+            return false;
         }
-        else
+
+        // The socket stays non-blocking, the event loop waits for it
+        socket_fd = connectToAny(host.addresses, port, options);
+        if (socket_fd < 0)
         {
-            canonical_hostname = std::string(hostname);
+            return false;
         }
 
+        canonical_hostname = host.canonicalName;
+
         if (use_tls)
         {
-            SSL_load_error_strings();
-            OpenSSL_add_all_algorithms();
-            SSL_library_init();
-
-            ctx = SSL_CTX_new(TLS_client_method());
+            SSL_CTX *ctx = getSharedContext(certfile, certaddr);
             if (!ctx)
             {
-                ERR_print_errors_fp(stderr);
-                close(socket_fd);
-                return false;
-            }
-
-            SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
-
-            if (!SSL_CTX_load_verify_locations(ctx, certfile.empty() ? nullptr : certfile.c_str(), certaddr.c_str()))
-            {
-                std::cerr << "Error: Failed to load certificates." << std::endl;
-                close(socket_fd);
+                disconnect();
                 return false;
             }
 
@@ -148,23 +1404,83 @@ public:
             if (!ssl)
             {
                 std::cerr << "Failed to create SSL structure." << std::endl;
-                close(socket_fd);
+                disconnect();
                 return false;
             }
 
+            // Writes are retried from a buffer that may have grown in the meantime
+            SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
             SSL_set_fd(ssl, socket_fd);
-            if (SSL_connect(ssl) <= 0)
+
+            // Resume the last session with the server to skip the full handshake
+            session_key = server + ":" + std::to_string(port);
+            SSL_set_app_data(ssl, this);
             {
-                std::cerr << "SSL/TLS handshake failed." << std::endl;
-                close(socket_fd);
-                return false;
+                std::lock_guard<std::mutex> lock(shared_mutex);
+                auto cached = sessions.find(session_key);
+                if (cached != sessions.end())
+                {
+                    SSL_set_session(ssl, cached->second);
+                }
             }
+            handshaking = true;
+        }
+
+        watched_events = EPOLLIN;
+        if (!loop->add(socket_fd, watched_events, [this](uint32_t events)
+                       { onSocketEvent(events); }))
+        {
+            std::cerr << "Error: Failed to watch socket." << std::endl;
+            disconnect();
+            return false;
         }
 
-        readResponse("*"); // Read the server greeting
+        pending.push_back({"*", nullptr, nullptr, onGreeting, nullptr, {}}); // Read the server greeting
+
+        if (handshaking)
+        {
+            continueHandshake();
+        }
         return true;
     }
 
+    /**
+     * @brief Send a command without waiting for its response. The callbacks run from the event
+     * loop as the response arrives; they must not call the blocking methods of the client.
+     *
+     * @param command The command to send
+     * @param onLine Callback for every untagged or continuation line of the response
+     * @param onLiteral Callback for the literal data
+     * @param onDone Callback for the tagged completion line
+     * @param onLiteralFile Optional callback giving the file a literal is written to, so that it can be moved
+     * there without passing through onLiteral; onLiteral then only gets a null pointer and the length
+     * @return The tag the command was sent with
+     */
+    std::string sendCommandAsync(const std::string &command, const LineHandler &onLine, const LiteralHandler &onLiteral,
+                                 const DoneHandler &onDone, const LiteralFileHandler &onLiteralFile = nullptr)
+    {
+        std::string tag = nextTag();
+
+        if (failed)
+        {
+            std::cerr << "Error: " << failure << std::endl;
+            aborted = true;
+            if (onDone)
+            {
+                onDone(tag + " NO " + failure);
+            }
+            return tag;
+        }
+
+        // Only a command with nothing ahead of it measures how fast the server answers
+        std::chrono::steady_clock::time_point sent = pending.empty() ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        pending.push_back({tag, onLine, onLiteral, onDone, onLiteralFile, sent});
+        queueWrite(tag + " " + command + "\r\n");
+        flushWrites();
+
+        return tag;
+    }
+
     /**
      * @brief Send a command to the server using regular socket or SSL.
      * Read the response from the server afterwards.
@@ -174,125 +1490,293 @@ public:
      */
     std::string sendCommand(const std::string &command)
     {
-        std::stringstream numbered_command;
-        numbered_command << "A" << std::setw(3) << std::setfill('0') << command_counter++ << " " << command << "\r\n";
+        std::string response;
+        bool done = false;
+
+        sendCommandAsync(
+            command,
+            [&response](const std::string &line)
+            { response.append(line).append("\r\n"); },
+            [&response](const char *data, size_t length)
+            { response.append(data, length); },
+            [&response, &done](const std::string &status)
+            {
+                response.append(status).append("\r\n");
+                done = true;
+            });
 
-        std::string full_command = numbered_command.str();
+        waitFor([&done]()
+                { return done; });
+        return response; // Return the full response
+    }
 
-        if (use_tls)
-        {
-            SSL_write(ssl, full_command.c_str(), full_command.size());
-        }
-        else
+    /**
+     * @brief Check whether the server announces a capability. The capabilities are queried
+     * with the CAPABILITY command on first use, so this should only be called after LOGIN.
+     *
+     * @param capability The capability name, e.g. "ESEARCH"
+     * @return true if the server has the capability, false otherwise
+     */
+    bool hasCapability(const std::string &capability)
+    {
+        if (capabilities.empty())
         {
-            send(socket_fd, full_command.c_str(), full_command.size(), 0);
+            std::string response = sendCommand("CAPABILITY");
+            std::string prefix = "* CAPABILITY ";
+
+            size_t start = response.find(prefix);
+            if (start == std::string::npos)
+            {
+                capabilities = " ";
+            }
+            else
+            {
+                start += prefix.size();
+                capabilities = " " + response.substr(start, response.find("\r\n", start) - start) + " ";
+                std::transform(capabilities.begin(), capabilities.end(), capabilities.begin(), ::toupper);
+            }
         }
 
-        std::string response = readResponse(full_command.substr(0, 4)); // Read the response and check the tagged response
+        return capabilities.find(" " + capability + " ") != std::string::npos;
+    }
 
-        return response; // Return the full response
+    /**
+     * @brief Send a command whose response carries large literals (like UID FETCH) and stream it
+     * to the given callbacks instead of buffering it.
+     *
+     * @param command The command to send
+     * @param onLine Callback for every untagged or continuation line of the response
+     * @param onLiteral Callback for the literal data
+     * @return The tagged completion line of the response
+     */
+    std::string sendStreamingCommand(const std::string &command, const LineHandler &onLine, const LiteralHandler &onLiteral)
+    {
+        std::string status;
+        bool done = false;
+
+        sendCommandAsync(command, onLine, onLiteral, [&status, &done](const std::string &line)
+                         {
+                             status = line;
+                             done = true; });
+
+        waitFor([&done]()
+                { return done; });
+        return status;
     }
 
     /**
-     * @brief Read the response from the server. If it is longer than 4096 bytes,
-     * keep reading until the whole response is read.
+     * @brief Send several streaming commands pipelined on this connection, keeping up to depth
+     * of them in flight, so the server always has the next command to work on while the
+     * responses of the previous ones are being processed.
      *
-     * @param tag The tag of the command to read the response for
-     * @return The response from the server
+     * @param commands The commands to send, in order
+     * @param depth The maximum number of commands in flight
+     * @param onLine Callback for every untagged or continuation line of the responses
+     * @param onLiteral Callback for the literal data
+     * @param onCompleted Optional callback run after each command that completed with OK
+     * @param onLiteralFile Optional callback giving the file a literal is written to, see sendCommandAsync()
+     * @return true if all the commands completed with OK, false otherwise
      */
-    std::string readResponse(const std::string &tag)
+    bool sendPipelinedCommands(const std::vector<std::string> &commands, size_t depth, const LineHandler &onLine,
+                               const LiteralHandler &onLiteral, const std::function<void()> &onCompleted = nullptr,
+                               const LiteralFileHandler &onLiteralFile = nullptr)
     {
-        char buffer[4096];
-        std::string response;
-        int bytes_read;
+        size_t next = 0;
+        size_t inFlight = 0;
+        bool success = true;
 
-        // Set up the timeout structure
-        struct timeval timeout_val;
-        timeout_val.tv_sec = 5;
-        timeout_val.tv_usec = 0;
+        std::function<void(const std::string &)> onDone = [&](const std::string &status)
+        {
+            --inFlight;
+
+            if (!Helpers::IsStatusOK(status))
+            {
+                if (!failed) // A lost connection was reported already
+                {
+                    std::cerr << "Error in server response: " << status << std::endl;
+                }
+                success = false;
+                next = commands.size(); // Do not send any further batches
+            }
+            else if (onCompleted)
+            {
+                onCompleted();
+            }
 
-        fd_set read_fds;
+            // Keep the pipeline full
+            while (next < commands.size() && inFlight < std::max<size_t>(depth, 1))
+            {
+                ++inFlight;
+                sendCommandAsync(commands[next++], onLine, onLiteral, onDone, onLiteralFile);
+            }
+        };
 
-        while (true)
+        while (next < commands.size() && inFlight < std::max<size_t>(depth, 1))
         {
-            memset(buffer, 0, sizeof(buffer));
+            ++inFlight;
+            sendCommandAsync(commands[next++], onLine, onLiteral, onDone, onLiteralFile);
+        }
+
+        waitFor([&inFlight]()
+                { return inFlight == 0; });
 
-            // Prepare the file descriptor set
-            FD_ZERO(&read_fds);
-            FD_SET(socket_fd, &read_fds);
+        return success;
+    }
 
-            // Wait for data to be available for reading
-            int result = select(socket_fd + 1, &read_fds, nullptr, nullptr, &timeout_val);
+    /**
+     * @brief Compress the rest of the session with COMPRESS DEFLATE (RFC 4978) if the server
+     * supports it. Must be called after LOGIN with no other command in flight.
+     *
+     * @return true if the connection is compressed, false otherwise
+     */
+    bool startCompression()
+    {
+        if (compressing || !hasCapability("COMPRESS=DEFLATE"))
+        {
+            return compressing;
+        }
 
-            if (result > 0)
+        bool done = false;
+        sendCommandAsync(
+            "COMPRESS DEFLATE", nullptr, nullptr,
+            [this, &done](const std::string &status)
             {
-                // Data is available, proceed to read
-                if (use_tls)
+                done = true;
+                if (!Helpers::IsStatusOK(status) || failed)
                 {
-                    bytes_read = SSL_read(ssl, buffer, sizeof(buffer) - 1);
+                    return;
                 }
-                else
+
+                // Raw deflate streams without the zlib header, as required by the RFC
+                if (inflateInit2(&inflater, -15) != Z_OK ||
+                    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
                 {
-                    bytes_read = recv(socket_fd, buffer, sizeof(buffer) - 1, 0);
+                    fail("Unable to initialize compression.");
+                    return;
                 }
+                compressing = true;
 
-                if (bytes_read > 0)
+                // The server compresses everything after this line, including what was already read
+                size_t remaining = read_end - read_start;
+                if (remaining > compressed_in.size())
                 {
-                    buffer[bytes_read] = '\0';
-                    response += buffer;
-
-                    // Check if the response contains the expected tag
-                    if (tag == "*")
-                    {
-                        if (response.find("* ") == 0 && response.find("\r\n") != std::string::npos)
-                        {
-                            break; // Complete untagged response received
-                        }
-                    }
-                    else
-                    {
-                        std::string tag_with_status = tag + " ";
-                        if (response.find(tag_with_status) != std::string::npos)
-                        {
-                            break; // Complete tagged response received
-                        }
-                    }
+                    compressed_in.resize(remaining);
                 }
-                else if (bytes_read == 0)
+                memcpy(compressed_in.data(), read_buffer.data() + read_start, remaining);
+                inflater.next_in = reinterpret_cast<Bytef *>(compressed_in.data());
+                inflater.avail_in = static_cast<uInt>(remaining);
+                inflate_pending = remaining > 0;
+                read_start = read_end;
+            });
+
+        waitFor([&done]()
+                { return done; });
+        return compressing;
+    }
+
+    /**
+     * @brief Wait in the IDLE state (RFC 2177) until the server reports new messages in the selected
+     * mailbox, the time limit passes or stop() holds, then leave it with DONE. The socket is only
+     * watched by the event loop meanwhile, nothing is polled.
+     *
+     * @param stop Condition that ends the wait early, checked at least once a second
+     * @param status The tagged completion line of the IDLE command
+     * @param limit The maximum time to stay idle, servers may log out clients idle for 30 minutes
+     * @return true if the server reported new messages, false otherwise
+     */
+    bool idle(const std::function<bool()> &stop, std::string &status, std::chrono::seconds limit = IDLE_LIMIT)
+    {
+        bool accepted = false;
+        bool changed = false;
+        bool done = false;
+
+        sendCommandAsync(
+            "IDLE",
+            [&accepted, &changed](const std::string &line)
+            {
+                if (line.compare(0, 2, "+ ") == 0)
                 {
-                    std::cerr << "Error: Connection closed by server." << std::endl;
-                    disconnect();
-                    exit(EXIT_FAILURE);
+                    accepted = true;
                 }
-                else if (bytes_read < 0)
+                else if (line.size() > 9 && line.compare(line.size() - 7, 7, " EXISTS") == 0)
                 {
-                    if (use_tls && SSL_get_error(ssl, bytes_read) == SSL_ERROR_WANT_READ)
-                    {
-                        continue; // Retry if needed
-                    }
-                    else
-                    {
-                        std::cerr << "Error reading from server." << std::endl;
-                        disconnect();
-                        exit(EXIT_FAILURE);
-                    }
+                    changed = true; // "* n EXISTS"
                 }
-            }
-            else if (result == 0)
+            },
+            [](const char *, size_t) {},
+            [&status, &done](const std::string &line)
             {
-                std::cerr << "Error: Read operation timed out." << std::endl;
-                disconnect();
-                exit(EXIT_FAILURE);
-            }
-            else
+                status = line;
+                done = true;
+            });
+
+        waitFor([&]()
+                { return accepted || done; });
+
+        auto deadline = std::chrono::steady_clock::now() + limit;
+        while (!done && !failed && !changed && !stop() && std::chrono::steady_clock::now() < deadline)
+        {
+            loop->runUntil([&]()
+                           { return done || failed || changed; }, socket_fd, -1,
+                           std::min(deadline, std::chrono::steady_clock::now() + std::chrono::seconds(1)));
+        }
+
+        if (!done && !failed)
+        {
+            queueWrite("DONE\r\n");
+            flushWrites();
+        }
+
+        waitFor([&done]()
+                { return done; });
+        return changed;
+    }
+
+    /**
+     * @brief Get the event loop driving the client.
+     * @return The event loop
+     */
+    EventLoop &getEventLoop()
+    {
+        return *loop;
+    }
+
+    /**
+     * @brief Set when the blocking methods give up waiting, regardless of the read timeout.
+     * @param deadline The point in time, max for never
+     */
+    void setDeadline(std::chrono::steady_clock::time_point deadline)
+    {
+        this->deadline = deadline;
+    }
+
+    /**
+     * @brief Check whether the connection failed.
+     * @return true if the connection failed, false otherwise
+     */
+    bool hasFailed() const
+    {
+        return failed;
+    }
+
+    /**
+     * @brief Log out and disconnect. A failed connection is only closed.
+     */
+    void logout()
+    {
+        try
+        {
+            if (!failed)
             {
-                std::cerr << "Error: select() failed." << std::endl;
-                disconnect();
-                exit(EXIT_FAILURE);
+                sendCommand("LOGOUT");
             }
         }
+        catch (const ConnectionError &)
+        {
+            // The server may close the connection before completing LOGOUT
+        }
 
-        return response;
+        disconnect();
     }
 
     /**
@@ -300,20 +1784,15 @@ public:
      */
     void disconnect()
     {
-        if (use_tls && ssl)
+        if (socket_fd != -1)
         {
-            int shutdown_status = SSL_shutdown(ssl);
-
-            if (shutdown_status == 0)
-            {
-                shutdown_status = SSL_shutdown(ssl); // Call it again to complete the shutdown
-            }
+            loop->remove(socket_fd);
+        }
 
-            if (shutdown_status == 1)
-            {
-                return;
-            }
-            else
+        if (use_tls && ssl)
+        {
+            // Only send our close_notify, waiting for the server's one is not required
+            if (!handshaking && !failed && SSL_shutdown(ssl) < 0)
             {
                 std::cerr << "Error during SSL/TLS shutdown." << std::endl;
                 ERR_print_errors_fp(stderr);
@@ -329,10 +1808,20 @@ public:
             socket_fd = -1;
         }
 
-        if (ctx)
+        if (compressing)
         {
-            SSL_CTX_free(ctx);
-            ctx = nullptr;
+            inflateEnd(&inflater);
+            deflateEnd(&deflater);
+            compressing = false;
+        }
+
+        if (splice_pipe[0] >= 0)
+        {
+            close(splice_pipe[0]);
+            close(splice_pipe[1]);
+            splice_pipe[0] = splice_pipe[1] = -1;
         }
     }
 };
+
+#endif
@@ -7,151 +7,99 @@
 
 #include <iostream>
 #include "ArgumentParser.h"
-#include "IMAPClient.cpp"
-#include "EmailMessage.cpp"
+#include "Synchronizer.cpp"
+#include "Daemon.cpp"
 #include <unistd.h>
 #include <cstring>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <sstream>
+#include <map>
+#include <csignal>
+#include <atomic>
+#include <filesystem>
+
+static std::atomic<bool> stopRequested{false}; // Set by SIGINT and SIGTERM in the IDLE mode
+
+/**
+ * @brief Handle SIGINT and SIGTERM by ending the IDLE mode after the current download.
+ * @param signal The signal number.
+ */
+static void onStopSignal(int)
+{
+    stopRequested = true;
+}
 
 int main(int argc, char *argv[])
 {
     ArgumentParser parser(argc, argv);
     ArgumentParser::ParsedArgs args = parser.parse();
-    IMAPClient client(args.use_tls);
 
-    std::string loginCommand = "LOGIN " + Helpers::parseLogin(args.authfile);
+    // Writes to a connection closed by the server must fail with an error instead of killing the program
+    signal(SIGPIPE, SIG_IGN);
 
-    if (!client.connect(args.server, args.port, 5, args.certfile, args.certaddr))
+    if (!args.daemon_config.empty())
     {
-        return EXIT_FAILURE;
+        Daemon daemon;
+        return daemon.load(args.daemon_config) ? daemon.run() : EXIT_FAILURE;
     }
 
-    std::string loginResponse = client.sendCommand(loginCommand);
+    std::string login = Helpers::parseLogin(args.authfile);
 
-    if (!Helpers::HandleLoginResponse(loginResponse))
+    // The canonical hostname and the TLS sessions are kept next to the messages for the next run
+    std::error_code ec;
+    std::filesystem::create_directories(args.outdir, ec);
+    IMAPClient::setHostnameFile(args.outdir + "/.hostnames");
+    if (args.use_tls)
     {
-        client.disconnect();
-        return EXIT_FAILURE;
+        IMAPClient::setSessionFile(args.outdir + "/.tls_sessions");
     }
 
-    std::string selectResponse = client.sendCommand("SELECT " + args.mailbox);
-
-    if (!Helpers::HandleUIDValidity(args.mailbox, args.outdir, selectResponse, client.canonical_hostname))
+    std::unique_ptr<IMAPClient> client = Synchronizer::openConnection(args, login);
+    if (!client)
     {
-        client.sendCommand("LOGOUT");
-        client.disconnect();
         return EXIT_FAILURE;
     }
 
-    std::string fetchCommand;
-    if (args.new_only)
+    Synchronizer synchronizer(*client, args, login);
+    std::vector<std::string> mailboxes;
+    try
+    {
+        mailboxes = synchronizer.listMailboxes();
+    }
+    catch (const IMAPClient::ConnectionError &)
     {
-        std::string searchResponse = client.sendCommand("UID SEARCH NEW");
-        std::vector<std::string> unseenUIDs;
-        std::istringstream iss(searchResponse);
-        std::string word;
+        return EXIT_FAILURE; // Nothing downloaded yet, reported by the client
+    }
 
-        // Check for errors in the search response
-        if (searchResponse.find("NO") != std::string::npos || searchResponse.find("BAD") != std::string::npos)
+    if (args.idle)
+    {
+        if (mailboxes.size() != 1)
         {
-            std::cerr << "Error in server response: unable to retreive email UIDs" << std::endl;
-            client.sendCommand("LOGOUT");
-            client.disconnect();
+            std::cerr << "Error: --idle keeps exactly one mailbox in sync." << std::endl;
+            synchronizer.logout();
             return EXIT_FAILURE;
         }
 
-        // Parse the search response to extract only the numbers (UIDs)
-        while (iss >> word)
-        {
-            // Check if the word is a number (UID)
-            if (!word.empty() && std::all_of(word.begin(), word.end(), ::isdigit))
-            {
-                unseenUIDs.push_back(word);
-            }
-        }
-
-        if (unseenUIDs.empty())
-        {
-            std::cout << "No new messages found." << std::endl;
-            client.sendCommand("LOGOUT");
-            client.disconnect();
-            return EXIT_SUCCESS;
-        }
-
-        std::string uidList = unseenUIDs[0];
-        for (size_t i = 1; i < unseenUIDs.size(); ++i)
-        {
-            uidList += "," + unseenUIDs[i];
-        }
-
-        fetchCommand = args.headers_only ? "UID FETCH " + uidList + " (UID BODY.PEEK[HEADER])" : "UID FETCH " + uidList + " (UID BODY[])";
-    }
-    else
-    {
-        std::string uidFetch = "UID SEARCH ALL";
-        std::string uidResponse = client.sendCommand(uidFetch);
-
-        fetchCommand = Helpers::GetSynchronizingFetch(args.headers_only, args.mailbox, args.outdir, uidResponse, client.canonical_hostname);
+        signal(SIGINT, onStopSignal);
+        signal(SIGTERM, onStopSignal);
+        bool success = synchronizer.watch(mailboxes.front(), []()
+                                          { return stopRequested.load(); });
 
-        if (fetchCommand.empty())
-        {
-            std::cerr << "No new messages to synchronize." << std::endl;
-            client.sendCommand("LOGOUT");
-            client.disconnect();
-            return EXIT_SUCCESS;
-        }
+        synchronizer.logout();
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    std::string fetchResponse = client.sendCommand(fetchCommand);
+    std::vector<MailboxStats> results = synchronizer.run(mailboxes);
 
-    std::vector<std::string> rawEmails;
-    std::vector<std::string> UIDs;
+    synchronizer.logout();
 
-    if (!Helpers::ParseImapResponse(fetchResponse, rawEmails, UIDs))
+    if (results.empty())
     {
-        client.sendCommand("LOGOUT");
-        client.disconnect();
+        std::cerr << "Error: No mailbox to synchronize." << std::endl;
         return EXIT_FAILURE;
-    };
-
-    // Process and save emails
-    int downloadedCount = 0;
-    for (size_t i = 0; i < rawEmails.size(); ++i)
-    {
-        try
-        {
-            EmailMessage message(rawEmails[i]);
-            message.saveToFile(args.outdir, UIDs[i], args.mailbox, client.canonical_hostname, args.headers_only);
-            ++downloadedCount;
-        }
-        catch (const std::exception &ex)
-        {
-            std::cerr << "Error: Failed to process email " << i + 1 << ": " << ex.what() << std::endl;
-        }
     }
 
-    if (args.headers_only && args.new_only)
-    {
-        std::cout << "Downloaded " << downloadedCount << " new messages (headers only) from mailbox " << args.mailbox << std::endl;
-    }
-    else if (args.headers_only)
-    {
-        std::cout << "Downloaded " << downloadedCount << " messages (headers only) from mailbox " << args.mailbox << std::endl;
-    }
-    else if (args.new_only)
-    {
-        std::cout << "Downloaded " << downloadedCount << " new messages from mailbox " << args.mailbox << std::endl;
-    }
-    else
-    {
-        std::cout << "Downloaded " << downloadedCount << " messages from mailbox " << args.mailbox << std::endl;
-    }
-
-    client.sendCommand("LOGOUT");
-    client.disconnect();
-
-    return EXIT_SUCCESS;
-}
+    return Synchronizer::printSummary(results) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
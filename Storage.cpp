@@ -0,0 +1,898 @@
+/**
+ * @file Storage.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing the layouts the downloaded messages are stored in.
+ */
+
+#ifndef STORAGE_CPP
+#define STORAGE_CPP
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <mutex>
+#include <ctime>
+#include <chrono>
+#include <filesystem>
+#include <unordered_map>
+#include <unistd.h>
+#include "ArgumentParser.h"
+#include "UIDSet.cpp"
+#include "SyncState.cpp"
+
+namespace fs = std::filesystem;
+
+/**
+ * @class Storage
+ * @brief The layout the messages of one mailbox are stored in.
+ *
+ * A message is written to the file given by getTempPath() first and handed over to store()
+ * once it is complete, so every layout only ever contains complete messages. The layouts with a
+ * file per message may store them gzip-compressed, with .gz appended to their names, and always
+ * recognize both compressed and plain files.
+ */
+class Storage
+{
+protected:
+    bool compressed; // Whether new messages are stored gzip-compressed.
+
+    /**
+     * @brief Constructs a Storage object.
+     * @param compressed Whether new messages are stored gzip-compressed.
+     */
+    explicit Storage(bool compressed) : compressed(compressed) {}
+
+    /**
+     * @brief Get the size of a stored message.
+     * @param entry The file of the message.
+     * @param gzipped Whether the file is gzip-compressed.
+     * @return uint64_t The size of the message, modulo 4 GiB for a compressed one.
+     */
+    static uint64_t getMessageSize(const fs::directory_entry &entry, bool gzipped)
+    {
+        if (!gzipped)
+        {
+            return entry.file_size();
+        }
+
+        // The gzip trailer ends with the uncompressed size, little endian
+        std::ifstream file(entry.path(), std::ios::binary);
+        unsigned char trailer[4] = {};
+        file.seekg(-4, std::ios::end);
+        file.read(reinterpret_cast<char *>(trailer), sizeof(trailer));
+        return trailer[0] | trailer[1] << 8 | trailer[2] << 16 | static_cast<uint64_t>(trailer[3]) << 24;
+    }
+
+    /**
+     * @brief Check whether a name ends with a suffix, and remove the suffix if it does.
+     * @param name The name.
+     * @param suffix The suffix.
+     * @return true if the suffix was removed, false otherwise.
+     */
+    static bool removeSuffix(std::string &name, const std::string &suffix)
+    {
+        if (name.length() < suffix.length() || name.compare(name.length() - suffix.length(), suffix.length(), suffix) != 0)
+        {
+            return false;
+        }
+        name.resize(name.length() - suffix.length());
+        return true;
+    }
+
+public:
+    /**
+     * @brief How much of a message was downloaded.
+     */
+    enum class Content
+    {
+        Full,   /**< The whole message. */
+        Parts,  /**< The headers and some of the MIME parts, the rest left empty. */
+        Headers /**< The headers only. */
+    };
+
+    virtual ~Storage() = default;
+
+    /**
+     * @brief Check whether new messages are stored gzip-compressed.
+     * @return true if they are, false otherwise.
+     */
+    bool isCompressed() const
+    {
+        return compressed;
+    }
+
+    /**
+     * @brief Create the storage of a mailbox in the given layout.
+     * @param format The layout.
+     * @param outputDir The output directory.
+     * @param mailbox The mailbox name as used in the local file names.
+     * @param canonicalHostname The canonical hostname of the mail server.
+     * @param compressed Whether new messages are stored gzip-compressed, not supported by mbox.
+     * @return std::unique_ptr<Storage> The storage.
+     */
+    static std::unique_ptr<Storage> create(ArgumentParser::StorageFormat format, const std::string &outputDir, const std::string &mailbox,
+                                           const std::string &canonicalHostname, bool compressed);
+
+    /**
+     * @brief Get the file a message being downloaded is written to.
+     * @param id A number keeping the downloads running at once apart.
+     * @return std::string The path of the temporary file.
+     */
+    virtual std::string getTempPath(unsigned id) const = 0;
+
+    /**
+     * @brief Store a complete message, taking over its temporary file.
+     * @param tempPath The temporary file holding the message.
+     * @param uid The UID of the message.
+     * @param content How much of the message was downloaded. It replaces the stored copies with less of it.
+     * @param flush Whether the data written by the storage itself has to be on disk before returning.
+     * @return std::string The file the message ended up in.
+     * @exception std::exception if the message cannot be stored.
+     */
+    virtual std::string store(const std::string &tempPath, uint32_t uid, Content content, bool flush) = 0;
+
+    /**
+     * @brief Find the messages already stored.
+     * @param headersOnly UIDs with only headers or some parts downloaded.
+     * @param fullEmails UIDs with full emails downloaded.
+     * @param sizes Sizes of the downloaded messages by UID.
+     */
+    virtual void scan(UIDSet &headersOnly, UIDSet &fullEmails, std::unordered_map<uint32_t, uint64_t> &sizes) = 0;
+
+    /**
+     * @brief Delete the stored messages, both full emails and headers.
+     * @param uids The UIDs of the messages to delete.
+     */
+    virtual void remove(const UIDSet &uids) = 0;
+};
+
+/**
+ * @class FlatStorage
+ * @brief Every message in its own file named <host>_<mailbox>_<uid>.eml directly in the output directory.
+ * A message with only its headers downloaded is named <host>_<mailbox>_<uid>_headers.eml, one with
+ * only some of its parts <host>_<mailbox>_<uid>_parts.eml. Compressed messages have .gz appended to the name.
+ */
+class FlatStorage : public Storage
+{
+private:
+    std::string directory;  // The output directory.
+    std::string filePrefix; // The path of the messages without the UID.
+    std::string tempPrefix; // The path of the temporary files without their number.
+
+public:
+    /**
+     * @brief Constructs a FlatStorage object.
+     * @param outputDir The output directory.
+     * @param mailbox The mailbox name as used in the local file names.
+     * @param canonicalHostname The canonical hostname of the mail server.
+     * @param compressed Whether new messages are stored gzip-compressed.
+     */
+    FlatStorage(const std::string &outputDir, const std::string &mailbox, const std::string &canonicalHostname, bool compressed)
+        : Storage(compressed), directory(outputDir), filePrefix(outputDir + "/" + canonicalHostname + "_" + mailbox + "_"),
+          tempPrefix(outputDir + "/." + canonicalHostname + "_" + mailbox + "_download") {}
+
+    std::string getTempPath(unsigned id) const override
+    {
+        return tempPrefix + std::to_string(id) + ".tmp";
+    }
+
+    std::string store(const std::string &tempPath, uint32_t uid, Content content, bool) override
+    {
+        static const char *const suffixes[] = {".eml", "_parts.eml", "_headers.eml"};
+        std::string fileName = filePrefix + std::to_string(uid);
+        std::string finalName = fileName + suffixes[static_cast<int>(content)] + (compressed ? ".gz" : "");
+
+        // A message replaces the copies with less of it only once it is in place, so a crash never loses both
+        fs::rename(tempPath, finalName);
+        std::error_code ec;
+        for (int lesser = static_cast<int>(content) + 1; lesser <= static_cast<int>(Content::Headers); ++lesser)
+        {
+            fs::remove(fileName + suffixes[lesser], ec);
+            fs::remove(fileName + suffixes[lesser] + ".gz", ec);
+        }
+
+        return finalName;
+    }
+
+    void scan(UIDSet &headersOnly, UIDSet &fullEmails, std::unordered_map<uint32_t, uint64_t> &sizes) override
+    {
+        std::vector<uint32_t> headerUIDs, fullUIDs; // In directory order, sorted when building the sets
+        for (const auto &entry : fs::directory_iterator(directory))
+        {
+            if (entry.is_regular_file())
+            {
+                std::string filePath = entry.path().string();
+                if (filePath.find(filePrefix) == 0 && isdigit(static_cast<unsigned char>(filePath[filePrefix.length()])))
+                {
+                    std::string name = filePath.substr(filePrefix.length());
+                    bool gzipped = removeSuffix(name, ".gz");
+
+                    // Check if it's a header-only file or one with some parts
+                    if (removeSuffix(name, "_headers.eml") || removeSuffix(name, "_parts.eml"))
+                    {
+                        headerUIDs.push_back(std::stoul(name));
+                        if (sizes.find(headerUIDs.back()) == sizes.end())
+                        {
+                            sizes[headerUIDs.back()] = getMessageSize(entry, gzipped);
+                        }
+                    }
+                    else if (removeSuffix(name, ".eml"))
+                    {
+                        fullUIDs.push_back(std::stoul(name));
+                        sizes[fullUIDs.back()] = getMessageSize(entry, gzipped);
+                    }
+                }
+            }
+        }
+
+        // A full message found next to its headers wins
+        fullEmails = UIDSet::fromUIDs(std::move(fullUIDs));
+        headersOnly = UIDSet::fromUIDs(std::move(headerUIDs)).subtract(fullEmails);
+    }
+
+    void remove(const UIDSet &uids) override
+    {
+        std::error_code ec;
+        for (const auto &range : uids.getRanges())
+        {
+            for (uint64_t uid = range.first; uid <= range.second; ++uid)
+            {
+                for (const char *suffix : {".eml", "_headers.eml", "_parts.eml", ".eml.gz", "_headers.eml.gz", "_parts.eml.gz"})
+                {
+                    fs::remove(filePrefix + std::to_string(uid) + suffix, ec);
+                }
+            }
+        }
+    }
+};
+
+/**
+ * @class MaildirStorage
+ * @brief A Maildir named <host>_<mailbox> in the output directory. Messages are written to tmp/ and
+ * delivered flat to new/ under a unique name, <time>.M<usec>P<pid>Q<n>.<localhost>,U=<uid>, so that
+ * any mail reader finds them; it may move them to cur/ and add flags. A message with only its headers
+ * or some of its parts has ,C=headers or ,C=parts appended. Compressed messages have .gz appended.
+ *
+ * The UID is only known from the names, so the delivered files are listed once on the first delivery
+ * to find the copies a message replaces.
+ */
+class MaildirStorage : public Storage
+{
+protected:
+    std::string root; // The Maildir.
+
+    /**
+     * @brief List the files of messages in new/ and cur/.
+     * @param onFile Called with every file and its name.
+     */
+    void list(const std::function<void(const fs::directory_entry &, const std::string &)> &onFile) const
+    {
+        std::error_code ec;
+        for (const char *folder : {"/new", "/cur"})
+        {
+            for (const auto &entry : fs::directory_iterator(root + folder, ec))
+            {
+                if (entry.is_regular_file())
+                {
+                    onFile(entry, entry.path().filename().string());
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Create the Maildir if it does not exist yet.
+     * @param outputDir The output directory.
+     * @param mailbox The mailbox name as used in the local file names.
+     * @param canonicalHostname The canonical hostname of the mail server.
+     * @param compressed Whether new messages are stored gzip-compressed.
+     * @param hostname The name of this machine in the names of the delivered messages.
+     */
+    MaildirStorage(const std::string &outputDir, const std::string &mailbox, const std::string &canonicalHostname, bool compressed,
+                   const std::string &hostname)
+        : Storage(compressed), root(outputDir + "/" + canonicalHostname + "_" + mailbox), hostname(hostname), deliveries(0), indexed(false)
+    {
+        fs::create_directories(root + "/tmp");
+        fs::create_directories(root + "/new");
+        fs::create_directories(root + "/cur");
+    }
+
+private:
+    std::string hostname; // The name of this machine in the names of the delivered messages.
+    unsigned deliveries;  // The number of messages delivered so far, keeps their names apart.
+    bool indexed;         // Whether files has been filled.
+    std::unordered_map<uint32_t, std::vector<std::string>> files; // The delivered files by UID.
+    std::mutex indexMutex; // Guards the index against concurrent downloads.
+
+    /**
+     * @brief Parse the name of a delivered message.
+     * @param name The file name, possibly with the info suffix added by a mail reader.
+     * @param uid The UID of the message.
+     * @param content How much of the message was downloaded.
+     * @param gzipped Whether the message is gzip-compressed.
+     * @return true if the name is the name of a message, false otherwise.
+     */
+    static bool parseName(const std::string &name, uint32_t &uid, Content &content, bool &gzipped)
+    {
+        std::string rest = name.substr(0, name.find(':'));
+        size_t start = rest.rfind(",U=");
+        if (start == std::string::npos)
+        {
+            return false;
+        }
+        rest = rest.substr(start + 3);
+
+        size_t end = std::min(rest.find_first_not_of("0123456789"), rest.size());
+        if (end == 0 || end > 10)
+        {
+            return false;
+        }
+
+        std::string number = rest.substr(0, end);
+        rest = rest.substr(end);
+        gzipped = removeSuffix(rest, ".gz");
+        if (rest.empty())
+        {
+            content = Content::Full;
+        }
+        else if (rest == ",C=parts")
+        {
+            content = Content::Parts;
+        }
+        else if (rest == ",C=headers")
+        {
+            content = Content::Headers;
+        }
+        else
+        {
+            return false;
+        }
+
+        uint64_t value = std::stoull(number);
+        uid = static_cast<uint32_t>(value);
+        return value != 0 && value <= UINT32_MAX;
+    }
+
+    /**
+     * @brief Get the name of this machine as allowed in the names of a Maildir.
+     * @return std::string The hostname with / , and : escaped as octal.
+     */
+    static std::string getHostname()
+    {
+        char buffer[256] = {};
+        if (gethostname(buffer, sizeof(buffer) - 1) != 0 || buffer[0] == '\0')
+        {
+            return "localhost";
+        }
+
+        std::string hostname;
+        for (const char *c = buffer; *c != '\0'; ++c)
+        {
+            hostname += *c == '/' ? "\\057" : *c == ',' ? "\\054" : *c == ':' ? "\\072" : std::string(1, *c);
+        }
+        return hostname;
+    }
+
+    /**
+     * @brief Fill the index with the files delivered before, the caller holds indexMutex.
+     */
+    void index()
+    {
+        files.clear();
+        list([this](const fs::directory_entry &entry, const std::string &name)
+             {
+                 uint32_t uid;
+                 Content content;
+                 bool gzipped;
+                 if (parseName(name, uid, content, gzipped))
+                 {
+                     files[uid].push_back(entry.path().string());
+                 }
+             });
+        indexed = true;
+    }
+
+public:
+    /**
+     * @brief Constructs a MaildirStorage object, creating the Maildir if it does not exist yet.
+     * @param outputDir The output directory.
+     * @param mailbox The mailbox name as used in the local file names.
+     * @param canonicalHostname The canonical hostname of the mail server.
+     * @param compressed Whether new messages are stored gzip-compressed.
+     */
+    MaildirStorage(const std::string &outputDir, const std::string &mailbox, const std::string &canonicalHostname, bool compressed)
+        : MaildirStorage(outputDir, mailbox, canonicalHostname, compressed, getHostname()) {}
+
+    std::string getTempPath(unsigned id) const override
+    {
+        return root + "/tmp/" + std::to_string(time(nullptr)) + "." + std::to_string(getpid()) + "_" + std::to_string(id) + ".download";
+    }
+
+    std::string store(const std::string &tempPath, uint32_t uid, Content content, bool) override
+    {
+        static const char *const suffixes[] = {"", ",C=parts", ",C=headers"};
+        std::lock_guard<std::mutex> lock(indexMutex);
+        if (!indexed)
+        {
+            index();
+        }
+
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(now);
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(now - seconds);
+        std::string finalName = root + "/new/" + std::to_string(seconds.count()) + ".M" + std::to_string(micros.count()) + "P" +
+                                std::to_string(getpid()) + "Q" + std::to_string(++deliveries) + "." + hostname + ",U=" +
+                                std::to_string(uid) + suffixes[static_cast<int>(content)] + (compressed ? ".gz" : "");
+        fs::rename(tempPath, finalName);
+
+        // The new copy replaces the earlier ones with as much of the message or less, wherever a reader moved them
+        std::vector<std::string> &paths = files[uid];
+        std::error_code ec;
+        for (auto path = paths.begin(); path != paths.end();)
+        {
+            uint32_t found;
+            Content stored;
+            bool gzipped;
+            if (parseName(fs::path(*path).filename().string(), found, stored, gzipped) && stored >= content)
+            {
+                fs::remove(*path, ec);
+                path = paths.erase(path);
+            }
+            else
+            {
+                ++path;
+            }
+        }
+        paths.push_back(finalName);
+
+        return finalName;
+    }
+
+    void scan(UIDSet &headersOnly, UIDSet &fullEmails, std::unordered_map<uint32_t, uint64_t> &sizes) override
+    {
+        std::vector<uint32_t> headerUIDs, fullUIDs;
+        list([&](const fs::directory_entry &entry, const std::string &name)
+             {
+                 uint32_t uid;
+                 Content content;
+                 bool gzipped;
+                 if (parseName(name, uid, content, gzipped))
+                 {
+                     bool headers = content != Content::Full;
+                     (headers ? headerUIDs : fullUIDs).push_back(uid);
+                     if (!headers || sizes.find(uid) == sizes.end())
+                     {
+                         sizes[uid] = getMessageSize(entry, gzipped);
+                     }
+                 }
+             });
+
+        // A full message found next to its headers wins
+        fullEmails = UIDSet::fromUIDs(std::move(fullUIDs));
+        headersOnly = UIDSet::fromUIDs(std::move(headerUIDs)).subtract(fullEmails);
+    }
+
+    void remove(const UIDSet &uids) override
+    {
+        std::lock_guard<std::mutex> lock(indexMutex);
+        std::error_code ec;
+        list([&](const fs::directory_entry &entry, const std::string &name)
+             {
+                 uint32_t uid;
+                 Content content;
+                 bool gzipped;
+                 if (parseName(name, uid, content, gzipped) && uids.contains(uid))
+                 {
+                     fs::remove(entry.path(), ec);
+                     files.erase(uid);
+                 }
+             });
+    }
+};
+
+/**
+ * @class HashedMaildirStorage
+ * @brief A Maildir-like directory named <host>_<mailbox> in the output directory, not readable by
+ * standard mail readers. Messages are written to tmp/ and delivered to new/ as <uid>, <uid>_parts or
+ * <uid>_headers, split into 256 subdirectories by the lowest byte of the UID to keep the directories
+ * small, e.g. the message with UID 258 is delivered as new/02/258. Files moved to cur/ by another
+ * tool, with flags added, are still recognized. Compressed messages have .gz appended to the name.
+ */
+class HashedMaildirStorage : public MaildirStorage
+{
+private:
+    /**
+     * @brief Get the subdirectory of a message.
+     * @param folder Either new or cur.
+     * @param uid The UID of the message.
+     * @return std::string The path of the subdirectory.
+     */
+    std::string getSubdirectory(const std::string &folder, uint32_t uid) const
+    {
+        static const char digits[] = "0123456789abcdef";
+        return root + "/" + folder + "/" + digits[(uid >> 4) & 0xf] + digits[uid & 0xf];
+    }
+
+    /**
+     * @brief Parse the name of a delivered message.
+     * @param name The file name, possibly with the info suffix added by a mail reader.
+     * @param uid The UID of the message.
+     * @param headersOnly Whether the message consists of its headers only or some of its parts.
+     * @param gzipped Whether the message is gzip-compressed.
+     * @return true if the name is the name of a message, false otherwise.
+     */
+    static bool parseName(const std::string &name, uint32_t &uid, bool &headersOnly, bool &gzipped)
+    {
+        size_t end = name.find_first_not_of("0123456789");
+        if (end == 0)
+        {
+            return false;
+        }
+
+        std::string rest = end == std::string::npos ? "" : name.substr(end, name.find(':', end) - end);
+        gzipped = removeSuffix(rest, ".gz");
+        headersOnly = rest == "_headers" || rest == "_parts";
+        if (!rest.empty() && !headersOnly)
+        {
+            return false;
+        }
+
+        uid = std::stoul(name.substr(0, end));
+        return true;
+    }
+
+public:
+    /**
+     * @brief Constructs a HashedMaildirStorage object, creating the directories if they do not exist yet.
+     * @param outputDir The output directory.
+     * @param mailbox The mailbox name as used in the local file names.
+     * @param canonicalHostname The canonical hostname of the mail server.
+     * @param compressed Whether new messages are stored gzip-compressed.
+     */
+    HashedMaildirStorage(const std::string &outputDir, const std::string &mailbox, const std::string &canonicalHostname, bool compressed)
+        : MaildirStorage(outputDir, mailbox, canonicalHostname, compressed, "") {}
+
+    std::string store(const std::string &tempPath, uint32_t uid, Content content, bool) override
+    {
+        static const char *const suffixes[] = {"", "_parts", "_headers"};
+        std::string directory = getSubdirectory("new", uid);
+        fs::create_directories(directory);
+
+        std::string fileName = directory + "/" + std::to_string(uid);
+        std::string finalName = fileName + suffixes[static_cast<int>(content)] + (compressed ? ".gz" : "");
+        fs::rename(tempPath, finalName);
+        std::error_code ec;
+        for (int lesser = static_cast<int>(content) + 1; lesser <= static_cast<int>(Content::Headers); ++lesser)
+        {
+            fs::remove(fileName + suffixes[lesser], ec);
+            fs::remove(fileName + suffixes[lesser] + ".gz", ec);
+        }
+
+        return finalName;
+    }
+
+    void scan(UIDSet &headersOnly, UIDSet &fullEmails, std::unordered_map<uint32_t, uint64_t> &sizes) override
+    {
+        std::vector<uint32_t> headerUIDs, fullUIDs;
+        for (const char *folder : {"/new", "/cur"})
+        {
+            for (const auto &entry : fs::recursive_directory_iterator(root + folder))
+            {
+                uint32_t uid;
+                bool headers, gzipped;
+                if (entry.is_regular_file() && parseName(entry.path().filename().string(), uid, headers, gzipped))
+                {
+                    (headers ? headerUIDs : fullUIDs).push_back(uid);
+                    if (!headers || sizes.find(uid) == sizes.end())
+                    {
+                        sizes[uid] = getMessageSize(entry, gzipped);
+                    }
+                }
+            }
+        }
+
+        // A full message found next to its headers wins
+        fullEmails = UIDSet::fromUIDs(std::move(fullUIDs));
+        headersOnly = UIDSet::fromUIDs(std::move(headerUIDs)).subtract(fullEmails);
+    }
+
+    void remove(const UIDSet &uids) override
+    {
+        std::map<std::string, std::vector<uint32_t>> bySubdirectory; // Every subdirectory is listed once
+        for (const auto &range : uids.getRanges())
+        {
+            for (uint64_t uid = range.first; uid <= range.second; ++uid)
+            {
+                bySubdirectory[getSubdirectory("new", uid)].push_back(uid);
+                bySubdirectory[getSubdirectory("cur", uid)].push_back(uid);
+            }
+        }
+
+        std::error_code ec;
+        for (const auto &subdirectory : bySubdirectory)
+        {
+            UIDSet removed = UIDSet::fromUIDs(std::vector<uint32_t>(subdirectory.second));
+            for (const auto &entry : fs::directory_iterator(subdirectory.first, ec))
+            {
+                uint32_t uid;
+                bool headers, gzipped;
+                if (parseName(entry.path().filename().string(), uid, headers, gzipped) && removed.contains(uid))
+                {
+                    fs::remove(entry.path(), ec);
+                }
+            }
+        }
+    }
+};
+
+/**
+ * @class MboxStorage
+ * @brief All messages of the mailbox appended to one file named <host>_<mailbox>.mbox in the output
+ * directory, in the mboxrd format. Every message starts with an X-UID header added to it, and with
+ * an X-Headers-Only or X-Parts-Only header if only its headers or some of its parts were downloaded.
+ *
+ * The file is only ever appended to, so a message whose headers were stored earlier stays in it
+ * next to the full message. Only removing messages rewrites the file.
+ */
+class MboxStorage : public Storage
+{
+private:
+    std::string directory;  // The output directory.
+    std::string path;       // The mbox file.
+    std::string tempPrefix; // The path of the temporary files without their number.
+
+    static inline std::mutex mutex; // Keeps the messages appended by concurrent downloads apart.
+
+    /**
+     * @brief A message found in the mbox file.
+     */
+    struct Entry
+    {
+        uint32_t uid = 0;      // The UID from the X-UID header, 0 if there is none.
+        bool headers = false;  // Whether the message has the X-Headers-Only or X-Parts-Only header.
+        uint64_t size = 0;     // The size of the message as downloaded.
+        bool inHeader = true;  // Whether the header of the message is being read.
+    };
+
+    /**
+     * @brief Read the mbox file message by message.
+     * @param onLine Called with every line and the message it belongs to, nullptr for the lines before the first one.
+     * @param onEntry Called with every message once all of its lines were read.
+     */
+    void read(const std::function<void(const std::string &, const Entry *)> &onLine, const std::function<void(const Entry &)> &onEntry)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::string line;
+        Entry entry;
+        bool inEntry = false;
+
+        while (std::getline(file, line))
+        {
+            bool hasNewline = !file.eof();
+            if (line.compare(0, 5, "From ") == 0)
+            {
+                if (inEntry)
+                {
+                    entry.size -= std::min<uint64_t>(entry.size, 1); // The blank line separating the messages
+                    onEntry(entry);
+                }
+                entry = Entry();
+                inEntry = true;
+            }
+            else if (inEntry)
+            {
+                if (entry.inHeader && (line == "\r" || line.empty()))
+                {
+                    entry.inHeader = false;
+                }
+
+                if (entry.inHeader && line.compare(0, 7, "X-UID: ") == 0)
+                {
+                    entry.uid = std::stoul(line.substr(7));
+                }
+                else if (entry.inHeader && (line.compare(0, 16, "X-Headers-Only: ") == 0 || line.compare(0, 14, "X-Parts-Only: ") == 0))
+                {
+                    entry.headers = true;
+                }
+                else
+                {
+                    size_t quotes = line.find_first_not_of('>');
+                    bool escaped = quotes != 0 && quotes != std::string::npos && line.compare(quotes, 5, "From ") == 0;
+                    entry.size += line.length() + (hasNewline ? 1 : 0) - (escaped ? 1 : 0);
+                }
+            }
+
+            if (onLine)
+            {
+                onLine(line + (hasNewline ? "\n" : ""), inEntry ? &entry : nullptr);
+            }
+        }
+
+        if (inEntry)
+        {
+            entry.size -= std::min<uint64_t>(entry.size, 1);
+            onEntry(entry);
+        }
+    }
+
+public:
+    /**
+     * @brief Constructs a MboxStorage object.
+     * @param outputDir The output directory.
+     * @param mailbox The mailbox name as used in the local file names.
+     * @param canonicalHostname The canonical hostname of the mail server.
+     */
+    MboxStorage(const std::string &outputDir, const std::string &mailbox, const std::string &canonicalHostname)
+        : Storage(false), directory(outputDir), path(outputDir + "/" + canonicalHostname + "_" + mailbox + ".mbox"),
+          tempPrefix(outputDir + "/." + canonicalHostname + "_" + mailbox + "_download") {}
+
+    std::string getTempPath(unsigned id) const override
+    {
+        return tempPrefix + std::to_string(id) + ".tmp";
+    }
+
+    std::string store(const std::string &tempPath, uint32_t uid, Content content, bool flush) override
+    {
+        std::ifstream message(tempPath, std::ios::binary);
+        if (!message.is_open())
+        {
+            throw std::runtime_error("Unable to read file: " + tempPath);
+        }
+
+        // The From line carries the time the message was stored, in the asctime() format
+        char date[32];
+        time_t now = time(nullptr);
+        struct tm local;
+        strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", localtime_r(&now, &local));
+
+        std::string header = std::string("From imapcl ") + date + "\n" + "X-UID: " + std::to_string(uid) + "\r\n";
+        if (content == Content::Headers)
+        {
+            header += "X-Headers-Only: yes\r\n";
+        }
+        else if (content == Content::Parts)
+        {
+            header += "X-Parts-Only: yes\r\n";
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::error_code ec;
+        uintmax_t mboxSize = fs::exists(path, ec) ? fs::file_size(path, ec) : 0;
+        if (ec)
+        {
+            throw std::runtime_error("Unable to read file: " + path);
+        }
+
+        std::ofstream mbox(path, std::ios::binary | std::ios::app);
+        mbox << header;
+
+        // Lines looking like the start of a message get one more '>' (mboxrd)
+        std::string line;
+        bool endsWithNewline = true;
+        while (std::getline(message, line))
+        {
+            size_t quotes = line.find_first_not_of('>');
+            if (quotes != std::string::npos && line.compare(quotes, 5, "From ") == 0)
+            {
+                mbox << '>';
+            }
+            mbox << line;
+
+            endsWithNewline = !message.eof();
+            if (endsWithNewline)
+            {
+                mbox << '\n';
+            }
+        }
+        mbox << (endsWithNewline ? "\n" : "\n\n");
+        mbox.close();
+
+        if (!mbox || (flush && !SyncState::syncPath(path)))
+        {
+            // A partial entry would still carry its X-UID, and scan() would count it as downloaded
+            fs::resize_file(path, mboxSize, ec);
+            throw std::runtime_error("Unable to write file: " + path);
+        }
+
+        fs::remove(tempPath, ec);
+        return path;
+    }
+
+    void scan(UIDSet &headersOnly, UIDSet &fullEmails, std::unordered_map<uint32_t, uint64_t> &sizes) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint32_t> headerUIDs, fullUIDs;
+
+        read(nullptr, [&](const Entry &entry)
+             {
+                 if (entry.uid == 0)
+                 {
+                     return; // Not stored by this program
+                 }
+                 (entry.headers ? headerUIDs : fullUIDs).push_back(entry.uid);
+                 if (!entry.headers || sizes.find(entry.uid) == sizes.end())
+                 {
+                     sizes[entry.uid] = entry.size;
+                 } });
+
+        // A full message stored after its headers wins
+        fullEmails = UIDSet::fromUIDs(std::move(fullUIDs));
+        headersOnly = UIDSet::fromUIDs(std::move(headerUIDs)).subtract(fullEmails);
+    }
+
+    void remove(const UIDSet &uids) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!fs::exists(path))
+        {
+            return;
+        }
+
+        // The messages are copied to a new file without the removed ones. Whether a message is
+        // removed is known once its header is read, so only the headers are buffered.
+        std::string tempPath = path + ".tmp";
+        std::ofstream copy(tempPath, std::ios::binary | std::ios::trunc);
+        std::string header;
+
+        read([&](const std::string &line, const Entry *entry)
+             {
+                 if (entry == nullptr)
+                 {
+                     copy << line; // Not part of any message
+                 }
+                 else if (entry->inHeader)
+                 {
+                     header += line;
+                 }
+                 else if (!uids.contains(entry->uid))
+                 {
+                     copy << header << line;
+                     header.clear();
+                 }
+                 else
+                 {
+                     header.clear();
+                 } },
+             [&](const Entry &entry)
+             {
+                 if (!uids.contains(entry.uid))
+                 {
+                     copy << header; // A message without a body
+                 }
+                 header.clear(); });
+
+        copy.close();
+        if (!copy)
+        {
+            std::error_code ec;
+            fs::remove(tempPath, ec);
+            std::cerr << "Error: Unable to write file: " << tempPath << std::endl;
+            return;
+        }
+        fs::rename(tempPath, path);
+    }
+};
+
+inline std::unique_ptr<Storage> Storage::create(ArgumentParser::StorageFormat format, const std::string &outputDir, const std::string &mailbox,
+                                                const std::string &canonicalHostname, bool compressed)
+{
+    switch (format)
+    {
+    case ArgumentParser::StorageFormat::Maildir:
+        return std::make_unique<MaildirStorage>(outputDir, mailbox, canonicalHostname, compressed);
+    case ArgumentParser::StorageFormat::HashedMaildir:
+        return std::make_unique<HashedMaildirStorage>(outputDir, mailbox, canonicalHostname, compressed);
+    case ArgumentParser::StorageFormat::Mbox:
+        return std::make_unique<MboxStorage>(outputDir, mailbox, canonicalHostname);
+    default:
+        return std::make_unique<FlatStorage>(outputDir, mailbox, canonicalHostname, compressed);
+    }
+}
+
+#endif
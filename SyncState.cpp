@@ -0,0 +1,696 @@
+/**
+ * @file SyncState.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing the persistent index of the messages downloaded from a mailbox.
+ */
+
+#ifndef SYNCSTATE_CPP
+#define SYNCSTATE_CPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+#include <mutex>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "UIDSet.cpp"
+
+/**
+ * @class SyncState
+ * @brief The synchronization state of one mailbox on one server, kept in the output directory
+ * so that the directory does not have to be scanned on every run.
+ *
+ * The state is stored as a binary snapshot and a journal next to it. Every batch of downloaded
+ * messages is appended to the journal as one record group ending with a commit marker, so an
+ * interrupted run loses at most the batch in progress. The journal is merged into the snapshot
+ * by save(), which replaces the snapshot atomically.
+ *
+ * The messages downloaded by a connection are collected in its own Batch until they are on disk,
+ * only then commit() records them. commit() and the getters may be called by several connections
+ * downloading parts of the mailbox at once, the rest of the methods must not run concurrently
+ * with anything else.
+ */
+class SyncState
+{
+private:
+    std::string statePath;   // Path of the snapshot file.
+    std::string journalPath; // Path of the journal file.
+    std::string directory;   // The directory of the files.
+    bool durable;            // Whether the files are flushed to disk before they count as written.
+
+    uint32_t uidValidity;                         // UIDVALIDITY of the mailbox the state belongs to.
+    uint64_t highestModSeq;                       // HIGHESTMODSEQ of the mailbox at the last sync, 0 if unknown.
+    mutable UIDSet fullEmails;                    // UIDs with full emails downloaded.
+    mutable UIDSet headersOnly;                   // UIDs with only headers or some parts downloaded, may overlap with fullEmails.
+    mutable std::vector<uint32_t> addedFull;      // UIDs recorded into fullEmails since the last merge, in any order.
+    mutable std::vector<uint32_t> addedHeaders;   // UIDs recorded into headersOnly since the last merge, in any order.
+    std::unordered_map<uint32_t, uint64_t> sizes; // Sizes of the downloaded messages by UID.
+    std::unordered_map<uint32_t, std::string> skippedParts; // Sections of the parts left out of the messages with some parts downloaded, by UID.
+    mutable std::mutex journalMutex;              // Guards the journal and the records committed by concurrent downloads.
+
+    static constexpr char MAGIC[8] = {'I', 'M', 'A', 'P', 'C', 'L', 'S', '2'};
+    static constexpr char RECORD_MESSAGE = 'M';
+    static constexpr char RECORD_PARTS = 'P';
+    static constexpr char RECORD_COMMIT = 'C';
+
+    /**
+     * @brief A downloaded message, as recorded in the journal.
+     */
+    struct Record
+    {
+        uint32_t uid;        // The UID of the message.
+        bool headers;        // Whether only the headers or some parts were downloaded.
+        uint64_t size;       // The size of the saved message.
+        bool parts;          // Whether some parts were downloaded.
+        std::string skipped; // The sections of the parts left out.
+    };
+
+public:
+    /**
+     * @class Batch
+     * @brief The messages saved by one connection since its files were last flushed to disk.
+     * They are handed to commit() once they are on disk, or dropped if flushing them failed.
+     */
+    class Batch
+    {
+    private:
+        std::vector<Record> records; // The messages in the order they were saved.
+
+        friend class SyncState;
+
+    public:
+        /**
+         * @brief Add a downloaded message.
+         * @param uid The UID of the message.
+         * @param headers Whether only the headers were downloaded.
+         * @param size The size of the saved message in bytes.
+         */
+        void addMessage(uint32_t uid, bool headers, uint64_t size)
+        {
+            records.push_back({uid, headers, size, false, ""});
+        }
+
+        /**
+         * @brief Add a message with only some of its parts downloaded.
+         * @param uid The UID of the message.
+         * @param size The size of the saved message in bytes.
+         * @param skipped The sections of the parts left out, e.g. 2,3.1.
+         */
+        void addParts(uint32_t uid, uint64_t size, const std::string &skipped)
+        {
+            records.push_back({uid, true, size, true, skipped});
+        }
+
+        /**
+         * @brief Get the number of messages in the batch.
+         * @return The number of messages.
+         */
+        size_t size() const
+        {
+            return records.size();
+        }
+
+        /**
+         * @brief Drop the messages, e.g. after flushing them failed.
+         */
+        void clear()
+        {
+            records.clear();
+        }
+    };
+
+private:
+    /**
+     * @brief Append the raw bytes of a value to a buffer.
+     */
+    template <typename T>
+    static void put(std::string &buffer, const T &value)
+    {
+        buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    /**
+     * @brief Read the raw bytes of a value from a buffer.
+     * @return true if the buffer held enough bytes, false otherwise.
+     */
+    template <typename T>
+    static bool get(const std::string &buffer, size_t &pos, T &value)
+    {
+        if (pos + sizeof(value) > buffer.size())
+        {
+            return false;
+        }
+
+        memcpy(&value, buffer.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+    /**
+     * @brief Append a UID set to a buffer as its number of ranges followed by the ranges.
+     */
+    static void putSet(std::string &buffer, const UIDSet &set)
+    {
+        put<uint64_t>(buffer, set.getRanges().size());
+        for (const auto &range : set.getRanges())
+        {
+            put(buffer, range.first);
+            put(buffer, range.second);
+        }
+    }
+
+    /**
+     * @brief Read a UID set written by putSet from a buffer.
+     * @return true if the set was read completely, false otherwise.
+     */
+    static bool getSet(const std::string &buffer, size_t &pos, UIDSet &set)
+    {
+        uint64_t count;
+        if (!get(buffer, pos, count))
+        {
+            return false;
+        }
+
+        set = UIDSet();
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            uint32_t first, last;
+            if (!get(buffer, pos, first) || !get(buffer, pos, last))
+            {
+                return false;
+            }
+            set.addRange(first, last);
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Append a string to a buffer as its length followed by its bytes.
+     */
+    static void putString(std::string &buffer, const std::string &value)
+    {
+        put<uint32_t>(buffer, value.size());
+        buffer += value;
+    }
+
+    /**
+     * @brief Read a string written by putString from a buffer.
+     * @return true if the string was read completely, false otherwise.
+     */
+    static bool getString(const std::string &buffer, size_t &pos, std::string &value)
+    {
+        uint32_t length;
+        if (!get(buffer, pos, length) || pos + length > buffer.size())
+        {
+            return false;
+        }
+
+        value = buffer.substr(pos, length);
+        pos += length;
+        return true;
+    }
+
+    /**
+     * @brief Read a whole file into a string.
+     * @return true if the file was read, false if it could not be opened.
+     */
+    static bool readFile(const std::string &path, std::string &content)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    /**
+     * @brief Apply the committed record groups of the journal, ignoring an incomplete last group.
+     */
+    void replayJournal()
+    {
+        std::string journal;
+        if (!readFile(journalPath, journal))
+        {
+            return;
+        }
+
+        size_t pos = 0;
+        std::vector<Record> group;
+
+        while (pos < journal.size())
+        {
+            char type = journal[pos++];
+
+            if (type == RECORD_COMMIT)
+            {
+                applyRecords(group);
+                group.clear();
+                continue;
+            }
+
+            Record record{0, true, 0, type == RECORD_PARTS, ""};
+            uint8_t headers = 1;
+            bool complete = type == RECORD_MESSAGE
+                                ? get(journal, pos, record.uid) && get(journal, pos, headers) && get(journal, pos, record.size)
+                                : type == RECORD_PARTS && get(journal, pos, record.uid) && get(journal, pos, record.size) &&
+                                      getString(journal, pos, record.skipped);
+            if (!complete)
+            {
+                break; // Torn write of an interrupted run
+            }
+            record.headers = headers != 0;
+            group.push_back(record);
+        }
+    }
+
+    /**
+     * @brief Record downloaded messages in memory.
+     */
+    void applyRecords(const std::vector<Record> &records)
+    {
+        for (const Record &record : records)
+        {
+            if (record.parts)
+            {
+                applyParts(record.uid, record.size, record.skipped);
+            }
+            else
+            {
+                applyMessage(record.uid, record.headers, record.size);
+            }
+        }
+    }
+
+    /**
+     * @brief Record a downloaded message in memory. The UIDs arrive in any order, e.g. with
+     * --order newest or from parallel connections, so they are merged into the sets at once
+     * by mergeAdded() instead of one by one.
+     */
+    void applyMessage(uint32_t uid, bool headers, uint64_t size)
+    {
+        if (headers)
+        {
+            addedHeaders.push_back(uid);
+        }
+        else
+        {
+            addedFull.push_back(uid);
+            skippedParts.erase(uid);
+        }
+        sizes[uid] = size;
+    }
+
+    /**
+     * @brief Record a message with some parts downloaded in memory.
+     */
+    void applyParts(uint32_t uid, uint64_t size, const std::string &skipped)
+    {
+        addedHeaders.push_back(uid);
+        skippedParts[uid] = skipped;
+        sizes[uid] = size;
+    }
+
+    /**
+     * @brief Merge the UIDs recorded since the last merge into the sets, sorting them once.
+     */
+    void mergeAdded() const
+    {
+        if (!addedFull.empty())
+        {
+            fullEmails = fullEmails.unite(UIDSet::fromUIDs(std::move(addedFull)));
+            addedFull.clear();
+        }
+        if (!addedHeaders.empty())
+        {
+            headersOnly = headersOnly.unite(UIDSet::fromUIDs(std::move(addedHeaders)));
+            addedHeaders.clear();
+        }
+    }
+
+public:
+    /**
+     * @brief Constructs an empty SyncState for the given mailbox.
+     * @param outputDir The directory where the emails are saved.
+     * @param mailbox The mailbox name.
+     * @param canonicalHostname The canonical hostname of the mail server.
+     */
+    SyncState(const std::string &outputDir, const std::string &mailbox, const std::string &canonicalHostname)
+        : statePath(outputDir + "/" + canonicalHostname + "_syncstate_" + mailbox), journalPath(statePath + ".journal"),
+          directory(outputDir), durable(false), uidValidity(0), highestModSeq(0) {}
+
+    /**
+     * @brief Flush a file or a directory to disk.
+     * @param path The path to the file or directory.
+     * @return true if it was flushed, false otherwise.
+     */
+    static bool syncPath(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+    }
+
+    /**
+     * @brief Choose whether commit() and save() flush the journal and the snapshot to disk.
+     * The messages recorded must have been flushed before they are committed.
+     *
+     * @param value true to flush the files, false to leave it to the system.
+     */
+    void setDurable(bool value)
+    {
+        durable = value;
+    }
+
+    /**
+     * @brief Load the state from the snapshot and the journal.
+     * @return true if a valid snapshot was found, false if the state has to be rebuilt.
+     */
+    bool load()
+    {
+        std::string snapshot;
+        if (!readFile(statePath, snapshot))
+        {
+            return false;
+        }
+
+        size_t pos = sizeof(MAGIC);
+        uint64_t count;
+        if (snapshot.compare(0, sizeof(MAGIC), MAGIC, sizeof(MAGIC)) != 0 || !get(snapshot, pos, uidValidity) ||
+            !get(snapshot, pos, highestModSeq) || !getSet(snapshot, pos, fullEmails) || !getSet(snapshot, pos, headersOnly) ||
+            !get(snapshot, pos, count))
+        {
+            reset(0);
+            return false;
+        }
+
+        sizes.reserve(std::min<uint64_t>(count, snapshot.size() / (sizeof(uint32_t) + sizeof(uint64_t))));
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            uint32_t uid;
+            uint64_t size;
+            if (!get(snapshot, pos, uid) || !get(snapshot, pos, size))
+            {
+                reset(0);
+                return false;
+            }
+            sizes[uid] = size;
+        }
+
+        if (!get(snapshot, pos, count))
+        {
+            reset(0);
+            return false;
+        }
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            uint32_t uid;
+            std::string skipped;
+            if (!get(snapshot, pos, uid) || !getString(snapshot, pos, skipped))
+            {
+                reset(0);
+                return false;
+            }
+            skippedParts[uid] = skipped;
+        }
+        if (pos != snapshot.size())
+        {
+            reset(0);
+            return false;
+        }
+
+        replayJournal();
+        return true;
+    }
+
+    /**
+     * @brief Replace the downloaded messages, e.g. with the result of a directory scan.
+     * @param headers UIDs with only headers downloaded.
+     * @param full UIDs with full emails downloaded.
+     * @param messageSizes Sizes of the downloaded messages by UID.
+     */
+    void setMessages(const UIDSet &headers, const UIDSet &full, const std::unordered_map<uint32_t, uint64_t> &messageSizes)
+    {
+        headersOnly = headers;
+        fullEmails = full;
+        addedHeaders.clear();
+        addedFull.clear();
+        sizes = messageSizes;
+        skippedParts.clear(); // Not known from the files, the messages with some parts count as headers
+    }
+
+    /**
+     * @brief Forget all downloaded messages and start over for a new UIDVALIDITY.
+     * @param newUidValidity The UIDVALIDITY of the mailbox.
+     */
+    void reset(uint32_t newUidValidity)
+    {
+        uidValidity = newUidValidity;
+        highestModSeq = 0;
+        fullEmails = UIDSet();
+        headersOnly = UIDSet();
+        addedFull.clear();
+        addedHeaders.clear();
+        sizes.clear();
+        skippedParts.clear();
+    }
+
+    /**
+     * @brief Forget messages that no longer exist on the server. Persistent with the next save().
+     * @param uids The UIDs of the messages.
+     */
+    void removeMessages(const UIDSet &uids)
+    {
+        mergeAdded();
+        fullEmails = fullEmails.subtract(uids);
+        headersOnly = headersOnly.subtract(uids);
+
+        for (auto size = sizes.begin(); size != sizes.end();)
+        {
+            size = uids.contains(size->first) ? sizes.erase(size) : std::next(size);
+        }
+        for (auto skipped = skippedParts.begin(); skipped != skippedParts.end();)
+        {
+            skipped = uids.contains(skipped->first) ? skippedParts.erase(skipped) : std::next(skipped);
+        }
+    }
+
+    /**
+     * @brief Record the messages of a batch and append them to the journal as one group.
+     * The files of the messages must be on disk already. If the journal cannot be written,
+     * the messages become persistent with the next save().
+     *
+     * @param batch The batch, empty afterwards.
+     */
+    void commit(Batch &batch)
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        if (batch.records.empty())
+        {
+            return;
+        }
+
+        applyRecords(batch.records);
+
+        std::string group;
+        for (const Record &record : batch.records)
+        {
+            if (record.parts)
+            {
+                group += RECORD_PARTS;
+                put(group, record.uid);
+                put(group, record.size);
+                putString(group, record.skipped);
+            }
+            else
+            {
+                group += RECORD_MESSAGE;
+                put(group, record.uid);
+                put<uint8_t>(group, record.headers ? 1 : 0);
+                put(group, record.size);
+            }
+        }
+        group += RECORD_COMMIT;
+        batch.clear();
+
+        int fd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        off_t journalSize = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+        bool written = journalSize >= 0;
+        for (size_t pos = 0; written && pos < group.size();)
+        {
+            ssize_t count = write(fd, group.data() + pos, group.size() - pos);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            written = count > 0;
+            pos += written ? count : 0;
+        }
+        written = written && (!durable || fsync(fd) == 0);
+
+        if (!written)
+        {
+            // Cut off the torn group, so the next commit does not append after garbage that replayJournal() would misread
+            if (journalSize >= 0 && ftruncate(fd, journalSize) != 0)
+            {
+                std::cerr << "Failed to truncate sync state journal: " << journalPath << std::endl;
+            }
+            std::cerr << "Failed to write sync state journal: " << journalPath << std::endl;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    /**
+     * @brief Write the whole state into a new snapshot, replace the old one atomically
+     * and drop the journal merged into it.
+     * @return true if the snapshot was written, false otherwise.
+     */
+    bool save()
+    {
+        mergeAdded();
+        headersOnly = headersOnly.subtract(fullEmails); // Upgraded messages are full emails now
+
+        std::string snapshot(MAGIC, sizeof(MAGIC));
+        put(snapshot, uidValidity);
+        put(snapshot, highestModSeq);
+        putSet(snapshot, fullEmails);
+        putSet(snapshot, headersOnly);
+        put<uint64_t>(snapshot, sizes.size());
+        for (const auto &size : sizes)
+        {
+            put(snapshot, size.first);
+            put(snapshot, size.second);
+        }
+        put<uint64_t>(snapshot, skippedParts.size());
+        for (const auto &skipped : skippedParts)
+        {
+            put(snapshot, skipped.first);
+            putString(snapshot, skipped.second);
+        }
+
+        std::string tempPath = statePath + ".tmp";
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(snapshot.data(), snapshot.size());
+        file.close();
+
+        std::error_code ec;
+        if (!file.fail() && (!durable || syncPath(tempPath)))
+        {
+            std::filesystem::rename(tempPath, statePath, ec);
+            if (durable && !ec)
+            {
+                syncPath(directory); // Make the rename itself durable
+            }
+        }
+        else
+        {
+            file.setstate(std::ios::failbit);
+        }
+
+        if (file.fail() || ec)
+        {
+            std::cerr << "Failed to write sync state: " << statePath << std::endl;
+            std::filesystem::remove(tempPath, ec);
+            return false;
+        }
+
+        std::filesystem::remove(journalPath, ec);
+        return true;
+    }
+
+    /**
+     * @brief Get the UIDVALIDITY the state belongs to.
+     * @return The UIDVALIDITY, 0 if unknown.
+     */
+    uint32_t getUIDValidity() const
+    {
+        return uidValidity;
+    }
+
+    /**
+     * @brief Set the UIDVALIDITY the state belongs to.
+     * @param value The UIDVALIDITY.
+     */
+    void setUIDValidity(uint32_t value)
+    {
+        uidValidity = value;
+    }
+
+    /**
+     * @brief Get the HIGHESTMODSEQ of the mailbox at the last sync.
+     * @return The HIGHESTMODSEQ, 0 if unknown.
+     */
+    uint64_t getHighestModSeq() const
+    {
+        return highestModSeq;
+    }
+
+    /**
+     * @brief Set the HIGHESTMODSEQ of the mailbox.
+     * @param value The HIGHESTMODSEQ.
+     */
+    void setHighestModSeq(uint64_t value)
+    {
+        highestModSeq = value;
+    }
+
+    /**
+     * @brief Get the UIDs with full emails downloaded.
+     * @return The set of UIDs.
+     */
+    UIDSet getFullEmails() const
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        mergeAdded();
+        return fullEmails;
+    }
+
+    /**
+     * @brief Get the UIDs with headers downloaded. Some of them may have been upgraded to full emails since.
+     * @return The set of UIDs, including the messages with some parts downloaded.
+     */
+    UIDSet getHeadersOnly() const
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        mergeAdded();
+        return headersOnly;
+    }
+
+    /**
+     * @brief Get the UIDs with some parts downloaded, a subset of getHeadersOnly().
+     * @return The set of UIDs.
+     */
+    UIDSet getPartEmails() const
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        std::vector<uint32_t> uids;
+        for (const auto &skipped : skippedParts)
+        {
+            uids.push_back(skipped.first);
+        }
+        return UIDSet::fromUIDs(std::move(uids));
+    }
+
+};
+
+#endif
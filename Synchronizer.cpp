@@ -0,0 +1,1232 @@
+/**
+ * @file Synchronizer.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing the synchronization of mailboxes over one or more authenticated connections.
+ */
+
+#ifndef SYNCHRONIZER_CPP
+#define SYNCHRONIZER_CPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include "ArgumentParser.h"
+#include "IMAPClient.cpp"
+#include "FetchHandler.cpp"
+
+/**
+ * @struct MailboxStats
+ * @brief Statistics of the synchronization of one mailbox.
+ */
+struct MailboxStats
+{
+    std::string mailbox;  /**< The mailbox name. */
+    bool success = false; /**< Whether the synchronization completed. */
+    int downloaded = 0;   /**< The number of messages downloaded. */
+    size_t vanished = 0;  /**< The number of downloaded messages no longer on the server. */
+    double seconds = 0;   /**< The duration of the synchronization. */
+};
+
+/**
+ * @struct MailboxJob
+ * @brief The state of one mailbox while its parts are downloaded, possibly over several connections.
+ */
+struct MailboxJob
+{
+    std::string mailbox;                           /**< The mailbox name as known to the server. */
+    std::string mailboxFile;                       /**< The mailbox name as used in the local file names. */
+    std::unique_ptr<SyncState> syncState;          /**< The sync state, shared by all parts. */
+    std::unique_ptr<Storage> storage;              /**< The storage the messages are saved in, shared by all parts. */
+    uint32_t uidValidity = 0;                      /**< The UIDVALIDITY the parts must be downloaded under. */
+    uint64_t serverModSeq = 0;                     /**< The HIGHESTMODSEQ reached once every part is downloaded. */
+    MailboxStats stats;                            /**< The statistics of the mailbox. */
+    std::chrono::steady_clock::time_point started; /**< When the synchronization of the mailbox started. */
+    size_t pendingParts = 0;                       /**< The number of parts not downloaded yet. */
+    bool fetchFailed = false;                      /**< Whether downloading any part failed. */
+    size_t skipped = 0;                            /**< The number of messages left out by the size and date limits. */
+};
+
+/**
+ * @struct SyncTask
+ * @brief A unit of work of a connection: either selecting a mailbox and planning its download,
+ * or downloading one part of the UIDs of a planned mailbox.
+ */
+struct SyncTask
+{
+    MailboxJob *job = nullptr; /**< The mailbox the task belongs to. */
+    bool plan = false;         /**< Whether the task plans the mailbox instead of downloading a part. */
+    std::vector<UIDSet> batches; /**< The batches of UIDs to download, in order. */
+};
+
+/**
+ * @struct SyncWorker
+ * @brief One authenticated connection with its own queue of tasks.
+ */
+struct SyncWorker
+{
+    IMAPClient *client = nullptr;      /**< The connection. */
+    std::unique_ptr<IMAPClient> owned; /**< The connection if it was opened by the Synchronizer. */
+    std::string selected;              /**< The mailbox currently selected on the connection. */
+    int qresyncState = -1;             /**< Whether QRESYNC is enabled: -1 unknown, 0 no, 1 yes. */
+    std::deque<SyncTask> tasks;        /**< The tasks waiting for the connection. */
+};
+
+/**
+ * @class Synchronizer
+ * @brief A class synchronizing mailboxes over a pool of connections to one server.
+ *
+ * Every connection takes tasks from the front of its own queue. Planning a mailbox pushes the parts
+ * of its download to the front of the queue of the connection that planned it, so it goes on with
+ * the mailbox it has selected. An idle connection steals tasks from the back of the longest queue,
+ * so the parts of a large mailbox end up spread over all connections.
+ *
+ * A connection lost in the middle of a task is opened again after a growing delay, and the task
+ * starts over on it: the mailbox is selected again under the same UIDVALIDITY, and only the
+ * messages not recorded in the sync state yet are downloaded.
+ *
+ * All connections share the event loop of the logged in client. The additional ones run as tasks
+ * of the loop, so the whole pool is driven from the calling thread.
+ */
+class Synchronizer
+{
+private:
+    IMAPClient *client;                     // The logged in client, replaced when its connection is lost.
+    std::unique_ptr<IMAPClient> ownedClient; // The replacement of the client given to the constructor, if any.
+    EventLoop &loop;                        // The event loop driving all connections.
+    const ArgumentParser::ParsedArgs &args; // The program arguments.
+    std::string login;                      // The arguments of the LOGIN command.
+    std::map<std::string, std::unique_ptr<SyncState>> *stateCache; // Sync states kept between runs, if any.
+    std::unique_ptr<BlobStore> blobStore;   // The store identical messages share, if deduplicating.
+    std::chrono::steady_clock::time_point deadline; // When the current run gives up, max for never.
+
+    std::vector<SyncWorker> workers; // The connections, the first one is the logged in client.
+    size_t runningTasks;             // The number of tasks being worked on.
+
+    static constexpr int RECONNECT_ATTEMPTS = 5;                 // Connection attempts before a task is given up
+    static constexpr std::chrono::seconds RECONNECT_DELAY{1};    // The delay before the first attempt, doubled for every further one
+    static constexpr size_t PACKED_BATCH_BYTES = 16 * 1024 * 1024; // The size packed batches are filled up to without --batch-bytes
+
+    /**
+     * @brief Write one line of a report.
+     * @param out The stream to write to.
+     * @param message The line without the newline.
+     */
+    void report(std::ostream &out, const std::string &message)
+    {
+        out << message << std::endl;
+    }
+
+    /**
+     * @brief Get the number of seconds elapsed since a point in time.
+     * @param started The point in time.
+     * @return double The elapsed seconds.
+     */
+    static double secondsSince(std::chrono::steady_clock::time_point started)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+
+    /**
+     * @brief Enable QRESYNC for the session if the server supports it. Only asks once per connection.
+     * @param worker The connection.
+     * @return true if QRESYNC is enabled, false otherwise.
+     */
+    bool enableQresync(SyncWorker &worker)
+    {
+        if (worker.qresyncState < 0)
+        {
+            worker.qresyncState = worker.client->hasCapability("QRESYNC") &&
+                                  Helpers::IsStatusOK(Helpers::GetStatusLine(worker.client->sendCommand("ENABLE QRESYNC")));
+        }
+
+        return worker.qresyncState == 1;
+    }
+
+    /**
+     * @brief Take the next task of a connection, stealing one if its own queue is empty.
+     *
+     * @param id The index of the connection.
+     * @param task The task taken.
+     * @return true if a task was taken, false if all queues are empty.
+     */
+    bool takeTask(size_t id, SyncTask &task)
+    {
+        SyncWorker *victim = &workers[id];
+
+        if (!victim->tasks.empty())
+        {
+            task = std::move(victim->tasks.front());
+            victim->tasks.pop_front();
+            return true;
+        }
+
+        for (SyncWorker &worker : workers)
+        {
+            if (worker.tasks.size() > victim->tasks.size())
+            {
+                victim = &worker;
+            }
+        }
+
+        if (victim->tasks.empty())
+        {
+            return false;
+        }
+
+        task = std::move(victim->tasks.back());
+        victim->tasks.pop_back();
+        return true;
+    }
+
+    /**
+     * @brief Run the tasks of a connection until no connection has any work left.
+     * @param id The index of the connection.
+     */
+    void workLoop(size_t id)
+    {
+        while (true)
+        {
+            SyncTask task;
+            if (takeTask(id, task))
+            {
+                ++runningTasks;
+                runTask(id, task);
+                --runningTasks;
+            }
+            else if (runningTasks == 0)
+            {
+                return; // Nothing queued and nothing running that could queue more
+            }
+            else
+            {
+                // The other connections go on meanwhile, until one queues more work or all are done
+                loop.runUntil([this]()
+                              { return runningTasks == 0 || std::any_of(workers.begin(), workers.end(), [](const SyncWorker &worker)
+                                                                        { return !worker.tasks.empty(); }); },
+                              -1, -1);
+            }
+        }
+    }
+
+    /**
+     * @brief Open a lost connection again, waiting longer before every further attempt.
+     * @param worker The connection.
+     * @param failures The number of attempts made so far for the task, increased by the attempts made.
+     * @return true if the connection is open again, false if it was given up.
+     */
+    bool reconnect(SyncWorker &worker, int &failures)
+    {
+        worker.selected.clear();
+        worker.qresyncState = -1;
+
+        while (failures < RECONNECT_ATTEMPTS)
+        {
+            std::chrono::seconds delay = RECONNECT_DELAY * (1 << failures);
+            if (std::chrono::steady_clock::now() + delay >= deadline)
+            {
+                report(std::cerr, "Error: No time left to reconnect to the server.");
+                return false;
+            }
+            report(std::cerr, "Connection to the server lost, reconnecting in " + std::to_string(delay.count()) + " s");
+            loop.sleepUntil(std::chrono::steady_clock::now() + delay);
+            ++failures;
+
+            std::unique_ptr<IMAPClient> connection = openConnection(args, login, &loop);
+            if (!connection)
+            {
+                continue;
+            }
+            connection->setDeadline(deadline);
+
+            worker.client = connection.get();
+            if (&worker == &workers.front())
+            {
+                client = connection.get(); // The logged in client is kept by the caller, only its replacement is owned
+                ownedClient = std::move(connection);
+            }
+            else
+            {
+                worker.owned = std::move(connection);
+            }
+            return true;
+        }
+
+        report(std::cerr, "Error: Unable to reconnect to the server.");
+        return false;
+    }
+
+    /**
+     * @brief Run one task on a connection, starting it over on a new connection if the connection is lost.
+     * @param id The index of the connection.
+     * @param task The task.
+     */
+    void runTask(size_t id, SyncTask &task)
+    {
+        SyncWorker &worker = workers[id];
+        MailboxJob &job = *task.job;
+        int failures = 0;
+        int downloaded = 0;
+
+        while (true)
+        {
+            int partDownloaded = 0;
+            try
+            {
+                if (task.plan)
+                {
+                    planParts(worker, job);
+                }
+                else
+                {
+                    bool success = fetchPart(worker, job, task.batches, partDownloaded);
+                    finishPart(job, success, downloaded + partDownloaded);
+                }
+                return;
+            }
+            catch (const IMAPClient::ConnectionError &)
+            {
+                downloaded += partDownloaded;
+            }
+
+            if (partDownloaded > 0)
+            {
+                failures = 0; // The connection made progress, so it was not the server refusing the work
+            }
+            if (!reconnect(worker, failures))
+            {
+                if (task.plan)
+                {
+                    job.stats.seconds = secondsSince(job.started);
+                }
+                else
+                {
+                    finishPart(job, false, downloaded);
+                }
+                return;
+            }
+
+            // Continue after the messages recorded before the connection was lost
+            std::vector<UIDSet> batches;
+            for (const UIDSet &batch : task.batches)
+            {
+                UIDSet remaining = Helpers::GetSynchronizingUIDs(args.headers_only, !args.part_types.empty(), *job.syncState, batch);
+                if (!remaining.empty())
+                {
+                    batches.push_back(std::move(remaining));
+                }
+            }
+            task.batches = std::move(batches);
+        }
+    }
+
+    /**
+     * @brief Plan a mailbox and queue the parts of its download on the connection that planned it.
+     * @param worker The connection.
+     * @param job The mailbox.
+     */
+    void planParts(SyncWorker &worker, MailboxJob &job)
+    {
+        job.skipped = 0;
+        UIDSet fetchUIDs = planMailbox(worker, job);
+        std::vector<UIDSet> batches;
+        if (fetchUIDs.empty() || !planFetches(worker, job, fetchUIDs, batches))
+        {
+            job.stats.seconds = secondsSince(job.started);
+            return;
+        }
+        if (batches.empty())
+        {
+            // Every message is left out, the mailbox stays behind HIGHESTMODSEQ so they are looked at again
+            job.syncState->save();
+            job.stats.success = true;
+            job.stats.seconds = secondsSince(job.started);
+            return;
+        }
+
+        // A single connection downloads the mailbox in one go, a pool splits it so that it can be shared
+        std::vector<std::vector<UIDSet>> parts;
+        size_t partBatches = workers.size() == 1 ? batches.size() : args.pipeline_depth;
+        for (size_t first = 0; first < batches.size(); first += partBatches)
+        {
+            size_t last = std::min(first + partBatches, batches.size());
+            parts.emplace_back(std::make_move_iterator(batches.begin() + first), std::make_move_iterator(batches.begin() + last));
+        }
+        job.pendingParts = parts.size();
+
+        for (auto part = parts.rbegin(); part != parts.rend(); ++part)
+        {
+            worker.tasks.push_front({&job, false, std::move(*part)});
+        }
+    }
+
+    /**
+     * @brief Group the UIDs to download into FETCH batches in the order asked for, leaving out the
+     * messages outside the size and date limits. Unless the order is by UID and nothing is limited,
+     * the size, date and flags of the messages are fetched first.
+     *
+     * @param worker The connection, with the mailbox selected.
+     * @param job The mailbox, counting the messages left out.
+     * @param uids The UIDs to download.
+     * @param batches The batches of UIDs, in the order to fetch them.
+     * @return true if the batches are planned, false if the server did not report the messages.
+     */
+    bool planFetches(SyncWorker &worker, MailboxJob &job, const UIDSet &uids, std::vector<UIDSet> &batches)
+    {
+        bool limited = args.max_size > 0 || args.since > 0 || args.before > 0;
+        if (args.fetch_order == ArgumentParser::FetchOrder::Uid && !limited && args.batch_bytes == 0)
+        {
+            batches = uids.split(args.batch_size);
+            return true;
+        }
+
+        std::map<uint32_t, MessageInfo> infos;
+        std::vector<std::string> commands = Helpers::GetBatchedFetches(uids, "(UID RFC822.SIZE INTERNALDATE FLAGS)", args.batch_size, 0, {});
+        bool succeeded = worker.client->sendPipelinedCommands(
+            commands, args.pipeline_depth,
+            [&infos](const std::string &line)
+            { Helpers::ParseFetchInfo(line, infos); },
+            [](const char *, size_t) {});
+        if (!succeeded)
+        {
+            report(std::cerr, "Error in server response: unable to retreive message sizes and dates");
+            return false;
+        }
+
+        // Messages expunged since the search are missing from the response and simply not fetched
+        std::vector<MessageInfo> messages;
+        size_t skipped = 0;
+        for (const auto &entry : infos)
+        {
+            const MessageInfo &info = entry.second;
+            if (!uids.contains(info.uid))
+            {
+                continue; // A flag change of another message
+            }
+
+            bool tooLarge = args.max_size > 0 && info.size > args.max_size;
+            bool tooOld = args.since > 0 && info.date != 0 && info.date < args.since;
+            bool tooNew = args.before > 0 && info.date != 0 && info.date >= args.before;
+            if (tooLarge || tooOld || tooNew)
+            {
+                ++skipped;
+            }
+            else
+            {
+                messages.push_back(info);
+            }
+        }
+
+        if (skipped > 0)
+        {
+            job.skipped += skipped;
+            report(std::cout, "Skipped " + std::to_string(skipped) + " messages outside the size and date limits in mailbox " + job.mailbox);
+        }
+
+        size_t batchBytes = args.batch_bytes;
+        if (args.fetch_order == ArgumentParser::FetchOrder::Packed && batchBytes == 0)
+        {
+            batchBytes = PACKED_BATCH_BYTES;
+        }
+        batches = Helpers::GetOrderedBatches(std::move(messages), args.fetch_order, args.batch_size, batchBytes);
+        return true;
+    }
+
+    /**
+     * @brief Select a mailbox, bring its sync state up to date and find out what is missing locally.
+     * @param worker The connection.
+     * @param job The mailbox.
+     * @return UIDSet The UIDs to download, empty if there is nothing to download or the mailbox failed.
+     */
+    UIDSet planMailbox(SyncWorker &worker, MailboxJob &job)
+    {
+        IMAPClient &client = *worker.client;
+        const std::string &mailbox = job.mailbox;
+        const std::string &mailboxFile = job.mailboxFile;
+
+        job.started = std::chrono::steady_clock::now();
+        job.storage = Storage::create(args.storage, args.outdir, mailboxFile, client.canonical_hostname, args.gzip);
+        if (!job.syncState) // Not kept from an earlier run
+        {
+            job.syncState = std::make_unique<SyncState>(args.outdir, mailboxFile, client.canonical_hostname);
+            Helpers::LoadSyncState(*job.syncState, args.outdir, *job.storage, args.rebuild_index);
+        }
+        SyncState &syncState = *job.syncState;
+        syncState.setDurable(args.fsync != ArgumentParser::FsyncPolicy::None);
+
+        // With CONDSTORE/QRESYNC (RFC 7162) an unchanged mailbox is synchronized by the SELECT alone
+        bool condstore = !args.new_only && client.hasCapability("CONDSTORE");
+        bool qresync = !args.new_only && enableQresync(worker);
+
+        std::string selectResponse = client.sendCommand(Helpers::GetSelectCommand(Helpers::QuoteString(mailbox), syncState, condstore, qresync));
+        worker.selected.clear();
+
+        if (!Helpers::HandleUIDValidity(mailboxFile, args.outdir, selectResponse, client.canonical_hostname, syncState, *job.storage))
+        {
+            return UIDSet();
+        }
+
+        worker.selected = mailbox;
+        job.uidValidity = syncState.getUIDValidity();
+
+        uint64_t knownModSeq = syncState.getHighestModSeq(); // Reset to 0 by a UIDVALIDITY change
+        uint64_t serverModSeq = Helpers::GetHighestModSeq(selectResponse);
+        job.serverModSeq = serverModSeq;
+
+        // With ESEARCH the server returns the UIDs as a sequence set instead of one by one
+        std::string searchCommand = client.hasCapability("ESEARCH") ? "UID SEARCH RETURN (ALL)" : "UID SEARCH";
+
+        UIDSet fetchUIDs;
+        if (args.new_only)
+        {
+            std::string searchResponse = client.sendCommand(searchCommand + " NEW");
+
+            // Check for errors in the search response
+            if (searchResponse.find("NO") != std::string::npos || searchResponse.find("BAD") != std::string::npos ||
+                !Helpers::GetMailServerUids(searchResponse, fetchUIDs))
+            {
+                report(std::cerr, "Error in server response: unable to retreive email UIDs");
+                return UIDSet();
+            }
+
+            if (fetchUIDs.empty())
+            {
+                report(std::cout, "No new messages found.");
+                job.stats.success = true;
+            }
+        }
+        else
+        {
+            UIDSet localUIDs = syncState.getFullEmails().unite(syncState.getHeadersOnly());
+            UIDSet serverUIDs;
+            UIDSet vanishedUIDs;
+
+            // Without QRESYNC an expunge need not change HIGHESTMODSEQ and is not reported by CHANGEDSINCE,
+            // so the vanished messages to prune are only found by listing all UIDs
+            bool expungesKnown = qresync || !args.prune_vanished;
+
+            if (knownModSeq != 0 && serverModSeq == knownModSeq && expungesKnown)
+            {
+                serverUIDs = localUIDs; // Nothing changed on the server since the last sync
+            }
+            else if (knownModSeq != 0 && serverModSeq != 0 && qresync)
+            {
+                // The SELECT reported the vanished UIDs and the changed messages, new ones included
+                if (!Helpers::GetVanishedUIDs(selectResponse, vanishedUIDs))
+                {
+                    report(std::cerr, "Error in server response: unable to retreive vanished email UIDs");
+                    return UIDSet();
+                }
+                vanishedUIDs = vanishedUIDs.intersect(localUIDs);
+                serverUIDs = localUIDs.subtract(vanishedUIDs).unite(Helpers::GetFetchedUIDs(selectResponse));
+            }
+            else if (knownModSeq != 0 && serverModSeq != 0 && condstore && expungesKnown)
+            {
+                std::string changedResponse = client.sendCommand("UID FETCH 1:* (UID) (CHANGEDSINCE " + std::to_string(knownModSeq) + ")");
+                serverUIDs = localUIDs.unite(Helpers::GetFetchedUIDs(changedResponse));
+            }
+            else
+            {
+                std::string uidFetch = searchCommand + " ALL";
+                std::string uidResponse = client.sendCommand(uidFetch);
+                if (!Helpers::IsStatusOK(Helpers::GetStatusLine(uidResponse)) || !Helpers::GetMailServerUids(uidResponse, serverUIDs))
+                {
+                    report(std::cerr, "Error in server response: unable to retreive email UIDs");
+                    return UIDSet();
+                }
+                vanishedUIDs = localUIDs.subtract(serverUIDs);
+            }
+
+            if (!vanishedUIDs.empty())
+            {
+                job.stats.vanished = vanishedUIDs.size();
+                std::string message = std::to_string(vanishedUIDs.size()) + " downloaded messages no longer exist in mailbox " + mailbox;
+                if (args.prune_vanished)
+                {
+                    job.storage->remove(vanishedUIDs);
+                    syncState.removeMessages(vanishedUIDs);
+                    message += ", removed their local copies";
+                }
+                report(std::cout, message + ": " + vanishedUIDs.toString());
+            }
+
+            fetchUIDs = Helpers::GetSynchronizingUIDs(args.headers_only, !args.part_types.empty(), syncState, serverUIDs);
+
+            if (fetchUIDs.empty())
+            {
+                syncState.setHighestModSeq(serverModSeq);
+                syncState.save();
+
+                report(std::cerr, "No new messages to synchronize.");
+                job.stats.success = true;
+            }
+        }
+
+        return fetchUIDs;
+    }
+
+    /**
+     * @brief Select a planned mailbox on a connection unless it is selected there already.
+     * @param worker The connection.
+     * @param job The mailbox.
+     * @return true if the mailbox is selected with the planned UIDVALIDITY, false otherwise.
+     */
+    bool selectPlanned(SyncWorker &worker, MailboxJob &job)
+    {
+        if (worker.selected == job.mailbox)
+        {
+            return true;
+        }
+
+        worker.selected.clear();
+        std::string selectResponse = worker.client->sendCommand("SELECT " + Helpers::QuoteString(job.mailbox));
+
+        if (!Helpers::IsStatusOK(Helpers::GetStatusLine(selectResponse)))
+        {
+            report(std::cerr, "Error: Unable to select mailbox " + job.mailbox + ": " + Helpers::GetStatusLine(selectResponse));
+            return false;
+        }
+        if (Helpers::GetUIDValidity(selectResponse) != job.uidValidity)
+        {
+            report(std::cerr, "Error: UIDVALIDITY of mailbox " + job.mailbox + " changed during synchronization.");
+            return false;
+        }
+
+        worker.selected = job.mailbox;
+        return true;
+    }
+
+    /**
+     * @brief Download a part of a planned mailbox, selecting the mailbox first if the connection
+     * has another one selected.
+     *
+     * @param worker The connection.
+     * @param job The mailbox.
+     * @param batches The batches of UIDs to download, in order.
+     * @param downloaded The number of messages saved, also when the connection is lost.
+     * @return true if every batch of the part completed, false otherwise.
+     */
+    bool fetchPart(SyncWorker &worker, MailboxJob &job, const std::vector<UIDSet> &batches, int &downloaded)
+    {
+        IMAPClient &client = *worker.client;
+
+        if (!selectPlanned(worker, job))
+        {
+            return false;
+        }
+
+        // Stream the responses so that message bodies go straight to their files
+        FetchHandler fetchHandler(*job.storage, args.headers_only, *job.syncState, args.fsync, blobStore.get());
+        auto send = [&](const std::vector<std::string> &commands)
+        {
+            return client.sendPipelinedCommands(
+                commands, args.pipeline_depth,
+                [&fetchHandler](const std::string &line)
+                { fetchHandler.onLine(line); },
+                [&fetchHandler](const char *data, size_t length)
+                { fetchHandler.onLiteral(data, length); },
+                [&fetchHandler]()
+                {
+                    // Every completed batch is persisted at once, after its messages are on disk
+                    fetchHandler.flush();
+                },
+                [&fetchHandler]()
+                { return fetchHandler.literalFile(); });
+        };
+
+        // Large messages are fetched in chunks, an interrupted one continues from its partial file
+        size_t chunkSize = args.headers_only ? 0 : args.chunk_size;
+        std::map<uint32_t, uint64_t> partials;
+        if (chunkSize > 0)
+        {
+            std::string partialPrefix = args.outdir + "/.partial/" + client.canonical_hostname + "_" + job.mailboxFile + "_" +
+                                        std::to_string(job.uidValidity) + "_";
+            fetchHandler.setChunks(chunkSize, partialPrefix);
+
+            UIDSet uids;
+            for (const UIDSet &batch : batches)
+            {
+                uids = uids.unite(batch);
+            }
+            partials = Helpers::GetPartialDownloads(partialPrefix, uids);
+        }
+
+        std::vector<uint32_t> resumedUIDs;
+        for (const auto &partial : partials)
+        {
+            resumedUIDs.push_back(partial.first);
+        }
+        UIDSet resumed = UIDSet::fromUIDs(std::move(resumedUIDs));
+
+        // With --parts, the messages with parts to skip are fetched section by section after the others
+        std::vector<std::string> partCommands;
+        std::vector<uint32_t> partUIDs;
+        if (!args.part_types.empty())
+        {
+            BodyStructure::Collector collector;
+            std::vector<std::string> structureCommands;
+            for (const UIDSet &batch : batches)
+            {
+                UIDSet structureUIDs = batch.subtract(resumed);
+                if (!structureUIDs.empty())
+                {
+                    structureCommands.push_back("UID FETCH " + structureUIDs.toString() + " (UID BODYSTRUCTURE)");
+                }
+            }
+            client.sendPipelinedCommands(
+                structureCommands, args.pipeline_depth,
+                [&collector](const std::string &line)
+                { collector.onLine(line); },
+                [&collector](const char *data, size_t length)
+                { collector.onLiteral(data, length); });
+
+            // A message without a known structure is fetched whole
+            for (auto &structure : collector.structures)
+            {
+                if (structure.second.select(args.part_types, args.max_part_size))
+                {
+                    fetchHandler.expectParts(structure.first, structure.second);
+                    partCommands.push_back("UID FETCH " + std::to_string(structure.first) + " " + structure.second.getFetchItems());
+                    partUIDs.push_back(structure.first);
+                }
+            }
+        }
+        UIDSet separateUIDs = resumed.unite(UIDSet::fromUIDs(std::move(partUIDs)));
+
+        std::vector<std::string> fetchCommands;
+        std::string items = Helpers::GetFetchItems(args.headers_only, chunkSize);
+        for (const UIDSet &batch : batches)
+        {
+            UIDSet fetchUIDs = batch.subtract(separateUIDs);
+            if (!fetchUIDs.empty())
+            {
+                fetchCommands.push_back("UID FETCH " + fetchUIDs.toString() + " " + items);
+            }
+        }
+        fetchCommands.insert(fetchCommands.end(), partCommands.begin(), partCommands.end());
+        bool fetchSucceeded = false;
+        try
+        {
+            fetchSucceeded = send(fetchCommands);
+
+            // The rest of every large message, one chunk after another
+            std::deque<std::pair<uint32_t, uint64_t>> incomplete(partials.begin(), partials.end());
+            for (const auto &partial : fetchHandler.takeIncomplete())
+            {
+                incomplete.push_back(partial);
+            }
+            while (fetchSucceeded && !incomplete.empty())
+            {
+                std::pair<uint32_t, uint64_t> partial = incomplete.front();
+                incomplete.pop_front();
+
+                fetchHandler.resume(partial.first);
+                fetchSucceeded = send({"UID FETCH " + std::to_string(partial.first) + " " +
+                                       Helpers::GetFetchItems(false, chunkSize, partial.second)});
+                for (const auto &next : fetchHandler.takeIncomplete())
+                {
+                    incomplete.push_front(next);
+                }
+            }
+        }
+        catch (const IMAPClient::ConnectionError &)
+        {
+            // The messages saved before the connection was lost are complete, keep them
+            fetchHandler.flush();
+            downloaded = fetchHandler.getSavedCount();
+            throw;
+        }
+
+        // So are the messages saved before a command failed
+        fetchHandler.flush();
+        downloaded = fetchHandler.getSavedCount();
+
+        // A message that was not saved is not in the sync state, so HIGHESTMODSEQ must not move past it
+        if (fetchHandler.getFailedCount() > 0)
+        {
+            report(std::cerr, "Error: " + std::to_string(fetchHandler.getFailedCount()) + " messages of mailbox " + job.mailbox +
+                                  " could not be saved.");
+            return false;
+        }
+        return fetchSucceeded;
+    }
+
+    /**
+     * @brief Record a downloaded part of a mailbox. The connection finishing the last part
+     * saves the sync state and reports the mailbox.
+     *
+     * @param job The mailbox.
+     * @param success Whether the part was downloaded completely.
+     * @param downloaded The number of messages saved.
+     */
+    void finishPart(MailboxJob &job, bool success, int downloaded)
+    {
+        job.stats.downloaded += downloaded;
+        job.fetchFailed = job.fetchFailed || !success;
+        if (--job.pendingParts > 0)
+        {
+            return;
+        }
+
+        // The mailbox is only in sync up to HIGHESTMODSEQ once every batch has arrived and nothing was left out
+        if (!job.fetchFailed && !args.new_only && job.skipped == 0)
+        {
+            job.syncState->setHighestModSeq(job.serverModSeq);
+        }
+        job.syncState->save();
+
+        job.stats.success = !job.fetchFailed;
+        job.stats.seconds = secondsSince(job.started);
+
+        if (job.fetchFailed)
+        {
+            return;
+        }
+
+        std::string downloadedCount = std::to_string(job.stats.downloaded);
+        const std::string &mailbox = job.mailbox;
+
+        if (args.headers_only && args.new_only)
+        {
+            report(std::cout, "Downloaded " + downloadedCount + " new messages (headers only) from mailbox " + mailbox);
+        }
+        else if (args.headers_only)
+        {
+            report(std::cout, "Downloaded " + downloadedCount + " messages (headers only) from mailbox " + mailbox);
+        }
+        else if (args.new_only)
+        {
+            report(std::cout, "Downloaded " + downloadedCount + " new messages from mailbox " + mailbox);
+        }
+        else
+        {
+            report(std::cout, "Downloaded " + downloadedCount + " messages from mailbox " + mailbox);
+        }
+    }
+
+public:
+    /**
+     * @brief Constructs a Synchronizer.
+     * @param client The logged in client.
+     * @param args The program arguments.
+     * @param login The arguments of the LOGIN command, used to open more connections.
+     */
+    Synchronizer(IMAPClient &client, const ArgumentParser::ParsedArgs &args, const std::string &login)
+        : client(&client), loop(client.getEventLoop()), args(args), login(login), stateCache(nullptr),
+          blobStore(args.dedup_dir.empty() ? nullptr : std::make_unique<BlobStore>(args.dedup_dir)),
+          deadline(std::chrono::steady_clock::time_point::max()), runningTasks(0) {}
+
+    /**
+     * @brief Open and log in a connection to the server.
+     * @param args The program arguments.
+     * @param login The arguments of the LOGIN command.
+     * @param loop The event loop driving the connection, nullptr to create one for it.
+     * @return std::unique_ptr<IMAPClient> The connection, nullptr if it could not be opened.
+     */
+    static std::unique_ptr<IMAPClient> openConnection(const ArgumentParser::ParsedArgs &args, const std::string &login,
+                                                      EventLoop *loop = nullptr)
+    {
+        auto connection = std::make_unique<IMAPClient>(args.use_tls, loop);
+
+        IMAPClient::ConnectionOptions options;
+        options.connectTimeout = args.connect_timeout;
+        options.readTimeout = args.read_timeout;
+        options.readBufferSize = args.read_buffer;
+        options.receiveBuffer = args.receive_buffer;
+        options.sendBuffer = args.send_buffer;
+        options.noDelay = args.tcp_nodelay;
+        options.keepAlive = args.keepalive;
+
+        if (!connection->connect(args.server, args.port, args.certfile, args.certaddr, options))
+        {
+            return nullptr;
+        }
+
+        try
+        {
+            if (!Helpers::HandleLoginResponse(connection->sendCommand("LOGIN " + login)))
+            {
+                connection->disconnect();
+                return nullptr;
+            }
+
+            if (args.compress == ArgumentParser::CompressPolicy::Always ||
+                (args.compress == ArgumentParser::CompressPolicy::Tls && args.use_tls))
+            {
+                connection->startCompression();
+            }
+        }
+        catch (const IMAPClient::ConnectionError &)
+        {
+            return nullptr;
+        }
+
+        return connection;
+    }
+
+    /**
+     * @brief Keep the sync states of the mailboxes in memory between runs, so a long-running
+     * process does not read them from the output directory again. Only the states of
+     * successfully synchronized mailboxes are kept, the others are loaded again.
+     *
+     * @param states The sync states by mailbox file name, owned by the caller.
+     */
+    void keepStates(std::map<std::string, std::unique_ptr<SyncState>> &states)
+    {
+        stateCache = &states;
+    }
+
+    /**
+     * @brief Get the mailboxes to synchronize. Names with the LIST wildcards "*" and "%" are
+     * expanded by the server, with --subscribed all subscribed mailboxes are added.
+     *
+     * @return std::vector<std::string> The selectable mailboxes, each one only once.
+     */
+    std::vector<std::string> listMailboxes()
+    {
+        std::vector<std::string> patterns;
+        std::vector<std::string> mailboxes;
+
+        for (const std::string &mailbox : args.mailboxes)
+        {
+            if (mailbox.find_first_of("*%") != std::string::npos)
+            {
+                patterns.push_back("LIST \"\" " + Helpers::QuoteString(mailbox));
+            }
+            else
+            {
+                mailboxes.push_back(mailbox);
+            }
+        }
+
+        if (args.subscribed)
+        {
+            patterns.push_back("LSUB \"\" \"*\"");
+        }
+
+        for (const std::string &command : patterns)
+        {
+            std::string response = client->sendCommand(command);
+            if (!Helpers::IsStatusOK(Helpers::GetStatusLine(response)))
+            {
+                std::cerr << "Error: Failed to list mailboxes: " << Helpers::GetStatusLine(response) << std::endl;
+                continue;
+            }
+
+            std::vector<std::string> listed = Helpers::ParseListResponse(response);
+            mailboxes.insert(mailboxes.end(), listed.begin(), listed.end());
+        }
+
+        // Keep the order, drop duplicates
+        std::vector<std::string> unique;
+        for (const std::string &mailbox : mailboxes)
+        {
+            if (std::find(unique.begin(), unique.end(), mailbox) == unique.end())
+            {
+                unique.push_back(mailbox);
+            }
+        }
+
+        return unique;
+    }
+
+    /**
+     * @brief Synchronize mailboxes over the logged in client and the additional connections
+     * requested by --connections.
+     *
+     * @param mailboxes The mailbox names as known to the server.
+     * @return std::vector<MailboxStats> The statistics of the mailboxes in the given order.
+     */
+    std::vector<MailboxStats> run(const std::vector<std::string> &mailboxes)
+    {
+        std::vector<std::unique_ptr<MailboxJob>> jobs;
+        for (const std::string &mailbox : mailboxes)
+        {
+            jobs.push_back(std::make_unique<MailboxJob>());
+            jobs.back()->mailbox = mailbox;
+            jobs.back()->mailboxFile = Helpers::GetMailboxFileName(mailbox);
+            jobs.back()->stats.mailbox = mailbox;
+
+            if (stateCache)
+            {
+                auto cached = stateCache->find(jobs.back()->mailboxFile);
+                if (cached != stateCache->end())
+                {
+                    jobs.back()->syncState = std::move(cached->second);
+                    stateCache->erase(cached);
+                }
+            }
+        }
+
+        // The time limit covers this run only, the connections are used without one afterwards
+        deadline = args.total_timeout > 0 ? std::chrono::steady_clock::now() + std::chrono::seconds(args.total_timeout)
+                                          : std::chrono::steady_clock::time_point::max();
+        client->setDeadline(deadline);
+
+        workers.clear();
+        workers.emplace_back();
+        workers.back().client = client;
+
+        while (workers.size() < args.connections)
+        {
+            std::unique_ptr<IMAPClient> connection = openConnection(args, login, &loop);
+            if (!connection)
+            {
+                std::cerr << "Warning: Continuing with " << workers.size() << " connections." << std::endl;
+                break;
+            }
+            connection->setDeadline(deadline);
+
+            workers.emplace_back();
+            workers.back().client = connection.get();
+            workers.back().owned = std::move(connection);
+        }
+
+        // Spread the mailboxes, the connections steal the rest of the work from each other
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+            workers[i % workers.size()].tasks.push_back({jobs[i].get(), true, {}});
+        }
+
+        size_t finished = 0;
+        for (size_t id = 1; id < workers.size(); ++id)
+        {
+            loop.spawn([this, id, &finished]()
+                       {
+                           workLoop(id);
+                           ++finished; });
+        }
+        workLoop(0);
+
+        loop.runUntil([this, &finished]()
+                      { return finished == workers.size() - 1; }, -1, -1);
+
+        deadline = std::chrono::steady_clock::time_point::max();
+        client->setDeadline(deadline);
+        for (SyncWorker &worker : workers)
+        {
+            if (worker.owned)
+            {
+                worker.owned->setDeadline(deadline);
+                worker.owned->logout();
+            }
+        }
+        workers.clear();
+
+        std::vector<MailboxStats> results;
+        for (const auto &job : jobs)
+        {
+            results.push_back(job->stats);
+
+            if (stateCache && job->stats.success && job->syncState)
+            {
+                (*stateCache)[job->mailboxFile] = std::move(job->syncState);
+            }
+        }
+
+        return results;
+    }
+
+    /**
+     * @brief Synchronize a mailbox and keep it in sync with IDLE (RFC 2177) until stop() holds.
+     * Whenever the server reports new messages, only the UIDs above the highest one downloaded
+     * are searched for and downloaded over the logged in client. A lost connection is opened again,
+     * and the messages that arrived meanwhile are downloaded at once.
+     *
+     * @param mailbox The mailbox.
+     * @param stop Condition that ends the watch, checked at least once a second.
+     * @return true if the mailbox was kept in sync until stop() held, false otherwise.
+     */
+    bool watch(const std::string &mailbox, const std::function<bool()> &stop)
+    {
+        bool idleSupported = false;
+        try
+        {
+            idleSupported = client->hasCapability("IDLE");
+        }
+        catch (const IMAPClient::ConnectionError &)
+        {
+            return false;
+        }
+        if (!idleSupported)
+        {
+            std::cerr << "Error: The server does not support IDLE." << std::endl;
+            return false;
+        }
+
+        // The initial run may use the whole pool, its sync state is handed over to the watch
+        std::map<std::string, std::unique_ptr<SyncState>> states;
+        if (!stateCache)
+        {
+            keepStates(states);
+        }
+
+        std::vector<MailboxStats> results = run({mailbox});
+        if (results.empty() || !results.front().success)
+        {
+            return false;
+        }
+
+        MailboxJob job;
+        job.mailbox = mailbox;
+        job.mailboxFile = Helpers::GetMailboxFileName(mailbox);
+        job.stats.mailbox = mailbox;
+        job.syncState = std::move((*stateCache)[job.mailboxFile]);
+        if (!job.syncState)
+        {
+            return false;
+        }
+        job.storage = Storage::create(args.storage, args.outdir, job.mailboxFile, client->canonical_hostname, args.gzip);
+        job.uidValidity = job.syncState->getUIDValidity();
+        job.serverModSeq = job.syncState->getHighestModSeq();
+
+        workers.emplace_back();
+        workers.back().client = client;
+        SyncWorker &worker = workers.back();
+
+        std::string searchCommand = client->hasCapability("ESEARCH") ? "UID SEARCH RETURN (ALL)" : "UID SEARCH";
+        bool success = true;
+        bool reconnected = false;
+        int failures = 0;
+
+        while (success && !stop())
+        {
+            bool lost = false;
+            try
+            {
+                if (!selectPlanned(worker, job))
+                {
+                    success = false;
+                    break;
+                }
+
+                // Messages may have arrived while the connection was down, look for them without waiting
+                bool changed = reconnected;
+                reconnected = false;
+                if (!changed)
+                {
+                    std::string status;
+                    changed = worker.client->idle(stop, status);
+                    if (!Helpers::IsStatusOK(status))
+                    {
+                        report(std::cerr, "Error: IDLE failed: " + status);
+                        success = false;
+                        break;
+                    }
+                    failures = 0;
+                }
+                if (!changed)
+                {
+                    continue; // Renew the IDLE before the server times it out
+                }
+
+                // "n:*" always matches the last message, even when its UID is below n
+                UIDSet known = job.syncState->getFullEmails().unite(job.syncState->getHeadersOnly());
+                uint32_t next = known.empty() ? 1 : known.getRanges().back().second + 1;
+                UIDSet above;
+                above.addRange(next, UINT32_MAX);
+
+                std::string searchResponse = worker.client->sendCommand(searchCommand + " UID " + std::to_string(next) + ":*");
+                UIDSet newUIDs;
+                if (!Helpers::IsStatusOK(Helpers::GetStatusLine(searchResponse)) || !Helpers::GetMailServerUids(searchResponse, newUIDs))
+                {
+                    report(std::cerr, "Error in server response: unable to retreive email UIDs");
+                    success = false;
+                    break;
+                }
+
+                newUIDs = newUIDs.intersect(above);
+                if (newUIDs.empty())
+                {
+                    continue;
+                }
+
+                job.started = std::chrono::steady_clock::now();
+                job.stats.downloaded = 0;
+                job.pendingParts = 1;
+                job.fetchFailed = false;
+                job.skipped = 0;
+
+                std::vector<UIDSet> batches;
+                if (!planFetches(worker, job, newUIDs, batches))
+                {
+                    success = false;
+                    break;
+                }
+                if (batches.empty())
+                {
+                    continue;
+                }
+
+                int downloaded = 0;
+                bool fetched = fetchPart(worker, job, batches, downloaded);
+                finishPart(job, fetched, downloaded);
+                success = fetched;
+            }
+            catch (const IMAPClient::ConnectionError &)
+            {
+                lost = true; // Reconnecting waits in the event loop, which must not happen inside the handler
+            }
+
+            if (lost)
+            {
+                success = reconnect(worker, failures);
+                reconnected = true;
+            }
+        }
+
+        workers.clear();
+        (*stateCache)[job.mailboxFile] = std::move(job.syncState);
+        if (stateCache == &states)
+        {
+            stateCache = nullptr;
+        }
+        return success;
+    }
+
+    /**
+     * @brief Log out the logged in client, or the connection that replaced it.
+     */
+    void logout()
+    {
+        client->logout();
+    }
+
+    /**
+     * @brief Print a summary of the synchronized mailboxes when there was more than one.
+     * @param results The statistics of the mailboxes.
+     * @return true if every mailbox was synchronized, false otherwise.
+     */
+    static bool printSummary(const std::vector<MailboxStats> &results)
+    {
+        bool success = true;
+        for (const MailboxStats &stats : results)
+        {
+            success = success && stats.success;
+        }
+
+        if (results.size() < 2)
+        {
+            return success;
+        }
+
+        std::cout << "Summary:" << std::endl;
+        for (const MailboxStats &stats : results)
+        {
+            std::cout << "  " << stats.mailbox << ": " << (stats.success ? "OK" : "FAILED") << ", " << stats.downloaded
+                      << " downloaded, " << stats.vanished << " vanished, " << std::fixed << std::setprecision(2)
+                      << stats.seconds << " s" << std::endl;
+        }
+
+        return success;
+    }
+};
+
+#endif
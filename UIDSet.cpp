@@ -0,0 +1,359 @@
+/**
+ * @file UIDSet.cpp
+ * @author Milan Jakubec (xjakub41)
+ * @date 2024-11-15
+ * @brief A file implementing a set of message UIDs stored as sorted ranges.
+ */
+
+#ifndef UIDSET_CPP
+#define UIDSET_CPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+
+/**
+ * @class UIDSet
+ * @brief A set of message UIDs stored as sorted, disjoint and non-adjacent ranges.
+ *
+ * The set converts to and from the IMAP sequence-set syntax ("1:90000,90005,90010:90020"),
+ * so its size grows with the number of gaps between the UIDs, not with the number of UIDs.
+ */
+class UIDSet
+{
+private:
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // Inclusive ranges in ascending order
+
+    /**
+     * @brief Convert a number of a sequence set to a UID.
+     * @param number The decimal digits of the number.
+     * @return uint32_t The UID.
+     * @exception std::out_of_range if the number is 0 or does not fit in 32 bits.
+     */
+    static uint32_t toUID(const std::string &number)
+    {
+        unsigned long long uid = std::stoull(number);
+        if (uid == 0 || uid > UINT32_MAX)
+        {
+            throw std::out_of_range("Invalid UID: " + number);
+        }
+        return static_cast<uint32_t>(uid);
+    }
+
+public:
+    /**
+     * @brief Parse a set from the IMAP sequence-set syntax. The "*" wildcard is not accepted,
+     * as it has no meaning outside of the server.
+     *
+     * @param sequenceSet The sequence set, e.g. "1:5,7,9:12".
+     * @return UIDSet The parsed set.
+     * @exception std::invalid_argument if the sequence set is malformed.
+     * @exception std::out_of_range if a number in it is not a valid UID.
+     */
+    static UIDSet parse(const std::string &sequenceSet)
+    {
+        UIDSet set;
+        size_t pos = 0;
+
+        while (pos < sequenceSet.size())
+        {
+            size_t end = sequenceSet.find(',', pos);
+            if (end == std::string::npos)
+            {
+                end = sequenceSet.size();
+            }
+
+            std::string item = sequenceSet.substr(pos, end - pos);
+            size_t colon = item.find(':');
+            std::string first = item.substr(0, colon);
+            std::string last = colon == std::string::npos ? first : item.substr(colon + 1);
+
+            if (first.empty() || last.empty() || first.find_first_not_of("0123456789") != std::string::npos ||
+                last.find_first_not_of("0123456789") != std::string::npos)
+            {
+                throw std::invalid_argument("Invalid sequence set: " + sequenceSet);
+            }
+
+            uint32_t a = toUID(first);
+            uint32_t b = toUID(last);
+            set.addRange(std::min(a, b), std::max(a, b)); // "5:1" is the same as "1:5"
+
+            pos = end + 1;
+        }
+
+        return set;
+    }
+
+    /**
+     * @brief Build a set from UIDs given in any order. Sorting them first takes O(n log n),
+     * adding them one by one in random order could take O(n^2).
+     *
+     * @param uids The UIDs, duplicates allowed.
+     * @return UIDSet The set of the UIDs.
+     */
+    static UIDSet fromUIDs(std::vector<uint32_t> uids)
+    {
+        UIDSet set;
+        std::sort(uids.begin(), uids.end());
+
+        for (uint32_t uid : uids)
+        {
+            set.add(uid);
+        }
+
+        return set;
+    }
+
+    /**
+     * @brief Add a single UID to the set. Adding UIDs in ascending order takes constant time.
+     * @param uid The UID to add.
+     */
+    void add(uint32_t uid)
+    {
+        addRange(uid, uid);
+    }
+
+    /**
+     * @brief Add an inclusive range of UIDs to the set. Appending takes constant time, adding
+     * below the last range a binary search and at most one move of the ranges after it.
+     * @param first The first UID of the range.
+     * @param last The last UID of the range.
+     */
+    void addRange(uint32_t first, uint32_t last)
+    {
+        // Fast path for ranges appended in ascending order
+        if (ranges.empty() || (ranges.back().second != UINT32_MAX && first > ranges.back().second + 1))
+        {
+            ranges.emplace_back(first, last);
+            return;
+        }
+        if (first >= ranges.back().first)
+        {
+            ranges.back().second = std::max(ranges.back().second, last);
+            return;
+        }
+
+        // The ranges the new one overlaps or touches, found by binary search and merged in place
+        auto begin = std::lower_bound(ranges.begin(), ranges.end(), first, [](const std::pair<uint32_t, uint32_t> &range, uint32_t uid)
+                                      { return static_cast<uint64_t>(range.second) + 1 < uid; });
+        auto end = std::upper_bound(begin, ranges.end(), last, [](uint32_t uid, const std::pair<uint32_t, uint32_t> &range)
+                                    { return static_cast<uint64_t>(uid) + 1 < range.first; });
+        if (begin == end)
+        {
+            ranges.emplace(begin, first, last);
+            return;
+        }
+
+        begin->first = std::min(begin->first, first);
+        begin->second = std::max(std::prev(end)->second, last);
+        ranges.erase(std::next(begin), end);
+    }
+
+    /**
+     * @brief Check whether the set contains a UID.
+     * @param uid The UID to look for.
+     * @return true if the UID is in the set, false otherwise.
+     */
+    bool contains(uint32_t uid) const
+    {
+        size_t low = 0;
+        size_t high = ranges.size();
+
+        while (low < high)
+        {
+            size_t middle = (low + high) / 2;
+            if (ranges[middle].second < uid)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        return low < ranges.size() && ranges[low].first <= uid;
+    }
+
+    /**
+     * @brief Check whether the set is empty.
+     * @return true if the set contains no UIDs.
+     */
+    bool empty() const
+    {
+        return ranges.empty();
+    }
+
+    /**
+     * @brief Get the number of UIDs in the set.
+     * @return The number of UIDs.
+     */
+    size_t size() const
+    {
+        size_t count = 0;
+        for (const auto &range : ranges)
+        {
+            count += static_cast<size_t>(range.second - range.first) + 1;
+        }
+        return count;
+    }
+
+    /**
+     * @brief Get the ranges of the set.
+     * @return The inclusive ranges in ascending order.
+     */
+    const std::vector<std::pair<uint32_t, uint32_t>> &getRanges() const
+    {
+        return ranges;
+    }
+
+    /**
+     * @brief Get the union of this set and another set in linear time.
+     * @param other The other set.
+     * @return UIDSet The UIDs in either set.
+     */
+    UIDSet unite(const UIDSet &other) const
+    {
+        UIDSet result;
+        size_t i = 0;
+        size_t j = 0;
+
+        while (i < ranges.size() || j < other.ranges.size())
+        {
+            // Take the range that starts first and merge it into the result
+            const auto &next = (j >= other.ranges.size() || (i < ranges.size() && ranges[i].first <= other.ranges[j].first))
+                                   ? ranges[i++]
+                                   : other.ranges[j++];
+
+            if (!result.ranges.empty() && (result.ranges.back().second == UINT32_MAX || next.first <= result.ranges.back().second + 1))
+            {
+                result.ranges.back().second = std::max(result.ranges.back().second, next.second);
+            }
+            else
+            {
+                result.ranges.push_back(next);
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * @brief Get the difference of this set and another set in linear time.
+     * @param other The set of UIDs to remove.
+     * @return UIDSet The UIDs of this set that are not in the other set.
+     */
+    UIDSet subtract(const UIDSet &other) const
+    {
+        UIDSet result;
+        size_t j = 0;
+
+        for (const auto &range : ranges)
+        {
+            uint64_t first = range.first; // 64 bits so that last + 1 cannot overflow
+
+            // Skip the removed ranges that end before this one
+            while (j < other.ranges.size() && other.ranges[j].second < first)
+            {
+                ++j;
+            }
+
+            size_t k = j;
+            while (first <= range.second && k < other.ranges.size() && other.ranges[k].first <= range.second)
+            {
+                if (other.ranges[k].first > first)
+                {
+                    result.ranges.emplace_back(first, other.ranges[k].first - 1);
+                }
+                first = static_cast<uint64_t>(other.ranges[k].second) + 1;
+                ++k;
+            }
+
+            if (first <= range.second)
+            {
+                result.ranges.emplace_back(first, range.second);
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * @brief Get the intersection of this set and another set in linear time.
+     * @param other The other set.
+     * @return UIDSet The UIDs in both sets.
+     */
+    UIDSet intersect(const UIDSet &other) const
+    {
+        return subtract(subtract(other));
+    }
+
+    /**
+     * @brief Split the set into consecutive parts of at most the given number of UIDs.
+     * @param maxSize The maximum number of UIDs in one part, must be positive.
+     * @return std::vector<UIDSet> The parts in ascending order of their UIDs.
+     */
+    std::vector<UIDSet> split(size_t maxSize) const
+    {
+        std::vector<UIDSet> parts;
+        UIDSet part;
+        size_t partSize = 0;
+
+        for (const auto &range : ranges)
+        {
+            uint64_t first = range.first;
+            while (first <= range.second)
+            {
+                // Take as much of the range as fits into the current part
+                uint64_t last = std::min<uint64_t>(range.second, first + (maxSize - partSize) - 1);
+                part.ranges.emplace_back(first, last);
+                partSize += last - first + 1;
+                first = last + 1;
+
+                if (partSize == maxSize)
+                {
+                    parts.push_back(std::move(part));
+                    part = UIDSet();
+                    partSize = 0;
+                }
+            }
+        }
+
+        if (partSize > 0)
+        {
+            parts.push_back(std::move(part));
+        }
+
+        return parts;
+    }
+
+    /**
+     * @brief Format the set in the IMAP sequence-set syntax.
+     * @return std::string The sequence set, empty for an empty set.
+     */
+    std::string toString() const
+    {
+        std::string result;
+
+        for (const auto &range : ranges)
+        {
+            if (!result.empty())
+            {
+                result += ",";
+            }
+
+            result += std::to_string(range.first);
+            if (range.second != range.first)
+            {
+                result += ":" + std::to_string(range.second);
+            }
+        }
+
+        return result;
+    }
+};
+
+#endif